@@ -74,6 +74,23 @@ workspace "Monte Carlo Ray Tracer"
         
     filter{}
 
+    -- Intersection kernels are compiled once per instruction set, the best one supported by the CPU is picked at startup (source/core/kernels.h)
+    -- No FMA contraction, so every instruction set reports the same distances
+    if os.host() == "windows" then
+        filter { "files:" .. source_folder .. "core/kernels_avx2.cpp" }
+            buildoptions { "/arch:AVX2" }
+        filter { "files:" .. source_folder .. "core/kernels_avx512.cpp" }
+            buildoptions { "/arch:AVX512" }
+    else
+        filter { "files:" .. source_folder .. "core/kernels_sse42.cpp" }
+            buildoptions { "-msse4.2", "-ffp-contract=off" }
+        filter { "files:" .. source_folder .. "core/kernels_avx2.cpp" }
+            buildoptions { "-mavx2", "-ffp-contract=off" }
+        filter { "files:" .. source_folder .. "core/kernels_avx512.cpp" }
+            buildoptions { "-mavx512f", "-ffp-contract=off" }
+    end
+    filter{}
+
 
 project "Main Application"
     kind "ConsoleApp"
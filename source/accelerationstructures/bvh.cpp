@@ -0,0 +1,455 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#include "bvh.h"
+
+#include <algorithm>
+#include <numeric>
+
+void BVH::Build(const std::vector<AABB>& primitiveBounds)
+{
+	Clear();
+	if (primitiveBounds.empty()) return;
+
+	primitiveCount = (unsigned int)primitiveBounds.size();
+	if (builder == BVHBuilder::Linear) BuildLinear(primitiveBounds);
+	else if (builder == BVHBuilder::Spatial) BuildSpatial(primitiveBounds);
+	else BuildBinnedSAH(primitiveBounds);
+
+	builtCost = SAHCost();
+
+	if (compressed)
+	{
+		bool success = (width == 8) ? Compress(compressedNodes8) : Compress(compressedNodes4);
+		if (success)
+		{
+			// Traversal only needs the root bounds from the binary tree
+			nodes.resize(1);
+			nodes.shrink_to_fit();
+			return;
+		}
+
+		// A leaf too large for the compact leaf references, keep the uncompressed layout
+		compressedNodes4.clear();
+		compressedNodes8.clear();
+	}
+
+	if (stackless) BuildParentLinks();
+	else if (width == 8) Collapse(wideNodes8, 0);
+	else if (width == 4) Collapse(wideNodes4, 0);
+}
+
+void BVH::BuildBinnedSAH(const std::vector<AABB>& primitiveBounds)
+{
+	primitiveIndices.resize(primitiveCount);
+	std::iota(primitiveIndices.begin(), primitiveIndices.end(), 0);
+
+	std::vector<vec3> centroids(primitiveCount);
+	for (unsigned int i = 0; i < primitiveCount; ++i)
+	{
+		centroids[i] = primitiveBounds[i].Centroid();
+	}
+
+	nodes.reserve(2 * primitiveCount - 1);
+	nodes.emplace_back();
+	nodes[0].leftFirst = 0;
+	nodes[0].count = primitiveCount;
+	UpdateNodeBounds(nodes[0], primitiveBounds);
+
+	Subdivide(0, primitiveBounds, centroids, 0);
+	nodes.shrink_to_fit();
+}
+
+void BVH::Clear()
+{
+	nodes.clear();
+	wideNodes4.clear();
+	wideNodes8.clear();
+	compressedNodes4.clear();
+	compressedNodes8.clear();
+	primitiveIndices.clear();
+	parentLinks.clear();
+	primitiveCount = 0;
+}
+
+void BVH::Refit(const std::vector<AABB>& primitiveBounds)
+{
+	if (nodes.empty() || IsCompressed() || primitiveBounds.size() != primitiveCount)
+	{
+		Build(primitiveBounds);
+		return;
+	}
+
+	// Both builders store children after their parent, a reverse sweep visits the children first
+	for (size_t i = nodes.size(); i-- > 0;)
+	{
+		BVHNode& node = nodes[i];
+		if (node.IsLeaf())
+		{
+			UpdateNodeBounds(node, primitiveBounds);
+		}
+		else
+		{
+			const BVHNode& left = nodes[node.leftFirst];
+			const BVHNode& right = nodes[node.leftFirst + 1];
+			node.min = glm::min(left.min, right.min);
+			node.max = glm::max(left.max, right.max);
+		}
+	}
+
+	// Collapsing is linear in the node count, much cheaper than refitting the wide nodes slot by slot
+	wideNodes4.clear();
+	wideNodes8.clear();
+	if (stackless) return;
+	if (width == 8) Collapse(wideNodes8, 0);
+	else if (width == 4) Collapse(wideNodes4, 0);
+}
+
+bool BVH::Update(const std::vector<AABB>& primitiveBounds)
+{
+	if (nodes.empty() || IsCompressed() || primitiveBounds.size() != primitiveCount)
+	{
+		Build(primitiveBounds);
+		return true;
+	}
+
+	Refit(primitiveBounds);
+	if (SAHCost() > builtCost * rebuildCostRatio)
+	{
+		Build(primitiveBounds);
+		return true;
+	}
+
+	return false;
+}
+
+float BVH::SAHCost() const
+{
+	if (nodes.empty() || IsCompressed()) return 0.0f;
+
+	float cost = 0.0f;
+	for (const BVHNode& node : nodes)
+	{
+		vec3 d = node.max - node.min;
+		float area = d.x * d.y + d.y * d.z + d.z * d.x;
+		cost += node.IsLeaf() ? area * float(node.count) : area * traversalCost;
+	}
+
+	vec3 d = nodes[0].max - nodes[0].min;
+	float rootArea = d.x * d.y + d.y * d.z + d.z * d.x;
+	return (rootArea > 0.0f) ? cost / rootArea : cost;
+}
+
+size_t BVH::TraversalNodeCount() const
+{
+	if (!compressedNodes8.empty()) return compressedNodes8.size();
+	if (!compressedNodes4.empty()) return compressedNodes4.size();
+	if (!wideNodes8.empty()) return wideNodes8.size();
+	if (!wideNodes4.empty()) return wideNodes4.size();
+	return nodes.size();
+}
+
+size_t BVH::MemoryUsage() const
+{
+	return	nodes.capacity() * sizeof(BVHNode) +
+			wideNodes4.capacity() * sizeof(WideBVHNode<4>) +
+			wideNodes8.capacity() * sizeof(WideBVHNode<8>) +
+			compressedNodes4.capacity() * sizeof(CompressedBVHNode<4>) +
+			compressedNodes8.capacity() * sizeof(CompressedBVHNode<8>) +
+			parentLinks.capacity() * sizeof(unsigned int) +
+			primitiveIndices.capacity() * sizeof(unsigned int);
+}
+
+void BVH::BuildParentLinks()
+{
+	parentLinks.assign(nodes.size(), 0);
+	for (unsigned int i = 0; i < nodes.size(); ++i)
+	{
+		if (nodes[i].IsLeaf()) continue;
+
+		unsigned int left = nodes[i].leftFirst;
+		parentLinks[left] |= i << 3;
+		parentLinks[left + 1] |= i << 3;
+
+		// Order of the children along the axis which separates their centers the most
+		vec3 offset = (nodes[left + 1].min + nodes[left + 1].max) - (nodes[left].min + nodes[left].max);
+		vec3 distance = glm::abs(offset);
+		unsigned int axis = (distance.y > distance.x) ? 1 : 0;
+		if (distance.z > distance[axis]) axis = 2;
+		parentLinks[i] |= (axis << 1) | (offset[axis] < 0.0f ? 1u : 0u);
+	}
+}
+
+template<unsigned int Width>
+unsigned int BVH::GatherChildren(unsigned int nodeIndex, unsigned int* slots) const
+{
+	// Open up the interior child with the largest surface area until all slots are used
+	unsigned int slotCount = 0;
+	if (nodes[nodeIndex].IsLeaf())
+	{
+		slots[slotCount++] = nodeIndex;
+	}
+	else
+	{
+		slots[slotCount++] = nodes[nodeIndex].leftFirst;
+		slots[slotCount++] = nodes[nodeIndex].leftFirst + 1;
+	}
+
+	while (slotCount < Width)
+	{
+		int largestSlot = -1;
+		float largestArea = -1.0f;
+		for (unsigned int i = 0; i < slotCount; ++i)
+		{
+			const BVHNode& node = nodes[slots[i]];
+			if (node.IsLeaf()) continue;
+
+			vec3 d = node.max - node.min;
+			float area = d.x * d.y + d.y * d.z + d.z * d.x;
+			if (area > largestArea)
+			{
+				largestArea = area;
+				largestSlot = int(i);
+			}
+		}
+
+		if (largestSlot < 0) break;
+
+		unsigned int opened = slots[largestSlot];
+		slots[largestSlot] = nodes[opened].leftFirst;
+		slots[slotCount++] = nodes[opened].leftFirst + 1;
+	}
+
+	return slotCount;
+}
+
+template<unsigned int Width>
+unsigned int BVH::Collapse(std::vector<WideBVHNode<Width>>& wideNodes, unsigned int nodeIndex)
+{
+	unsigned int slots[Width];
+	unsigned int slotCount = GatherChildren<Width>(nodeIndex, slots);
+
+	unsigned int wideIndex = (unsigned int)wideNodes.size();
+	wideNodes.emplace_back();
+
+	WideBVHNode<Width> wideNode{};
+	wideNode.childCount = slotCount;
+	for (unsigned int i = 0; i < slotCount; ++i)
+	{
+		const BVHNode& node = nodes[slots[i]];
+		wideNode.minX[i] = node.min.x;
+		wideNode.minY[i] = node.min.y;
+		wideNode.minZ[i] = node.min.z;
+		wideNode.maxX[i] = node.max.x;
+		wideNode.maxY[i] = node.max.y;
+		wideNode.maxZ[i] = node.max.z;
+
+		if (node.IsLeaf())
+		{
+			wideNode.child[i] = node.leftFirst;
+			wideNode.count[i] = node.count;
+		}
+		else
+		{
+			wideNode.child[i] = Collapse(wideNodes, slots[i]);
+			wideNode.count[i] = 0;
+		}
+	}
+
+	wideNodes[wideIndex] = wideNode;
+	return wideIndex;
+}
+
+template<unsigned int Width>
+bool BVH::Compress(std::vector<CompressedBVHNode<Width>>& compressedNodes)
+{
+	struct PendingNode
+	{
+		unsigned int nodeIndex;
+		unsigned int compressedIndex;
+	};
+
+	// Breadth first, so that the interior children of a node are allocated next to each other.
+	// The primitives are reordered so that the leaf children of a node are next to each other as well.
+	std::vector<unsigned int> compressedPrimitives;
+	compressedPrimitives.reserve(primitiveIndices.size());
+	std::vector<PendingNode> pending;
+	pending.push_back(PendingNode{ 0, 0 });
+	compressedNodes.emplace_back();
+
+	for (size_t p = 0; p < pending.size(); ++p)
+	{
+		unsigned int slots[Width];
+		unsigned int slotCount = GatherChildren<Width>(pending[p].nodeIndex, slots);
+
+		CompressedBVHNode<Width> compressedNode{};
+		compressedNode.SetGrid(nodes[pending[p].nodeIndex].min, nodes[pending[p].nodeIndex].max);
+		compressedNode.childCount = uint8_t(slotCount);
+		compressedNode.firstChild = (unsigned int)compressedNodes.size();
+		compressedNode.firstPrimitive = (unsigned int)compressedPrimitives.size();
+
+		for (unsigned int i = 0; i < slotCount; ++i)
+		{
+			const BVHNode& node = nodes[slots[i]];
+			compressedNode.SetChildBounds(i, node.min, node.max);
+
+			if (node.IsLeaf())
+			{
+				if (node.count > COMPRESSEDBVH_MAX_LEAF_SIZE) return false;
+
+				compressedNode.count[i] = uint8_t(node.count);
+				compressedPrimitives.insert(compressedPrimitives.end(), primitiveIndices.begin() + node.leftFirst, primitiveIndices.begin() + node.leftFirst + node.count);
+			}
+			else
+			{
+				compressedNode.count[i] = 0;
+				pending.push_back(PendingNode{ slots[i], (unsigned int)compressedNodes.size() });
+				compressedNodes.emplace_back();
+			}
+		}
+
+		compressedNodes[pending[p].compressedIndex] = compressedNode;
+	}
+
+	compressedNodes.shrink_to_fit();
+	primitiveIndices.swap(compressedPrimitives);
+	return true;
+}
+
+void BVH::UpdateNodeBounds(BVHNode& node, const std::vector<AABB>& primitiveBounds)
+{
+	AABB bounds = AABB::Empty();
+	for (unsigned int i = 0; i < node.count; ++i)
+	{
+		bounds.Encapsulate(primitiveBounds[primitiveIndices[node.leftFirst + i]]);
+	}
+
+	node.min = bounds.min;
+	node.max = bounds.max;
+}
+
+void BVH::Subdivide(unsigned int nodeIndex, const std::vector<AABB>& primitiveBounds, const std::vector<vec3>& centroids, unsigned int depth)
+{
+	BVHNode& node = nodes[nodeIndex];
+	if (node.count <= 1 || depth >= BVH_STACK_SIZE - 2) return;
+
+	int axis = -1;
+	float splitPosition = 0.0f;
+	float splitCost = FindBestSplit(node, primitiveBounds, centroids, axis, splitPosition);
+
+	// Compare against the cost of keeping the primitives in a leaf (both relative to the node area)
+	AABB nodeBounds;
+	nodeBounds.min = node.min;
+	nodeBounds.max = node.max;
+	float leafCost = float(node.count) * nodeBounds.SurfaceArea();
+	if (splitCost >= leafCost && node.count <= maxLeafSize) return;
+
+	unsigned int first = node.leftFirst;
+	unsigned int last = first + node.count;
+	unsigned int middle = first;
+	if (axis >= 0)
+	{
+		middle = (unsigned int)(std::partition(primitiveIndices.begin() + first, primitiveIndices.begin() + last, [&](unsigned int index) {
+			return centroids[index][axis] < splitPosition;
+		}) - primitiveIndices.begin());
+	}
+
+	if (middle == first || middle == last)
+	{
+		// Centroids could not be separated by the bins, fall back to a median split along the widest axis
+		vec3 extent = node.max - node.min;
+		axis = (extent.y > extent.x) ? 1 : 0;
+		if (extent.z > extent[axis]) axis = 2;
+
+		middle = first + node.count / 2;
+		std::nth_element(primitiveIndices.begin() + first, primitiveIndices.begin() + middle, primitiveIndices.begin() + last, [&](unsigned int a, unsigned int b) {
+			return centroids[a][axis] < centroids[b][axis];
+		});
+	}
+
+	unsigned int leftIndex = (unsigned int)nodes.size();
+	nodes.emplace_back();
+	nodes.emplace_back();
+
+	// The node reference is invalidated if the vector grows, index it again
+	BVHNode& left = nodes[leftIndex];
+	BVHNode& right = nodes[leftIndex + 1];
+	left.leftFirst = first;
+	left.count = middle - first;
+	right.leftFirst = middle;
+	right.count = last - middle;
+	UpdateNodeBounds(left, primitiveBounds);
+	UpdateNodeBounds(right, primitiveBounds);
+
+	nodes[nodeIndex].leftFirst = leftIndex;
+	nodes[nodeIndex].count = 0;
+
+	Subdivide(leftIndex, primitiveBounds, centroids, depth + 1);
+	Subdivide(leftIndex + 1, primitiveBounds, centroids, depth + 1);
+}
+
+float BVH::FindBestSplit(const BVHNode& node, const std::vector<AABB>& primitiveBounds, const std::vector<vec3>& centroids, int& axis, float& splitPosition)
+{
+	AABB centroidBounds = AABB::Empty();
+	for (unsigned int i = 0; i < node.count; ++i)
+	{
+		centroidBounds.Encapsulate(centroids[primitiveIndices[node.leftFirst + i]]);
+	}
+
+	AABB nodeBounds;
+	nodeBounds.min = node.min;
+	nodeBounds.max = node.max;
+
+	float bestCost = FLOAT_INFINITY;
+	std::vector<Bin> bins(binCount);
+	std::vector<float> leftArea(binCount - 1), rightArea(binCount - 1);
+	std::vector<unsigned int> leftCount(binCount - 1), rightCount(binCount - 1);
+
+	for (int a = 0; a < 3; ++a)
+	{
+		float boundsMin = centroidBounds.min[a];
+		float boundsMax = centroidBounds.max[a];
+		if (boundsMax <= boundsMin) continue;
+
+		std::fill(bins.begin(), bins.end(), Bin{});
+		float scale = float(binCount) / (boundsMax - boundsMin);
+		for (unsigned int i = 0; i < node.count; ++i)
+		{
+			unsigned int index = primitiveIndices[node.leftFirst + i];
+			unsigned int binIndex = std::min(binCount - 1, (unsigned int)((centroids[index][a] - boundsMin) * scale));
+			bins[binIndex].count++;
+			bins[binIndex].bounds.Encapsulate(primitiveBounds[index]);
+		}
+
+		// Sweep from both sides to get the area and count on each side of every bin boundary
+		AABB leftBox = AABB::Empty(), rightBox = AABB::Empty();
+		unsigned int leftSum = 0, rightSum = 0;
+		for (unsigned int i = 0; i < binCount - 1; ++i)
+		{
+			leftSum += bins[i].count;
+			leftCount[i] = leftSum;
+			leftBox.Encapsulate(bins[i].bounds);
+			leftArea[i] = (leftSum > 0) ? leftBox.SurfaceArea() : 0.0f;
+
+			rightSum += bins[binCount - 1 - i].count;
+			rightCount[binCount - 2 - i] = rightSum;
+			rightBox.Encapsulate(bins[binCount - 1 - i].bounds);
+			rightArea[binCount - 2 - i] = (rightSum > 0) ? rightBox.SurfaceArea() : 0.0f;
+		}
+
+		float binWidth = (boundsMax - boundsMin) / float(binCount);
+		for (unsigned int i = 0; i < binCount - 1; ++i)
+		{
+			float cost = traversalCost * nodeBounds.SurfaceArea() + leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				axis = a;
+				splitPosition = boundsMin + binWidth * float(i + 1);
+			}
+		}
+	}
+
+	return bestCost;
+}
@@ -0,0 +1,726 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "../core/math.h"
+#include "../core/ray.h"
+#include "../core/aabb.h"
+#include "../core/raypacket.h"
+#include "widebvh.h"
+#include "compressedbvh.h"
+
+#include <vector>
+#include <functional>
+
+#define BVH_STACK_SIZE 64
+#define WIDEBVH_STACK_SIZE (BVH_STACK_SIZE * 7 + 1)
+#define BVH_INTERLEAVE_DEFAULT_GROUP 8
+#define BVH_INTERLEAVE_MAX_GROUP 32
+
+/*
+	BinnedSAH gives good traversal performance, Linear (LBVH) builds in parallel and much faster.
+	Spatial (SBVH) also splits large primitives between nodes, which pays off for big overlapping polygons.
+*/
+enum class BVHBuilder { BinnedSAH, Linear, Spatial, COUNT };
+
+// Build options shared by the top-level and the mesh structures of a scene
+struct BVHSettings
+{
+	BVHBuilder builder = BVHBuilder::BinnedSAH;
+	bool compressed = false;
+	bool stackless = false;
+	float spatialSplitBudget = 0.3f;
+};
+
+/*
+	Bounds of the parts of a primitive on each side of the plane at position along axis,
+	limited to the given bounds (the part of the primitive which is being split).
+*/
+typedef std::function<void(unsigned int primitiveIndex, int axis, float position, const AABB& bounds, AABB& left, AABB& right)> SplitPrimitiveFunction;
+
+struct BVHNode
+{
+	vec3 min;
+	unsigned int leftFirst = 0;	// left child index for interior nodes (right child is leftFirst+1), first primitive for leaves
+	vec3 max;
+	unsigned int count = 0;		// number of primitives in a leaf, 0 for interior nodes
+
+	inline bool IsLeaf() const { return count > 0; }
+};
+
+/*
+	Bounding volume hierarchy over an arbitrary set of primitives.
+	The tree only knows about primitive bounds, the caller resolves primitive indices during traversal.
+
+	Built top-down with a binned surface area heuristic, or as a linear BVH from
+	sorted Morton codes when build time matters more than quality. With a width of 4 or 8 the
+	binary tree is collapsed into a wide tree which is used for traversal.
+
+	A compressed BVH stores the wide tree with quantized bounds and releases the binary nodes
+	(only the root is kept), which reduces the node memory to roughly a quarter.
+
+	A stackless BVH keeps the binary tree with parent links and is traversed without a stack,
+	which keeps the stack usage of deep recursive TraceRay calls down.
+*/
+class BVH
+{
+protected:
+	std::vector<BVHNode> nodes;
+	std::vector<WideBVHNode<4>> wideNodes4;
+	std::vector<WideBVHNode<8>> wideNodes8;
+	std::vector<CompressedBVHNode<4>> compressedNodes4;
+	std::vector<CompressedBVHNode<8>> compressedNodes8;
+	std::vector<unsigned int> primitiveIndices;
+	std::vector<unsigned int> parentLinks;	// stackless trees only: parent << 3 | axis << 1 | right child is lower along axis
+	float builtCost = 0.0f;		// SAH cost right after the last full build
+	unsigned int primitiveCount = 0;
+
+	struct Bin
+	{
+		AABB bounds = AABB::Empty();
+		unsigned int count = 0;
+	};
+
+public:
+	BVHBuilder builder = BVHBuilder::BinnedSAH;
+	unsigned int maxLeafSize = 4;
+	unsigned int binCount = 12;
+	float traversalCost = 1.0f;		// cost of a node visit relative to a primitive intersection
+	unsigned int width = ActiveKernels().bvhWidth;	// branching factor used for traversal: 2, 4 or 8
+	bool compressed = false;					// quantized wide nodes (width 2 is treated as 4), less memory but slightly slower traversal
+	bool stackless = false;						// binary traversal through parent links, ignores width (compressed takes precedence)
+	float rebuildCostRatio = 1.3f;				// Update rebuilds once refitting made the SAH cost this much worse than after the build
+
+	// Spatial builder only
+	float spatialSplitBudget = 0.3f;			// extra primitive references allowed, relative to the primitive count
+	float spatialSplitOverlap = 1e-5f;			// spatial splits are tried when the children of an object split overlap by this much of the root area
+	SplitPrimitiveFunction splitPrimitive;		// clips primitives more tightly than their bounds, optional
+
+	BVH() = default;
+	~BVH() = default;
+
+	void Build(const std::vector<AABB>& primitiveBounds);
+	void Clear();
+
+	void Configure(const BVHSettings& settings)
+	{
+		builder = settings.builder;
+		compressed = settings.compressed;
+		stackless = settings.stackless;
+		spatialSplitBudget = settings.spatialSplitBudget;
+	}
+
+	bool IsConfiguredAs(const BVHSettings& settings) const
+	{
+		return builder == settings.builder && compressed == settings.compressed && stackless == settings.stackless && spatialSplitBudget == settings.spatialSplitBudget;
+	}
+
+	/*
+		Recomputes the node bounds bottom-up for primitives which moved, the tree topology is kept.
+		The primitive count must be the same as in the last build. Compressed trees have no binary
+		nodes left to refit, they are rebuilt instead.
+	*/
+	void Refit(const std::vector<AABB>& primitiveBounds);
+
+	// Refits, or rebuilds if the primitive count changed or refitting degraded the tree too much. Returns true on a rebuild.
+	bool Update(const std::vector<AABB>& primitiveBounds);
+
+	// Expected cost of a ray which hits the root, in primitive intersections (0 for compressed trees)
+	float SAHCost() const;
+
+	inline bool IsEmpty() const { return nodes.empty(); }
+	inline size_t NodeCount() const { return nodes.size(); }
+	inline const std::vector<BVHNode>& Nodes() const { return nodes; }
+	inline const std::vector<unsigned int>& PrimitiveIndices() const { return primitiveIndices; }
+	inline bool IsCompressed() const { return !compressedNodes4.empty() || !compressedNodes8.empty(); }
+
+	// Nodes used for traversal and the bytes they take, primitive indices included
+	size_t TraversalNodeCount() const;
+	size_t MemoryUsage() const;
+
+	/*
+		Closest hit traversal.
+		intersectPrimitive(primitiveIndex, nearestDistance) must return true and shrink nearestDistance on a closer hit.
+	*/
+	template<typename IntersectPrimitive>
+	bool Intersect(const Ray& ray, float& nearestDistance, IntersectPrimitive&& intersectPrimitive) const
+	{
+		return IntersectLeaves(ray, nearestDistance, [&](unsigned int first, unsigned int count, float& nearest) {
+			bool hit = false;
+			for (unsigned int i = 0; i < count; ++i)
+			{
+				hit |= intersectPrimitive(primitiveIndices[first + i], nearest);
+			}
+			return hit;
+		});
+	}
+
+	/*
+		Any hit traversal, stops at the first primitive for which occludesPrimitive(primitiveIndex, maxDistance) returns true.
+	*/
+	template<typename OccludesPrimitive>
+	bool Occluded(const Ray& ray, float maxDistance, OccludesPrimitive&& occludesPrimitive) const
+	{
+		return OccludedLeaves(ray, maxDistance, [&](unsigned int first, unsigned int count, float& maxHitDistance) {
+			for (unsigned int i = 0; i < count; ++i)
+			{
+				if (occludesPrimitive(primitiveIndices[first + i], maxHitDistance)) return true;
+			}
+			return false;
+		});
+	}
+
+	/*
+		Closest hit traversal for a packet of coherent rays over the binary nodes.
+		intersectPrimitive(primitiveIndex, firstRay) must test the rays [firstRay, packet.size)
+		and shrink their entries in nearestDistances on closer hits.
+	*/
+	template<typename IntersectPrimitive>
+	void IntersectPacket(const RayPacket& packet, unsigned int firstRay, float* nearestDistances, IntersectPrimitive&& intersectPrimitive) const
+	{
+		IntersectPacketLeaves(packet, firstRay, nearestDistances, [&](unsigned int first, unsigned int count, unsigned int firstActive) {
+			for (unsigned int i = 0; i < count; ++i)
+			{
+				intersectPrimitive(primitiveIndices[first + i], firstActive);
+			}
+		});
+	}
+
+	/*
+		Leaf level versions of the queries above. The callbacks receive whole leaves as ranges
+		[first, first + count) of PrimitiveIndices(), which lets a caller store its primitive data
+		in the same order and stream through it.
+	*/
+	template<typename IntersectLeaf>
+	bool IntersectLeaves(const Ray& ray, float& nearestDistance, IntersectLeaf&& intersectLeaf) const
+	{
+		if (nodes.empty()) return false;
+
+		if (!compressedNodes8.empty()) return IntersectWide<false>(compressedNodes8, ray, nearestDistance, intersectLeaf);
+		if (!compressedNodes4.empty()) return IntersectWide<false>(compressedNodes4, ray, nearestDistance, intersectLeaf);
+		if (width == 8 && !wideNodes8.empty()) return IntersectWide<false>(wideNodes8, ray, nearestDistance, intersectLeaf);
+		if (width == 4 && !wideNodes4.empty()) return IntersectWide<false>(wideNodes4, ray, nearestDistance, intersectLeaf);
+		if (!parentLinks.empty()) return IntersectStackless<false>(ray, nearestDistance, intersectLeaf);
+		return IntersectBinary<false>(ray, nearestDistance, intersectLeaf);
+	}
+
+	template<typename OccludesLeaf>
+	bool OccludedLeaves(const Ray& ray, float maxDistance, OccludesLeaf&& occludesLeaf) const
+	{
+		if (nodes.empty()) return false;
+
+		if (!compressedNodes8.empty()) return IntersectWide<true>(compressedNodes8, ray, maxDistance, occludesLeaf);
+		if (!compressedNodes4.empty()) return IntersectWide<true>(compressedNodes4, ray, maxDistance, occludesLeaf);
+		if (width == 8 && !wideNodes8.empty()) return IntersectWide<true>(wideNodes8, ray, maxDistance, occludesLeaf);
+		if (width == 4 && !wideNodes4.empty()) return IntersectWide<true>(wideNodes4, ray, maxDistance, occludesLeaf);
+		if (!parentLinks.empty()) return IntersectStackless<true>(ray, maxDistance, occludesLeaf);
+		return IntersectBinary<true>(ray, maxDistance, occludesLeaf);
+	}
+
+	/*
+		Closest hits for a stream of independent (incoherent) rays. groupSize rays are traversed in
+		round-robin, one node per ray and turn, and the node a ray visits next is prefetched. A cache miss
+		of one ray then overlaps with the work on the others (asynchronous memory access chaining,
+		Kocberber et al. 2015). intersectLeaf(rayIndex, first, count, nearestDistance) is called per leaf,
+		setting nearestDistance negative ends the traversal of that ray (any-hit queries).
+		Only the wide and compressed layouts are interleaved, binary trees trace the rays one by one.
+	*/
+	template<typename IntersectLeaf>
+	void IntersectLeavesInterleaved(const Ray* rays, unsigned int rayCount, float* nearestDistances, unsigned int groupSize, IntersectLeaf&& intersectLeaf) const
+	{
+		if (nodes.empty()) return;
+
+		if (!compressedNodes8.empty()) return IntersectWideInterleaved(compressedNodes8, rays, rayCount, nearestDistances, groupSize, intersectLeaf);
+		if (!compressedNodes4.empty()) return IntersectWideInterleaved(compressedNodes4, rays, rayCount, nearestDistances, groupSize, intersectLeaf);
+		if (width == 8 && !wideNodes8.empty()) return IntersectWideInterleaved(wideNodes8, rays, rayCount, nearestDistances, groupSize, intersectLeaf);
+		if (width == 4 && !wideNodes4.empty()) return IntersectWideInterleaved(wideNodes4, rays, rayCount, nearestDistances, groupSize, intersectLeaf);
+
+		for (unsigned int i = 0; i < rayCount; ++i)
+		{
+			IntersectLeaves(rays[i], nearestDistances[i], [&](unsigned int first, unsigned int count, float& nearest) {
+				return intersectLeaf(i, first, count, nearest);
+			});
+		}
+	}
+
+	/*
+		A node is entered if any ray still active hits it, rays before the first hitting one are
+		deactivated for the whole subtree. intersectLeaf(first, count, firstActive) is called once per leaf.
+	*/
+	template<typename IntersectLeaf>
+	void IntersectPacketLeaves(const RayPacket& packet, unsigned int firstRay, float* nearestDistances, IntersectLeaf&& intersectLeaf) const
+	{
+		if (nodes.empty() || firstRay >= packet.size) return;
+
+		if (!compressedNodes8.empty()) return IntersectPacketCompressed(compressedNodes8, packet, firstRay, nearestDistances, intersectLeaf);
+		if (!compressedNodes4.empty()) return IntersectPacketCompressed(compressedNodes4, packet, firstRay, nearestDistances, intersectLeaf);
+
+		struct StackEntry
+		{
+			unsigned int nodeIndex;
+			unsigned int firstActive;
+		};
+
+		StackEntry stack[BVH_STACK_SIZE];
+		unsigned int stackSize = 0;
+		stack[stackSize++] = StackEntry{ 0, firstRay };
+		float tEntry = 0.0f;
+
+		while (stackSize > 0)
+		{
+			StackEntry entry = stack[--stackSize];
+			const BVHNode& node = nodes[entry.nodeIndex];
+
+			float maxDistance = 0.0f;
+			for (unsigned int i = entry.firstActive; i < packet.size; ++i)
+			{
+				maxDistance = std::max(maxDistance, nearestDistances[i]);
+			}
+
+			// Frustum-style rejection of the whole packet before testing individual rays
+			if (!packet.MayIntersect(node.min, node.max, maxDistance)) continue;
+
+			unsigned int first = entry.firstActive;
+			while (first < packet.size && !AABB::RayIntersectsBox(node.min, node.max, packet.rays[first], nearestDistances[first], tEntry))
+			{
+				++first;
+			}
+
+			if (first == packet.size) continue;
+
+			if (node.IsLeaf())
+			{
+				intersectLeaf(node.leftFirst, node.count, first);
+				continue;
+			}
+
+			// Order the children along the mean packet direction
+			unsigned int closeChild = node.leftFirst;
+			unsigned int farChild = node.leftFirst + 1;
+			vec3 closeCenter = (nodes[closeChild].min + nodes[closeChild].max) * 0.5f;
+			vec3 farCenter = (nodes[farChild].min + nodes[farChild].max) * 0.5f;
+			if (glm::dot(farCenter - closeCenter, packet.meanDirection) < 0.0f)
+			{
+				std::swap(closeChild, farChild);
+			}
+
+			stack[stackSize++] = StackEntry{ farChild, first };
+			stack[stackSize++] = StackEntry{ closeChild, first };
+		}
+	}
+
+	// Packet traversal over the compressed nodes, children are decoded one at a time
+	template<unsigned int Width, typename IntersectLeaf>
+	void IntersectPacketCompressed(const std::vector<CompressedBVHNode<Width>>& compressedNodes, const RayPacket& packet, unsigned int firstRay, float* nearestDistances, IntersectLeaf& intersectLeaf) const
+	{
+		struct StackEntry
+		{
+			unsigned int reference;
+			unsigned int count;
+			unsigned int firstActive;
+			float order;
+		};
+
+		StackEntry stack[WIDEBVH_STACK_SIZE];
+		unsigned int stackSize = 0;
+		stack[stackSize++] = StackEntry{ 0, 0, firstRay, 0.0f };
+		float tEntry = 0.0f;
+
+		while (stackSize > 0)
+		{
+			StackEntry entry = stack[--stackSize];
+			if (entry.count > 0)
+			{
+				intersectLeaf(entry.reference, entry.count, entry.firstActive);
+				continue;
+			}
+
+			float maxDistance = 0.0f;
+			for (unsigned int i = entry.firstActive; i < packet.size; ++i)
+			{
+				maxDistance = std::max(maxDistance, nearestDistances[i]);
+			}
+
+			const CompressedBVHNode<Width>& node = compressedNodes[entry.reference];
+			unsigned int references[Width];
+			GetChildReferences(node, references);
+
+			// Push the children furthest first along the mean packet direction
+			StackEntry children[Width];
+			unsigned int childCount = 0;
+			for (unsigned int i = 0; i < node.childCount; ++i)
+			{
+				vec3 childMin, childMax;
+				node.GetChildBounds(i, childMin, childMax);
+				if (!packet.MayIntersect(childMin, childMax, maxDistance)) continue;
+
+				unsigned int first = entry.firstActive;
+				while (first < packet.size && !AABB::RayIntersectsBox(childMin, childMax, packet.rays[first], nearestDistances[first], tEntry))
+				{
+					++first;
+				}
+
+				if (first == packet.size) continue;
+
+				float order = glm::dot(childMin + childMax, packet.meanDirection);
+				unsigned int j = childCount++;
+				while (j > 0 && children[j - 1].order < order)
+				{
+					children[j] = children[j - 1];
+					--j;
+				}
+				children[j] = StackEntry{ references[i], node.count[i], first, order };
+			}
+
+			for (unsigned int i = 0; i < childCount; ++i)
+			{
+				stack[stackSize++] = children[i];
+			}
+		}
+	}
+
+	template<bool AnyHit, typename IntersectLeaf>
+	bool IntersectBinary(const Ray& ray, float& nearestDistance, IntersectLeaf& intersectLeaf) const
+	{
+		float tEntry = 0.0f;
+		if (!AABB::RayIntersectsBox(nodes[0].min, nodes[0].max, ray, nearestDistance, tEntry)) return false;
+
+		unsigned int stack[BVH_STACK_SIZE];
+		float stackDistance[BVH_STACK_SIZE];
+		unsigned int stackSize = 0;
+		unsigned int nodeIndex = 0;
+		bool hit = false;
+
+		while (true)
+		{
+			const BVHNode& node = nodes[nodeIndex];
+			if (node.IsLeaf())
+			{
+				hit |= intersectLeaf(node.leftFirst, node.count, nearestDistance);
+				if (AnyHit && hit) return true;
+			}
+			else
+			{
+				// Visit the closest child first, the other one is deferred on the stack
+				unsigned int closeChild = node.leftFirst;
+				unsigned int farChild = node.leftFirst + 1;
+				float tClose = 0.0f;
+				float tFar = 0.0f;
+				bool hitClose = AABB::RayIntersectsBox(nodes[closeChild].min, nodes[closeChild].max, ray, nearestDistance, tClose);
+				bool hitFar = AABB::RayIntersectsBox(nodes[farChild].min, nodes[farChild].max, ray, nearestDistance, tFar);
+
+				if (hitClose && hitFar)
+				{
+					if (tFar < tClose)
+					{
+						std::swap(closeChild, farChild);
+						std::swap(tClose, tFar);
+					}
+					stack[stackSize] = farChild;
+					stackDistance[stackSize++] = tFar;
+					nodeIndex = closeChild;
+					continue;
+				}
+				else if (hitClose || hitFar)
+				{
+					nodeIndex = hitClose ? closeChild : farChild;
+					continue;
+				}
+			}
+
+			// Skip deferred nodes which are further away than the nearest hit found so far
+			while (stackSize > 0 && stackDistance[stackSize - 1] > nearestDistance)
+			{
+				--stackSize;
+			}
+
+			if (stackSize == 0) break;
+			nodeIndex = stack[--stackSize];
+		}
+
+		return hit;
+	}
+
+	/*
+		Binary traversal without a stack ("Efficient Stack-less BVH Traversal for Ray Tracing", Hapala et al. 2011).
+		The traversal walks the tree through parent links and remembers only from which direction it came.
+		The near child only depends on the ray direction sign along the axis which separates the child centers
+		most, so the choice is the same on the way down and up.
+	*/
+	template<bool AnyHit, typename IntersectLeaf>
+	bool IntersectStackless(const Ray& ray, float& nearestDistance, IntersectLeaf& intersectLeaf) const
+	{
+		float tEntry = 0.0f;
+		if (!AABB::RayIntersectsBox(nodes[0].min, nodes[0].max, ray, nearestDistance, tEntry)) return false;
+		if (nodes[0].IsLeaf()) return intersectLeaf(nodes[0].leftFirst, nodes[0].count, nearestDistance);
+
+		auto parent = [&](unsigned int nodeIndex) { return parentLinks[nodeIndex] >> 3; };
+
+		auto nearChild = [&](unsigned int nodeIndex) {
+			unsigned int link = parentLinks[nodeIndex];
+			return nodes[nodeIndex].leftFirst + (ray.sign[(link >> 1) & 3] ^ (link & 1));
+		};
+
+		auto sibling = [&](unsigned int nodeIndex) {
+			unsigned int left = nodes[parent(nodeIndex)].leftFirst;
+			return (nodeIndex == left) ? left + 1 : left;
+		};
+
+		enum class State { FromParent, FromSibling, FromChild };
+		State state = State::FromParent;
+		unsigned int nodeIndex = nearChild(0);
+		bool hit = false;
+
+		while (true)
+		{
+			if (state == State::FromChild)
+			{
+				if (nodeIndex == 0) return hit;
+
+				unsigned int parentIndex = parent(nodeIndex);
+				if (nodeIndex == nearChild(parentIndex))
+				{
+					nodeIndex = (nodeIndex == nodes[parentIndex].leftFirst) ? nodeIndex + 1 : nodeIndex - 1;
+					state = State::FromSibling;
+				}
+				else
+				{
+					nodeIndex = parentIndex;
+				}
+				continue;
+			}
+
+			const BVHNode& node = nodes[nodeIndex];
+			bool entered = AABB::RayIntersectsBox(node.min, node.max, ray, nearestDistance, tEntry);
+			if (entered && !node.IsLeaf())
+			{
+				nodeIndex = nearChild(nodeIndex);
+				state = State::FromParent;
+				continue;
+			}
+
+			if (entered)
+			{
+				hit |= intersectLeaf(node.leftFirst, node.count, nearestDistance);
+				if (AnyHit && hit) return true;
+			}
+
+			// Continue with the far sibling, or go up once both siblings are done
+			if (state == State::FromParent)
+			{
+				nodeIndex = sibling(nodeIndex);
+				state = State::FromSibling;
+			}
+			else
+			{
+				nodeIndex = parent(nodeIndex);
+				state = State::FromChild;
+			}
+		}
+	}
+
+	template<template<unsigned int> class WideNode, unsigned int Width, typename IntersectLeaf>
+	void IntersectWideInterleaved(const std::vector<WideNode<Width>>& wideNodes, const Ray* rays, unsigned int rayCount, float* nearestDistances, unsigned int groupSize, IntersectLeaf& intersectLeaf) const
+	{
+		struct StackEntry
+		{
+			unsigned int reference;
+			unsigned int count;
+			float distance;
+		};
+
+		struct RaySlot
+		{
+			WideBVHRay wideRay;
+			unsigned int rayIndex;
+			unsigned int stackSize;
+			StackEntry* stack;
+		};
+
+		groupSize = std::max(1u, std::min(groupSize, (unsigned int)BVH_INTERLEAVE_MAX_GROUP));
+		std::vector<StackEntry> stacks(size_t(groupSize) * WIDEBVH_STACK_SIZE);
+		RaySlot slots[BVH_INTERLEAVE_MAX_GROUP];
+
+		// Gives the slot the next ray which hits the root, false when the stream is exhausted
+		unsigned int nextRay = 0;
+		auto startRay = [&](RaySlot& slot) {
+			while (nextRay < rayCount)
+			{
+				unsigned int rayIndex = nextRay++;
+				float tEntry = 0.0f;
+				if (!AABB::RayIntersectsBox(nodes[0].min, nodes[0].max, rays[rayIndex], nearestDistances[rayIndex], tEntry)) continue;
+
+				slot.wideRay = WideBVHRay{ rays[rayIndex] };
+				slot.rayIndex = rayIndex;
+				slot.stack[0] = StackEntry{ 0, 0, tEntry };
+				slot.stackSize = 1;
+				return true;
+			}
+			slot.stackSize = 0;
+			return false;
+		};
+
+		unsigned int activeCount = 0;
+		for (unsigned int s = 0; s < groupSize; ++s)
+		{
+			slots[s].stack = &stacks[size_t(s) * WIDEBVH_STACK_SIZE];
+			if (startRay(slots[s])) ++activeCount;
+		}
+
+		while (activeCount > 0)
+		{
+			for (unsigned int s = 0; s < groupSize; ++s)
+			{
+				RaySlot& slot = slots[s];
+				if (slot.stackSize == 0) continue;
+
+				float& nearestDistance = nearestDistances[slot.rayIndex];
+				StackEntry entry = slot.stack[--slot.stackSize];
+				if (entry.distance <= nearestDistance)
+				{
+					if (entry.count > 0)
+					{
+						intersectLeaf(slot.rayIndex, entry.reference, entry.count, nearestDistance);
+						if (nearestDistance < 0.0f) slot.stackSize = 0;
+					}
+					else
+					{
+						const WideNode<Width>& node = wideNodes[entry.reference];
+						alignas(32) float distances[Width];
+						unsigned int mask = IntersectChildren(node, slot.wideRay, nearestDistance, distances);
+
+						unsigned int references[Width];
+						GetChildReferences(node, references);
+
+						StackEntry children[Width];
+						unsigned int childCount = 0;
+						for (unsigned int i = 0; i < Width; ++i)
+						{
+							if (!(mask & (1u << i))) continue;
+
+							unsigned int j = childCount++;
+							while (j > 0 && children[j - 1].distance < distances[i])
+							{
+								children[j] = children[j - 1];
+								--j;
+							}
+							children[j] = StackEntry{ references[i], node.count[i], distances[i] };
+						}
+
+						for (unsigned int i = 0; i < childCount; ++i)
+						{
+							slot.stack[slot.stackSize++] = children[i];
+						}
+					}
+				}
+
+				// The node this ray visits on its next turn is loaded while the other rays work
+				if (slot.stackSize > 0)
+				{
+					const StackEntry& next = slot.stack[slot.stackSize - 1];
+					if (next.count == 0) Prefetch(wideNodes[next.reference]);
+				}
+				else if (startRay(slot))
+				{
+					Prefetch(wideNodes[0]);
+				}
+				else
+				{
+					--activeCount;
+				}
+			}
+		}
+	}
+
+	template<bool AnyHit, template<unsigned int> class WideNode, unsigned int Width, typename IntersectLeaf>
+	bool IntersectWide(const std::vector<WideNode<Width>>& wideNodes, const Ray& ray, float& nearestDistance, IntersectLeaf& intersectLeaf) const
+	{
+		float tEntry = 0.0f;
+		if (!AABB::RayIntersectsBox(nodes[0].min, nodes[0].max, ray, nearestDistance, tEntry)) return false;
+
+		struct StackEntry
+		{
+			unsigned int reference;		// wide node index, or first primitive of a leaf
+			unsigned int count;			// primitive count for leaves
+			float distance;
+		};
+
+		WideBVHRay wideRay{ ray };
+		StackEntry stack[WIDEBVH_STACK_SIZE];
+		unsigned int stackSize = 0;
+		stack[stackSize++] = StackEntry{ 0, 0, tEntry };
+		bool hit = false;
+
+		while (stackSize > 0)
+		{
+			StackEntry entry = stack[--stackSize];
+			if (entry.distance > nearestDistance) continue;
+
+			if (entry.count > 0)
+			{
+				hit |= intersectLeaf(entry.reference, entry.count, nearestDistance);
+				if (AnyHit && hit) return true;
+				continue;
+			}
+
+			const WideNode<Width>& node = wideNodes[entry.reference];
+			alignas(32) float distances[Width];
+			unsigned int mask = IntersectChildren(node, wideRay, nearestDistance, distances);
+
+			unsigned int references[Width];
+			GetChildReferences(node, references);
+
+			// Push the children furthest first so that the closest one is popped next
+			StackEntry children[Width];
+			unsigned int childCount = 0;
+			for (unsigned int i = 0; i < Width; ++i)
+			{
+				if (!(mask & (1u << i))) continue;
+
+				unsigned int j = childCount++;
+				while (j > 0 && children[j - 1].distance < distances[i])
+				{
+					children[j] = children[j - 1];
+					--j;
+				}
+				children[j] = StackEntry{ references[i], node.count[i], distances[i] };
+			}
+
+			for (unsigned int i = 0; i < childCount; ++i)
+			{
+				stack[stackSize++] = children[i];
+			}
+		}
+
+		return hit;
+	}
+
+protected:
+	void BuildBinnedSAH(const std::vector<AABB>& primitiveBounds);
+	void BuildLinear(const std::vector<AABB>& primitiveBounds);	// lbvh.cpp
+	void BuildSpatial(const std::vector<AABB>& primitiveBounds);	// sbvh.cpp
+
+	struct SpatialBuild;
+	struct SpatialReference
+	{
+		AABB bounds;
+		unsigned int primitiveIndex;
+	};
+
+	void SubdivideSpatial(SpatialBuild& build, unsigned int nodeIndex, std::vector<SpatialReference>& references, unsigned int depth);
+
+	template<unsigned int Width>
+	unsigned int GatherChildren(unsigned int nodeIndex, unsigned int* slots) const;
+
+	template<unsigned int Width>
+	unsigned int Collapse(std::vector<WideBVHNode<Width>>& wideNodes, unsigned int nodeIndex);
+
+	template<unsigned int Width>
+	bool Compress(std::vector<CompressedBVHNode<Width>>& compressedNodes);
+
+	void BuildParentLinks();
+	void UpdateNodeBounds(BVHNode& node, const std::vector<AABB>& primitiveBounds);
+	void Subdivide(unsigned int nodeIndex, const std::vector<AABB>& primitiveBounds, const std::vector<vec3>& centroids, unsigned int depth);
+	float FindBestSplit(const BVHNode& node, const std::vector<AABB>& primitiveBounds, const std::vector<vec3>& centroids, int& axis, float& splitPosition);
+};
@@ -0,0 +1,217 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "../core/math.h"
+#include "../core/ray.h"
+#include "widebvh.h"
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#define COMPRESSEDBVH_MAX_LEAF_SIZE 255
+
+// 2^exponent built directly from the float bits, exponent must be in [-126, 127]
+inline float PowerOfTwo(int exponent)
+{
+	uint32_t bits = uint32_t(exponent + 127) << 23;
+	float value;
+	std::memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+/*
+	Wide node with child bounds quantized to 8 bits inside the bounds of the node
+	("Efficient Incoherent Ray Traversal on GPUs Through Compressed Wide BVHs", Ylitie et al. 2017).
+
+	The grid step along each axis is a power of two so that decoding is exact. Interior children
+	are stored next to each other starting at firstChild, and the primitives of all leaf children
+	are stored next to each other starting at firstPrimitive, so a child only needs its primitive count.
+	An 8-wide node takes 80 bytes instead of the 288 bytes of a WideBVHNode<8>.
+*/
+template<unsigned int Width>
+struct alignas(16) CompressedBVHNode
+{
+	vec3 origin;					// minimum corner of the node, the grid starts here
+	int8_t exponent[3];				// grid step is 2^exponent along each axis
+	uint8_t childCount;
+	unsigned int firstChild;		// first interior child node
+	unsigned int firstPrimitive;	// first primitive of the first leaf child
+	uint8_t minX[Width];
+	uint8_t minY[Width];
+	uint8_t minZ[Width];
+	uint8_t maxX[Width];
+	uint8_t maxY[Width];
+	uint8_t maxZ[Width];
+	uint8_t count[Width];			// primitive count for leaves, 0 for interior children
+
+	// Smallest power of two steps which let 255 steps cover the node
+	void SetGrid(const vec3& boundsMin, const vec3& boundsMax)
+	{
+		origin = boundsMin;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float extent = boundsMax[axis] - boundsMin[axis];
+			int e = -126;
+			if (extent > 0.0f)
+			{
+				std::frexp(extent / 255.0f, &e);
+				e = std::max(e, -126);
+			}
+			while (e < 127 && origin[axis] + 255.0f * PowerOfTwo(e) < boundsMax[axis]) ++e;
+			exponent[axis] = int8_t(e);
+		}
+	}
+
+	// Quantizes the child bounds outwards, the decoded box always contains the original
+	void SetChildBounds(unsigned int slot, const vec3& childMin, const vec3& childMax)
+	{
+		uint8_t* quantizedMin[3] = { minX, minY, minZ };
+		uint8_t* quantizedMax[3] = { maxX, maxY, maxZ };
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float step = PowerOfTwo(exponent[axis]);
+			float low = std::floor((childMin[axis] - origin[axis]) / step);
+			float high = std::ceil((childMax[axis] - origin[axis]) / step);
+			int qMin = int(std::min(std::max(low, 0.0f), 255.0f));
+			int qMax = int(std::min(std::max(high, 0.0f), 255.0f));
+			while (qMin > 0 && origin[axis] + float(qMin) * step > childMin[axis]) --qMin;
+			while (qMax < 255 && origin[axis] + float(qMax) * step < childMax[axis]) ++qMax;
+			quantizedMin[axis][slot] = uint8_t(qMin);
+			quantizedMax[axis][slot] = uint8_t(qMax);
+		}
+	}
+
+	void GetChildBounds(unsigned int slot, vec3& childMin, vec3& childMax) const
+	{
+		vec3 step{ PowerOfTwo(exponent[0]), PowerOfTwo(exponent[1]), PowerOfTwo(exponent[2]) };
+		childMin = origin + vec3{ float(minX[slot]), float(minY[slot]), float(minZ[slot]) } * step;
+		childMax = origin + vec3{ float(maxX[slot]), float(maxY[slot]), float(maxZ[slot]) } * step;
+	}
+};
+
+// Child node indices and leaf primitive offsets, in slot order
+template<unsigned int Width>
+inline void GetChildReferences(const CompressedBVHNode<Width>& node, unsigned int* references)
+{
+	unsigned int interiorIndex = node.firstChild;
+	unsigned int primitiveIndex = node.firstPrimitive;
+	for (unsigned int i = 0; i < node.childCount; ++i)
+	{
+		if (node.count[i] == 0)
+		{
+			references[i] = interiorIndex++;
+		}
+		else
+		{
+			references[i] = primitiveIndex;
+			primitiveIndex += node.count[i];
+		}
+	}
+}
+
+#ifdef WIDEBVH_USE_SSE
+inline __m128 DecodeQuantized4(const uint8_t* values)
+{
+	int packed;
+	std::memcpy(&packed, values, sizeof(packed));
+	__m128i zero = _mm_setzero_si128();
+	__m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+}
+#endif
+
+/*
+	Slab test against all children of a compressed node, same contract as IntersectChildren for WideBVHNode.
+	Planes are decoded relative to the ray origin as (origin - rayOrigin) + q * step.
+*/
+template<unsigned int Width>
+inline unsigned int IntersectChildren(const CompressedBVHNode<Width>& node, const WideBVHRay& ray, float maxDistance, float* tEntry)
+{
+	unsigned int mask = 0;
+	vec3 step{ PowerOfTwo(node.exponent[0]), PowerOfTwo(node.exponent[1]), PowerOfTwo(node.exponent[2]) };
+	vec3 offset = node.origin - ray.origin;
+
+#if defined(__AVX2__)
+	if constexpr (Width == 8)
+	{
+		auto decode = [](const uint8_t* values) {
+			return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)values)));
+		};
+
+		__m256 stepX = _mm256_set1_ps(step.x), offsetX = _mm256_set1_ps(offset.x);
+		__m256 t1 = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(decode(node.minX), stepX), offsetX), ray.invX8);
+		__m256 t2 = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(decode(node.maxX), stepX), offsetX), ray.invX8);
+		__m256 tmin = _mm256_max_ps(_mm256_min_ps(t1, t2), _mm256_setzero_ps());
+		__m256 tmax = _mm256_min_ps(_mm256_max_ps(t1, t2), _mm256_set1_ps(maxDistance));
+
+		__m256 stepY = _mm256_set1_ps(step.y), offsetY = _mm256_set1_ps(offset.y);
+		t1 = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(decode(node.minY), stepY), offsetY), ray.invY8);
+		t2 = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(decode(node.maxY), stepY), offsetY), ray.invY8);
+		tmin = _mm256_max_ps(tmin, _mm256_min_ps(t1, t2));
+		tmax = _mm256_min_ps(tmax, _mm256_max_ps(t1, t2));
+
+		__m256 stepZ = _mm256_set1_ps(step.z), offsetZ = _mm256_set1_ps(offset.z);
+		t1 = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(decode(node.minZ), stepZ), offsetZ), ray.invZ8);
+		t2 = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(decode(node.maxZ), stepZ), offsetZ), ray.invZ8);
+		tmin = _mm256_max_ps(tmin, _mm256_min_ps(t1, t2));
+		tmax = _mm256_min_ps(tmax, _mm256_max_ps(t1, t2));
+
+		_mm256_storeu_ps(tEntry, tmin);
+		mask = (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+	}
+	else
+#endif
+	{
+#ifdef WIDEBVH_USE_SSE
+		__m128 stepX = _mm_set1_ps(step.x), offsetX = _mm_set1_ps(offset.x);
+		__m128 stepY = _mm_set1_ps(step.y), offsetY = _mm_set1_ps(offset.y);
+		__m128 stepZ = _mm_set1_ps(step.z), offsetZ = _mm_set1_ps(offset.z);
+		for (unsigned int group = 0; group < Width; group += 4)
+		{
+			__m128 t1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(DecodeQuantized4(node.minX + group), stepX), offsetX), ray.invX);
+			__m128 t2 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(DecodeQuantized4(node.maxX + group), stepX), offsetX), ray.invX);
+			__m128 tmin = _mm_max_ps(_mm_min_ps(t1, t2), _mm_setzero_ps());
+			__m128 tmax = _mm_min_ps(_mm_max_ps(t1, t2), _mm_set1_ps(maxDistance));
+
+			t1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(DecodeQuantized4(node.minY + group), stepY), offsetY), ray.invY);
+			t2 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(DecodeQuantized4(node.maxY + group), stepY), offsetY), ray.invY);
+			tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+
+			t1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(DecodeQuantized4(node.minZ + group), stepZ), offsetZ), ray.invZ);
+			t2 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(DecodeQuantized4(node.maxZ + group), stepZ), offsetZ), ray.invZ);
+			tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+
+			_mm_storeu_ps(tEntry + group, tmin);
+			mask |= (unsigned int)_mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << group;
+		}
+#else
+		for (unsigned int i = 0; i < Width; ++i)
+		{
+			float t1 = (float(node.minX[i]) * step.x + offset.x) * ray.invDirection.x;
+			float t2 = (float(node.maxX[i]) * step.x + offset.x) * ray.invDirection.x;
+			float tmin = std::max(std::min(t1, t2), 0.0f);
+			float tmax = std::min(std::max(t1, t2), maxDistance);
+
+			t1 = (float(node.minY[i]) * step.y + offset.y) * ray.invDirection.y;
+			t2 = (float(node.maxY[i]) * step.y + offset.y) * ray.invDirection.y;
+			tmin = std::max(tmin, std::min(t1, t2));
+			tmax = std::min(tmax, std::max(t1, t2));
+
+			t1 = (float(node.minZ[i]) * step.z + offset.z) * ray.invDirection.z;
+			t2 = (float(node.maxZ[i]) * step.z + offset.z) * ray.invDirection.z;
+			tmin = std::max(tmin, std::min(t1, t2));
+			tmax = std::min(tmax, std::max(t1, t2));
+
+			tEntry[i] = tmin;
+			if (tmin <= tmax) mask |= 1 << i;
+		}
+#endif
+	}
+
+	return mask & ((1u << node.childCount) - 1u);
+}
@@ -0,0 +1,92 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "../core/aabb.h"
+#include "bvh.h"
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+/*
+	Bottom-level structure of an object with many primitives: a BVH and the primitives in its leaf order
+	as a structure of arrays (TriangleSoA, SphereSoA).
+
+	Double buffered so that a refined structure can be built while other threads trace the active one.
+	Queries load the active buffer once with Active() and only read that buffer.
+
+	The owner passes primitiveBounds() returning the bounds of every primitive, and
+	buildIntersectionData(SoA&, order) filling the arrays in the given primitive order.
+*/
+template<typename SoA>
+class DoubleBufferedStructure
+{
+public:
+	struct Buffer
+	{
+		BVH bvh;
+		SoA intersectionData;
+	};
+
+	SplitPrimitiveFunction splitPrimitive;		// clips primitives for spatial splits, optional
+
+	inline const Buffer& Active() const { return buffers[active.load(std::memory_order_acquire)]; }
+
+	// Must be called when the primitives change
+	void MarkDirty() { dirty = true; }
+
+	// Builds the active buffer unless it is up to date, moved primitives keep the tree topology unless it degraded too much
+	template<typename PrimitiveBounds, typename BuildIntersectionData>
+	void Build(const BVHSettings& settings, PrimitiveBounds&& primitiveBounds, BuildIntersectionData&& buildIntersectionData)
+	{
+		unsigned int current = active.load();
+		Buffer& buffer = buffers[current];
+		if (!dirty && buffer.bvh.IsConfiguredAs(settings)) return;
+
+		// Nothing traces the object during a build, the buffer replaced by the last refinement can go
+		buffers[1 - current] = Buffer{};
+
+		BuildBuffer(buffer, settings, buffer.bvh.IsConfiguredAs(settings), primitiveBounds(), buildIntersectionData);
+		dirty = false;
+	}
+
+	// Builds the inactive buffer with settings and swaps it in, safe while other threads trace the active one
+	template<typename PrimitiveBounds, typename BuildIntersectionData>
+	void Refine(const BVHSettings& settings, PrimitiveBounds&& primitiveBounds, BuildIntersectionData&& buildIntersectionData)
+	{
+		// Instances of a shared object can ask for the same refinement from several threads
+		std::lock_guard<std::mutex> lock(refineMutex);
+
+		unsigned int current = active.load();
+		if (dirty || buffers[current].bvh.IsConfiguredAs(settings)) return;
+
+		BuildBuffer(buffers[1 - current], settings, false, primitiveBounds(), buildIntersectionData);
+		active.store(1 - current, std::memory_order_release);
+	}
+
+private:
+	Buffer buffers[2];
+	std::atomic<unsigned int> active{ 0 };
+	std::mutex refineMutex;
+	bool dirty = true;
+
+	template<typename BuildIntersectionData>
+	void BuildBuffer(Buffer& buffer, const BVHSettings& settings, bool update, const std::vector<AABB>& bounds, BuildIntersectionData& buildIntersectionData)
+	{
+		buffer.bvh.splitPrimitive = splitPrimitive;
+		if (update)
+		{
+			buffer.bvh.Update(bounds);
+		}
+		else
+		{
+			buffer.bvh.Configure(settings);
+			buffer.bvh.Build(bounds);
+		}
+		buffer.bvh.splitPrimitive = nullptr;
+
+		buildIntersectionData(buffer.intersectionData, buffer.bvh.PrimitiveIndices());
+	}
+};
@@ -0,0 +1,346 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "../core/math.h"
+#include "../core/aabb.h"
+#include "../objects/object.h"
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#define KDTREE_MAX_DEPTH 64
+#define KDTREE_MAILBOX_SIZE 16
+
+/*
+	8 byte node. Interior nodes store the split plane, the child below the plane is the next node
+	and the child above is stored at aboveChild. Leaves store a range of the flattened object list.
+*/
+struct KdTreeNode
+{
+	union
+	{
+		float split;
+		unsigned int firstObject;
+	};
+	unsigned int flags;		// axis in the two low bits (3 for leaves), above child or object count in the rest
+
+	inline bool IsLeaf() const { return (flags & 3) == 3; }
+	inline int Axis() const { return int(flags & 3); }
+	inline unsigned int AboveChild() const { return flags >> 2; }
+	inline unsigned int ObjectCount() const { return flags >> 2; }
+
+	void MakeLeaf(unsigned int first, unsigned int count)
+	{
+		firstObject = first;
+		flags = 3 | (count << 2);
+	}
+
+	void MakeInterior(int axis, float position)
+	{
+		split = position;
+		flags = (unsigned int)axis;
+	}
+
+	void SetAboveChild(unsigned int index) { flags |= index << 2; }
+};
+
+/*
+	Kd-tree over object bounds with surface area heuristic splits
+	("On building fast kd-Trees for Ray Tracing, and on doing that in O(N log N)", Wald and Havran 2006,
+	the candidate planes are sorted per node here which is O(N log^2 N)).
+
+	Traversal visits the cells along the ray front to back with a short stack of far children,
+	so it can stop as soon as a hit is closer than the entry of the next cell.
+*/
+class KdTree
+{
+protected:
+	std::vector<KdTreeNode> nodes;
+	std::vector<Object*> nodeObjects;
+	AABB bounds;
+
+	struct BoundEdge
+	{
+		float position;
+		unsigned int object;
+		bool start;
+
+		bool operator<(const BoundEdge& other) const
+		{
+			if (position == other.position) return start && !other.start;
+			return position < other.position;
+		}
+	};
+
+	/*
+		Objects are referenced from every leaf they overlap. A small per-ray cache of the tested objects
+		keeps large objects (walls, meshes) from being intersected again in each of those leaves.
+	*/
+	struct Mailbox
+	{
+		const Object* tested[KDTREE_MAILBOX_SIZE] = {};
+
+		inline bool TestOnce(const Object* object)
+		{
+			unsigned int slot = (unsigned int)((reinterpret_cast<uintptr_t>(object) >> 4) & (KDTREE_MAILBOX_SIZE - 1));
+			if (tested[slot] == object) return false;
+			tested[slot] = object;
+			return true;
+		}
+	};
+
+	struct StackEntry
+	{
+		unsigned int node;
+		float tMin;
+		float tMax;
+	};
+
+public:
+	float traversalCost = 1.0f;
+	float intersectionCost = 80.0f;
+	float emptyBonus = 0.5f;			// cost reduction for splits which cut off empty space
+	unsigned int maxObjects = 1;		// leaves are only forced for this many objects, otherwise the SAH decides
+
+	KdTree() = default;
+	~KdTree() = default;
+
+	void Clear()
+	{
+		nodes.clear();
+		nodeObjects.clear();
+	}
+
+	inline size_t NodeCount() const { return nodes.size(); }
+	inline size_t MemoryUsage() const { return nodes.capacity() * sizeof(KdTreeNode) + nodeObjects.capacity() * sizeof(Object*); }
+
+	void Fill(std::vector<Object*>& objects)
+	{
+		Clear();
+		if (objects.empty()) return;
+
+		bounds = AABB::Empty();
+		std::vector<unsigned int> objectIndices(objects.size());
+		for (unsigned int i = 0; i < objects.size(); ++i)
+		{
+			bounds.Encapsulate(objects[i]->aabb);
+			objectIndices[i] = i;
+		}
+
+		unsigned int maxDepth = std::min((unsigned int)KDTREE_MAX_DEPTH - 1, (unsigned int)std::lround(8.0f + 1.3f * std::log2(float(objects.size()))));
+		std::vector<BoundEdge> edges(2 * objects.size());
+		Subdivide(objects, objectIndices, bounds, maxDepth, 0, edges);
+
+		nodes.shrink_to_fit();
+		nodeObjects.shrink_to_fit();
+	}
+
+	bool Intersect(Ray& ray, RayIntersectionInfo& hitInfo) const
+	{
+		hitInfo.Reset();
+		if (nodes.empty()) return false;
+
+		RayIntersectionInfo newHit;
+		Mailbox mailbox;
+		Traverse(ray, FLOAT_INFINITY, [&](const KdTreeNode& leaf) {
+			for (unsigned int i = 0; i < leaf.ObjectCount(); ++i)
+			{
+				Object* object = nodeObjects[leaf.firstObject + i];
+				if (mailbox.TestOnce(object) && object->Intersects(ray.origin, ray.direction, newHit) && newHit.hitDistance < hitInfo.hitDistance)
+				{
+					hitInfo = newHit;
+				}
+			}
+
+			// Objects can reach into later cells, only a hit in front of the next cell ends the traversal
+			return hitInfo.hitDistance;
+		});
+
+		return (hitInfo.object != nullptr);
+	}
+
+	// Any hit closer than maxDistance
+	bool Occluded(Ray& ray, float maxDistance) const
+	{
+		if (nodes.empty()) return false;
+
+		bool occluded = false;
+		Mailbox mailbox;
+		Traverse(ray, maxDistance, [&](const KdTreeNode& leaf) {
+			for (unsigned int i = 0; i < leaf.ObjectCount() && !occluded; ++i)
+			{
+				Object* object = nodeObjects[leaf.firstObject + i];
+				occluded = mailbox.TestOnce(object) && object->Occludes(ray, maxDistance);
+			}
+			return occluded ? -FLOAT_INFINITY : maxDistance;
+		});
+
+		return occluded;
+	}
+
+protected:
+	// Calls visitLeaf(leaf) for the leaves along the ray front to back, it returns the distance beyond which cells can be skipped
+	template<typename LeafFunction>
+	void Traverse(Ray& ray, float maxDistance, LeafFunction visitLeaf) const
+	{
+		float tMin = 0.0f, tMax = 0.0f;
+		if (!AABB::RayIntersectsBox(bounds.min, bounds.max, ray, maxDistance, tMin, tMax)) return;
+
+		StackEntry stack[KDTREE_MAX_DEPTH];
+		unsigned int stackSize = 0;
+		unsigned int nodeIndex = 0;
+		float nearest = maxDistance;
+		while (true)
+		{
+			if (nearest < tMin) break;
+
+			const KdTreeNode& node = nodes[nodeIndex];
+			if (!node.IsLeaf())
+			{
+				int axis = node.Axis();
+				float tPlane = (node.split - ray.origin[axis]) * ray.invDirection[axis];
+
+				bool belowFirst = (ray.origin[axis] < node.split) || (ray.origin[axis] == node.split && ray.direction[axis] <= 0.0f);
+				unsigned int firstChild = belowFirst ? nodeIndex + 1 : node.AboveChild();
+				unsigned int secondChild = belowFirst ? node.AboveChild() : nodeIndex + 1;
+
+				if (tPlane > tMax || tPlane <= 0.0f)
+				{
+					nodeIndex = firstChild;
+				}
+				else if (tPlane < tMin)
+				{
+					nodeIndex = secondChild;
+				}
+				else
+				{
+					stack[stackSize++] = StackEntry{ secondChild, tPlane, tMax };
+					nodeIndex = firstChild;
+					tMax = tPlane;
+				}
+				continue;
+			}
+
+			nearest = std::min(nearest, visitLeaf(node));
+
+			if (stackSize == 0) break;
+			--stackSize;
+			nodeIndex = stack[stackSize].node;
+			tMin = stack[stackSize].tMin;
+			tMax = stack[stackSize].tMax;
+		}
+	}
+
+	void Subdivide(std::vector<Object*>& objects, std::vector<unsigned int>& objectIndices, const AABB& nodeBounds, unsigned int depth, unsigned int badRefines, std::vector<BoundEdge>& edges)
+	{
+		unsigned int nodeIndex = (unsigned int)nodes.size();
+		nodes.emplace_back();
+
+		unsigned int count = (unsigned int)objectIndices.size();
+		auto makeLeaf = [&]() {
+			nodes[nodeIndex].MakeLeaf((unsigned int)nodeObjects.size(), count);
+			for (unsigned int index : objectIndices)
+			{
+				nodeObjects.push_back(objects[index]);
+			}
+		};
+
+		if (count <= maxObjects || depth == 0)
+		{
+			makeLeaf();
+			return;
+		}
+
+		/*
+			Sweep the sorted bound edges of each axis, starting with the widest one
+		*/
+		vec3 extent = nodeBounds.max - nodeBounds.min;
+		float totalArea = nodeBounds.SurfaceArea();
+		float leafCost = intersectionCost * float(count);
+		float bestCost = FLOAT_INFINITY;
+		int bestAxis = -1;
+		unsigned int bestOffset = 0;
+
+		int axis = (extent.y > extent.x) ? 1 : 0;
+		if (extent.z > extent[axis]) axis = 2;
+		for (int retries = 0; retries < 3 && bestAxis == -1; ++retries, axis = (axis + 1) % 3)
+		{
+			for (unsigned int i = 0; i < count; ++i)
+			{
+				const AABB& objectBounds = objects[objectIndices[i]]->aabb;
+				edges[2 * i] = BoundEdge{ objectBounds.min[axis], objectIndices[i], true };
+				edges[2 * i + 1] = BoundEdge{ objectBounds.max[axis], objectIndices[i], false };
+			}
+			std::sort(edges.begin(), edges.begin() + 2 * count);
+
+			int otherAxis0 = (axis + 1) % 3;
+			int otherAxis1 = (axis + 2) % 3;
+			float crossArea = extent[otherAxis0] * extent[otherAxis1];
+			float crossPerimeter = extent[otherAxis0] + extent[otherAxis1];
+
+			unsigned int below = 0, above = count;
+			for (unsigned int i = 0; i < 2 * count; ++i)
+			{
+				if (!edges[i].start) --above;
+
+				float position = edges[i].position;
+				if (position > nodeBounds.min[axis] && position < nodeBounds.max[axis])
+				{
+					float areaBelow = 2.0f * (crossArea + (position - nodeBounds.min[axis]) * crossPerimeter);
+					float areaAbove = 2.0f * (crossArea + (nodeBounds.max[axis] - position) * crossPerimeter);
+					float bonus = (below == 0 || above == 0) ? emptyBonus : 0.0f;
+					float cost = traversalCost + intersectionCost * (1.0f - bonus) * (areaBelow * float(below) + areaAbove * float(above)) / totalArea;
+					if (cost < bestCost)
+					{
+						bestCost = cost;
+						bestAxis = axis;
+						bestOffset = i;
+					}
+				}
+
+				if (edges[i].start) ++below;
+			}
+
+			// The edges of the best axis are still needed for the classification below
+			if (bestAxis != -1) break;
+		}
+
+		if (bestCost > leafCost) ++badRefines;
+		if ((bestCost > 4.0f * leafCost && count < 16) || bestAxis == -1 || badRefines == 3)
+		{
+			makeLeaf();
+			return;
+		}
+
+		/*
+			Objects starting before the plane go below, objects ending after it go above
+		*/
+		std::vector<unsigned int> belowIndices, aboveIndices;
+		belowIndices.reserve(count);
+		aboveIndices.reserve(count);
+		for (unsigned int i = 0; i < bestOffset; ++i)
+		{
+			if (edges[i].start) belowIndices.push_back(edges[i].object);
+		}
+		for (unsigned int i = bestOffset + 1; i < 2 * count; ++i)
+		{
+			if (!edges[i].start) aboveIndices.push_back(edges[i].object);
+		}
+
+		float split = edges[bestOffset].position;
+		AABB belowBounds = nodeBounds, aboveBounds = nodeBounds;
+		belowBounds.max[bestAxis] = split;
+		aboveBounds.min[bestAxis] = split;
+
+		nodes[nodeIndex].MakeInterior(bestAxis, split);
+		std::vector<unsigned int>().swap(objectIndices);
+
+		Subdivide(objects, belowIndices, belowBounds, depth - 1, badRefines, edges);
+		nodes[nodeIndex].SetAboveChild((unsigned int)nodes.size());
+		Subdivide(objects, aboveIndices, aboveBounds, depth - 1, badRefines, edges);
+	}
+};
@@ -0,0 +1,304 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#include "bvh.h"
+#include "../core/parallel.h"
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/*
+	Linear BVH builder
+
+	Based on "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees" (Karras 2012).
+	Primitives are sorted along a Morton curve, after which every internal node of the hierarchy
+	can be determined independently from the sorted codes.
+*/
+
+namespace
+{
+	inline int CountLeadingZeros(uint32_t x)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		return _BitScanReverse(&index, x) ? 31 - int(index) : 32;
+#else
+		return (x == 0) ? 32 : __builtin_clz(x);
+#endif
+	}
+
+	// Spreads the lower 10 bits so that there are two zero bits between each of them
+	inline uint32_t ExpandBits(uint32_t v)
+	{
+		v = (v * 0x00010001u) & 0xFF0000FFu;
+		v = (v * 0x00000101u) & 0x0F00F00Fu;
+		v = (v * 0x00000011u) & 0xC30C30C3u;
+		v = (v * 0x00000005u) & 0x49249249u;
+		return v;
+	}
+
+	// 30-bit Morton code for a point in the unit cube
+	inline uint32_t MortonCode(vec3 p)
+	{
+		p = glm::clamp(p * 1024.0f, vec3{ 0.0f }, vec3{ 1023.0f });
+		return (ExpandBits(uint32_t(p.x)) << 2) | (ExpandBits(uint32_t(p.y)) << 1) | ExpandBits(uint32_t(p.z));
+	}
+
+	// Stable LSD radix sort of codes (and their primitive indices), 8 bits per pass
+	void ParallelRadixSort(std::vector<uint32_t>& codes, std::vector<unsigned int>& indices)
+	{
+		unsigned int count = (unsigned int)codes.size();
+		unsigned int threadCount = std::min(ParallelThreadCount(), std::max(1u, count / 4096));
+		unsigned int rangeSize = (count + threadCount - 1) / threadCount;
+
+		std::vector<uint32_t> codesOut(count);
+		std::vector<unsigned int> indicesOut(count);
+		std::vector<unsigned int> histograms(threadCount * 256);
+
+		for (unsigned int shift = 0; shift < 32; shift += 8)
+		{
+			std::fill(histograms.begin(), histograms.end(), 0);
+			ParallelForThreads(threadCount, [&](unsigned int t) {
+				unsigned int* histogram = &histograms[t * 256];
+				unsigned int end = std::min(count, (t + 1) * rangeSize);
+				for (unsigned int i = t * rangeSize; i < end; ++i)
+				{
+					histogram[(codes[i] >> shift) & 0xFF]++;
+				}
+			});
+
+			// Exclusive prefix sum ordered by digit first and thread second keeps the sort stable
+			unsigned int offset = 0;
+			for (unsigned int digit = 0; digit < 256; ++digit)
+			{
+				for (unsigned int t = 0; t < threadCount; ++t)
+				{
+					unsigned int digitCount = histograms[t * 256 + digit];
+					histograms[t * 256 + digit] = offset;
+					offset += digitCount;
+				}
+			}
+
+			ParallelForThreads(threadCount, [&](unsigned int t) {
+				unsigned int* offsets = &histograms[t * 256];
+				unsigned int end = std::min(count, (t + 1) * rangeSize);
+				for (unsigned int i = t * rangeSize; i < end; ++i)
+				{
+					unsigned int destination = offsets[(codes[i] >> shift) & 0xFF]++;
+					codesOut[destination] = codes[i];
+					indicesOut[destination] = indices[i];
+				}
+			});
+
+			codes.swap(codesOut);
+			indices.swap(indicesOut);
+		}
+	}
+
+	struct LinearNode
+	{
+		unsigned int left;		// child references, LINEAR_LEAF_FLAG marks a sorted primitive index
+		unsigned int right;
+		unsigned int first;		// range of sorted primitives below this node
+		unsigned int last;
+	};
+
+	const unsigned int LINEAR_LEAF_FLAG = 0x80000000u;
+}
+
+void BVH::BuildLinear(const std::vector<AABB>& primitiveBounds)
+{
+	// Centroid bounds for Morton code quantization
+	unsigned int threadCount = ParallelThreadCount();
+	std::vector<AABB> threadBounds(threadCount, AABB::Empty());
+	unsigned int rangeSize = (primitiveCount + threadCount - 1) / threadCount;
+	ParallelForThreads(threadCount, [&](unsigned int t) {
+		unsigned int end = std::min(primitiveCount, (t + 1) * rangeSize);
+		for (unsigned int i = t * rangeSize; i < end; ++i)
+		{
+			threadBounds[t].Encapsulate(primitiveBounds[i].Centroid());
+		}
+	});
+
+	AABB centroidBounds = AABB::Empty();
+	for (AABB& bounds : threadBounds)
+	{
+		centroidBounds.Encapsulate(bounds);
+	}
+
+	vec3 extent = centroidBounds.max - centroidBounds.min;
+	vec3 scale{
+		extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+		extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+		extent.z > 0.0f ? 1.0f / extent.z : 0.0f
+	};
+
+	std::vector<uint32_t> codes(primitiveCount);
+	primitiveIndices.resize(primitiveCount);
+	ParallelForRange(primitiveCount, [&](unsigned int begin, unsigned int end) {
+		for (unsigned int i = begin; i < end; ++i)
+		{
+			codes[i] = MortonCode((primitiveBounds[i].Centroid() - centroidBounds.min) * scale);
+			primitiveIndices[i] = i;
+		}
+	});
+
+	ParallelRadixSort(codes, primitiveIndices);
+
+	if (primitiveCount == 1)
+	{
+		nodes.emplace_back();
+		nodes[0].leftFirst = 0;
+		nodes[0].count = 1;
+		UpdateNodeBounds(nodes[0], primitiveBounds);
+		return;
+	}
+
+	/*
+		Hierarchy emission, each internal node finds its range and split position on its own
+	*/
+	int count = int(primitiveCount);
+	auto delta = [&](int i, int j) -> int {
+		if (j < 0 || j >= count) return -1;
+		if (codes[i] == codes[j]) return 32 + CountLeadingZeros(uint32_t(i ^ j));
+		return CountLeadingZeros(codes[i] ^ codes[j]);
+	};
+
+	std::vector<LinearNode> internalNodes(primitiveCount - 1);
+	std::vector<unsigned int> internalParents(primitiveCount - 1, 0);
+	std::vector<unsigned int> leafParents(primitiveCount, 0);
+	ParallelForRange(primitiveCount - 1, [&](unsigned int begin, unsigned int end) {
+		for (int i = int(begin); i < int(end); ++i)
+		{
+			int direction = (delta(i, i + 1) - delta(i, i - 1)) >= 0 ? 1 : -1;
+			int deltaMin = delta(i, i - direction);
+
+			int lengthMax = 2;
+			while (delta(i, i + lengthMax * direction) > deltaMin) lengthMax *= 2;
+
+			int length = 0;
+			for (int t = lengthMax / 2; t >= 1; t /= 2)
+			{
+				if (delta(i, i + (length + t) * direction) > deltaMin) length += t;
+			}
+
+			int j = i + length * direction;
+			int deltaNode = delta(i, j);
+
+			int split = 0;
+			int divisor = 2;
+			int t = 0;
+			do
+			{
+				t = (length + divisor - 1) / divisor;
+				if (delta(i, i + (split + t) * direction) > deltaNode) split += t;
+				divisor *= 2;
+			} while (t > 1);
+
+			int gamma = i + split * direction + std::min(direction, 0);
+			LinearNode& node = internalNodes[i];
+			node.first = unsigned(std::min(i, j));
+			node.last = unsigned(std::max(i, j));
+			node.left = (node.first == unsigned(gamma)) ? (unsigned(gamma) | LINEAR_LEAF_FLAG) : unsigned(gamma);
+			node.right = (node.last == unsigned(gamma + 1)) ? (unsigned(gamma + 1) | LINEAR_LEAF_FLAG) : unsigned(gamma + 1);
+
+			if (node.left & LINEAR_LEAF_FLAG) leafParents[gamma] = i;
+			else internalParents[gamma] = i;
+
+			if (node.right & LINEAR_LEAF_FLAG) leafParents[gamma + 1] = i;
+			else internalParents[gamma + 1] = i;
+		}
+	});
+
+	/*
+		Bottom-up bounds, the second thread to arrive at a node has both child bounds available
+	*/
+	std::vector<AABB> internalBounds(primitiveCount - 1);
+	std::unique_ptr<std::atomic<unsigned int>[]> arrivals(new std::atomic<unsigned int>[primitiveCount - 1]);
+	for (unsigned int i = 0; i < primitiveCount - 1; ++i)
+	{
+		arrivals[i].store(0, std::memory_order_relaxed);
+	}
+
+	auto childBounds = [&](unsigned int reference) -> const AABB& {
+		if (reference & LINEAR_LEAF_FLAG) return primitiveBounds[primitiveIndices[reference & ~LINEAR_LEAF_FLAG]];
+		return internalBounds[reference];
+	};
+
+	ParallelForRange(primitiveCount, [&](unsigned int begin, unsigned int end) {
+		for (unsigned int i = begin; i < end; ++i)
+		{
+			unsigned int nodeIndex = leafParents[i];
+			while (true)
+			{
+				if (arrivals[nodeIndex].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+
+				LinearNode& node = internalNodes[nodeIndex];
+				AABB bounds = childBounds(node.left);
+				bounds.Encapsulate(childBounds(node.right));
+				internalBounds[nodeIndex] = bounds;
+
+				if (nodeIndex == 0) break;
+				nodeIndex = internalParents[nodeIndex];
+			}
+		}
+	});
+
+	/*
+		Convert to the node layout shared with the SAH builder (siblings next to each other).
+		Subtrees with few enough primitives become leaves, their primitives are already contiguous.
+	*/
+	nodes.reserve(2 * primitiveCount - 1);
+	nodes.emplace_back();
+
+	struct PendingNode
+	{
+		unsigned int nodeIndex;
+		unsigned int reference;
+	};
+
+	std::vector<PendingNode> pending;
+	pending.push_back(PendingNode{ 0, 0 });
+	while (!pending.empty())
+	{
+		PendingNode current = pending.back();
+		pending.pop_back();
+
+		const AABB& bounds = childBounds(current.reference);
+		nodes[current.nodeIndex].min = bounds.min;
+		nodes[current.nodeIndex].max = bounds.max;
+
+		if (current.reference & LINEAR_LEAF_FLAG)
+		{
+			nodes[current.nodeIndex].leftFirst = current.reference & ~LINEAR_LEAF_FLAG;
+			nodes[current.nodeIndex].count = 1;
+			continue;
+		}
+
+		const LinearNode& node = internalNodes[current.reference];
+		unsigned int rangeCount = node.last - node.first + 1;
+		if (rangeCount <= maxLeafSize)
+		{
+			nodes[current.nodeIndex].leftFirst = node.first;
+			nodes[current.nodeIndex].count = rangeCount;
+			continue;
+		}
+
+		unsigned int leftIndex = (unsigned int)nodes.size();
+		nodes.emplace_back();
+		nodes.emplace_back();
+		nodes[current.nodeIndex].leftFirst = leftIndex;
+		nodes[current.nodeIndex].count = 0;
+
+		pending.push_back(PendingNode{ leftIndex + 1, node.right });
+		pending.push_back(PendingNode{ leftIndex, node.left });
+	}
+
+	nodes.shrink_to_fit();
+}
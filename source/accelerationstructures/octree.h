@@ -10,228 +10,263 @@
 #include <vector>
 #include <algorithm>
 #include <iostream>
-#include <set>
 
 #define SUBNODE_COUNT 8
+#define OCTREE_MAX_DEPTH 8
 
+struct OctreeNode
+{
+	vec3 min;
+	unsigned int firstChild = 0;	// index of SUBNODE_COUNT consecutive children in Morton order, 0 for leaves
+	vec3 max;
+	unsigned int firstObject = 0;	// index into the flattened object list
+	unsigned int objectCount = 0;	// objects stored in this node
+
+	inline bool IsLeaf() const { return firstChild == 0; }
+};
+
+/*
+	Linear octree stored in one contiguous array.
+	Children of a node are stored next to each other in Morton order: child index = x | y << 1 | z << 2.
+	Objects overlapping several leaves are referenced from each of them, except objects
+	overlapping every child which stay in the interior node so that they are only tested once.
+*/
 class Octree
 {
 protected:
-	bool isSubdivided = false;
-	std::vector<Object*> objects;
-	Octree* subnodes[SUBNODE_COUNT];
-
-	struct OctreeIntersectionInfo
-	{
-		Octree* octree = nullptr;
-		float hitDistance = FLOAT_INFINITY;
-	};
+	std::vector<OctreeNode> nodes;
+	std::vector<Object*> nodeObjects;
 
 public:
-	unsigned int maxCount = 1;
-	AABB aabb;
+	unsigned int maxCount = 4;		// objects per leaf before it is subdivided
+	unsigned int maxDepth = OCTREE_MAX_DEPTH;
 
-	Octree()
-	{}
+	Octree() = default;
+	~Octree() = default;
 
-	~Octree()
+	void Clear()
 	{
-		Clear();
+		nodes.clear();
+		nodeObjects.clear();
 	}
 
-	void Clear()
+	inline size_t NodeCount() const { return nodes.size(); }
+	inline size_t MemoryUsage() const { return nodes.capacity() * sizeof(OctreeNode) + nodeObjects.capacity() * sizeof(Object*); }
+
+	void Fill(std::vector<Object*>& newObjects, unsigned int maxCountPerLeaf = 4, unsigned int maxTreeDepth = OCTREE_MAX_DEPTH)
 	{
-		Merge();
-		aabb.Reset();
-		objects.clear();
+		Clear();
+		if (newObjects.empty()) return;
+
+		maxCount = std::max(1u, maxCountPerLeaf);
+		maxDepth = std::min(maxTreeDepth, (unsigned int)OCTREE_MAX_DEPTH);
+
+		AABB bounds = AABB::Empty();
+		for (Object* object : newObjects)
+		{
+			bounds.Encapsulate(object->aabb);
+		}
+
+		nodes.emplace_back();
+		nodes[0].min = bounds.min;
+		nodes[0].max = bounds.max;
+		Subdivide(0, newObjects, 0);
 	}
 
-	// Recursive
-	void InsertIfOverlaps(Object* newObject)
+	bool Intersect(Ray& ray, RayIntersectionInfo& hitInfo) const
 	{
-		if (!newObject) return;
+		hitInfo.Reset();
+		if (nodes.empty()) return false;
+
+		float tEntry = 0.0f;
+		if (!AABB::RayIntersectsBox(nodes[0].min, nodes[0].max, ray, hitInfo.hitDistance, tEntry)) return false;
+
+		// Every level pushes at most 7 siblings while descending into the closest child
+		unsigned int stack[OCTREE_MAX_DEPTH * (SUBNODE_COUNT - 1) + 1];
+		float stackDistance[OCTREE_MAX_DEPTH * (SUBNODE_COUNT - 1) + 1];
+		unsigned int stackSize = 0;
+		stack[stackSize] = 0;
+		stackDistance[stackSize++] = tEntry;
 
-		if (aabb.Overlaps(newObject->aabb))
+		RayIntersectionInfo newHit;
+		while (stackSize > 0)
 		{
-			AddUnique(newObject);
+			--stackSize;
 
-			if (isSubdivided)
+			// A hit found in an earlier cell can lie beyond the entry of this one, only skip cells behind it
+			if (stackDistance[stackSize] > hitInfo.hitDistance) continue;
+
+			const OctreeNode& node = nodes[stack[stackSize]];
+			for (unsigned int i = 0; i < node.objectCount; ++i)
+			{
+				Object* object = nodeObjects[node.firstObject + i];
+				if (object->Intersects(ray.origin, ray.direction, newHit) && newHit.hitDistance < hitInfo.hitDistance)
+				{
+					hitInfo = newHit;
+				}
+			}
+
+			if (node.IsLeaf()) continue;
+
+			// Sort the children which are hit by entry distance, furthest first so the closest is popped next
+			unsigned int childIndices[SUBNODE_COUNT];
+			float childDistances[SUBNODE_COUNT];
+			unsigned int childCount = 0;
+			for (unsigned int i = 0; i < SUBNODE_COUNT; ++i)
 			{
-				for (int i = 0; i < SUBNODE_COUNT; ++i)
+				const OctreeNode& child = nodes[node.firstChild + i];
+				if (child.IsLeaf() && child.objectCount == 0) continue;
+				if (!AABB::RayIntersectsBox(child.min, child.max, ray, hitInfo.hitDistance, tEntry)) continue;
+
+				unsigned int j = childCount++;
+				while (j > 0 && childDistances[j - 1] < tEntry)
 				{
-					subnodes[i]->InsertIfOverlaps(newObject);
+					childIndices[j] = childIndices[j - 1];
+					childDistances[j] = childDistances[j - 1];
+					--j;
 				}
+				childIndices[j] = node.firstChild + i;
+				childDistances[j] = tEntry;
 			}
-			else if (objects.size() > maxCount)
+
+			for (unsigned int i = 0; i < childCount; ++i)
 			{
-				Subdivide();
+				stack[stackSize] = childIndices[i];
+				stackDistance[stackSize++] = childDistances[i];
 			}
 		}
-	}
 
-	bool HasObject(Object* object)
-	{
-		return std::find(objects.begin(), objects.end(), object) != objects.end();
+		return (hitInfo.object != nullptr);
 	}
 
-	void Fill(std::vector<Object*>& newObjects, unsigned int maxCountPerSubdivision = 1)
+	// Shadow ray query, returns as soon as any object is hit closer than maxDistance (cells are visited in any order)
+	bool Occluded(Ray& ray, float maxDistance) const
 	{
-		Clear();
+		if (nodes.empty()) return false;
 
-		maxCount = maxCountPerSubdivision;
-		objects = std::vector<Object*>(newObjects.begin(), newObjects.end());
-		for (Object* object : objects)
-		{
-			aabb.Encapsulate(object->aabb);
-		}
+		float tEntry = 0.0f;
+		if (!AABB::RayIntersectsBox(nodes[0].min, nodes[0].max, ray, maxDistance, tEntry)) return false;
 
-		if (objects.size() > maxCount)
-		{
-			Subdivide();
-		}
-	}
+		unsigned int stack[OCTREE_MAX_DEPTH * (SUBNODE_COUNT - 1) + 1];
+		unsigned int stackSize = 0;
+		stack[stackSize++] = 0;
 
-	bool Intersect(Ray& ray, RayIntersectionInfo& hitInfo) const
-	{
-		if (aabb.IntersectsRay(ray.origin, ray.direction, hitInfo.hitDistance))
+		while (stackSize > 0)
 		{
-			hitInfo.Reset();
-			RayIntersectionInfo newHit;
-
-			if (isSubdivided)
+			const OctreeNode& node = nodes[stack[--stackSize]];
+			for (unsigned int i = 0; i < node.objectCount; ++i)
 			{
-				std::vector<OctreeIntersectionInfo> attempts(8);
-				for (int i = 0; i < SUBNODE_COUNT; ++i)
-				{
-					attempts[i].octree = subnodes[i];
-					subnodes[i]->aabb.IntersectsRay(ray.origin, ray.direction, attempts[i].hitDistance);
-				}
+				if (nodeObjects[node.firstObject + i]->Occludes(ray, maxDistance)) return true;
+			}
 
-				std::sort(attempts.begin(), attempts.end(), [](OctreeIntersectionInfo& a, OctreeIntersectionInfo& b) {
-					return a.hitDistance <= b.hitDistance;
-				});
+			if (node.IsLeaf()) continue;
 
-				for (OctreeIntersectionInfo& info : attempts)
-				{
-					if (info.octree->Intersect(ray, newHit))
-					{
-						return true;
-					}
-				}
-				
-				return false;
-			}
-			else
+			for (unsigned int i = 0; i < SUBNODE_COUNT; ++i)
 			{
-				for (Object* object : objects)
-				{
-					if (object->Intersects(ray.origin, ray.direction, newHit) && newHit.hitDistance < hitInfo.hitDistance)
-					{
-						hitInfo = newHit;
-					}
-				}
-			}
+				const OctreeNode& child = nodes[node.firstChild + i];
+				if (child.IsLeaf() && child.objectCount == 0) continue;
+				if (!AABB::RayIntersectsBox(child.min, child.max, ray, maxDistance, tEntry)) continue;
 
-			return (hitInfo.object != nullptr);
+				stack[stackSize++] = node.firstChild + i;
+			}
 		}
 
 		return false;
 	}
 
-	void PrintDebug(int depth = 0)
+	void PrintDebug(unsigned int nodeIndex = 0, int depth = 0)
 	{
+		if (nodeIndex >= nodes.size()) return;
+
 		for (int i = 0; i < depth; i++)
 		{
 			std::cout << "  ";
 		}
 
-		std::cout << objects.size() << "\r\n";
+		std::cout << nodes[nodeIndex].objectCount << "\r\n";
 
-		if (isSubdivided)
+		if (!nodes[nodeIndex].IsLeaf())
 		{
-			for (int i = 0; i < SUBNODE_COUNT; ++i)
+			for (unsigned int i = 0; i < SUBNODE_COUNT; ++i)
 			{
-				subnodes[i]->PrintDebug(depth + 1);
+				PrintDebug(nodes[nodeIndex].firstChild + i, depth + 1);
 			}
 		}
 	}
 
 protected:
-	void AddUnique(Object* newObject)
+	static inline bool Overlaps(const OctreeNode& node, const AABB& bounds)
 	{
-		if (!HasObject(newObject))
-		{
-			objects.push_back(newObject);
-		}
+		return	bounds.min.x <= node.max.x && bounds.max.x >= node.min.x &&
+				bounds.min.y <= node.max.y && bounds.max.y >= node.min.y &&
+				bounds.min.z <= node.max.z && bounds.max.z >= node.min.z;
 	}
 
-	void Subdivide()
+	void StoreObjects(unsigned int nodeIndex, std::vector<Object*>& objects)
 	{
-		assert(!isSubdivided);
-		isSubdivided = true;
+		OctreeNode& node = nodes[nodeIndex];
+		node.firstObject = (unsigned int)nodeObjects.size();
+		node.objectCount = (unsigned int)objects.size();
+		nodeObjects.insert(nodeObjects.end(), objects.begin(), objects.end());
+	}
 
-		int i = 0;
-		for (int z = 0; z < 2; ++z)
+	void Subdivide(unsigned int nodeIndex, std::vector<Object*>& objects, unsigned int depth)
+	{
+		if (objects.size() <= maxCount || depth >= maxDepth)
 		{
-			for (int y = 0; y < 2; ++y)
-			{
-				for (int x = 0; x < 2; ++x)
-				{
-					subnodes[i] = new Octree();
-					subnodes[i]->aabb.min.x = aabb.min.x + aabb.max.x / 2.0f * x;
-					subnodes[i]->aabb.max.x = aabb.min.x + aabb.max.x / 2.0f * (x + 1);
-
-					subnodes[i]->aabb.min.y = aabb.min.y + aabb.max.y / 2.0f * y;
-					subnodes[i]->aabb.max.y = aabb.min.y + aabb.max.y / 2.0f * (y + 1);
+			StoreObjects(nodeIndex, objects);
+			return;
+		}
 
-					subnodes[i]->aabb.min.z = aabb.min.z + aabb.max.z / 2.0f * z;
-					subnodes[i]->aabb.max.z = aabb.min.z + aabb.max.z / 2.0f * (z + 1);
+		vec3 nodeMin = nodes[nodeIndex].min;
+		vec3 nodeMax = nodes[nodeIndex].max;
+		vec3 middle = (nodeMin + nodeMax) * 0.5f;
 
-					++i;
-				}
+		OctreeNode children[SUBNODE_COUNT];
+		for (unsigned int i = 0; i < SUBNODE_COUNT; ++i)
+		{
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				bool upper = (i >> axis) & 1;
+				children[i].min[axis] = upper ? middle[axis] : nodeMin[axis];
+				children[i].max[axis] = upper ? nodeMax[axis] : middle[axis];
 			}
 		}
 
-		// Avoid infinite recursion by testing if subdivision will generate a new subset
-		int splitAttemptCount = 0;
+		std::vector<Object*> childObjects[SUBNODE_COUNT];
+		std::vector<Object*> straddlingObjects;
 		for (Object* object : objects)
 		{
-			for (int i = 0; i < SUBNODE_COUNT; ++i)
+			unsigned int overlapMask = 0;
+			for (unsigned int i = 0; i < SUBNODE_COUNT; ++i)
 			{
-				if (subnodes[i]->aabb.Overlaps(object->aabb))
-				{
-					splitAttemptCount++;
-				}
+				if (Overlaps(children[i], object->aabb)) overlapMask |= 1 << i;
 			}
-		}
 
-		if (splitAttemptCount >= objects.size()*8)
-		{
-			// Failed to subdivide, all children in subdivisions keep repeating all objects
-			Merge();
-		}
-		else
-		{
-			for (Object* object : objects)
+			if (overlapMask == (1 << SUBNODE_COUNT) - 1)
 			{
-				for (int i = 0; i < SUBNODE_COUNT; ++i)
-				{
-					subnodes[i]->InsertIfOverlaps(object);
-				}
+				straddlingObjects.push_back(object);
+				continue;
 			}
-		}
-	}
 
-	void Merge()
-	{
-		if (isSubdivided)
-		{
-			for (int i = 0; i < SUBNODE_COUNT; ++i)
+			for (unsigned int i = 0; i < SUBNODE_COUNT; ++i)
 			{
-				delete subnodes[i];
+				if (overlapMask & (1 << i)) childObjects[i].push_back(object);
 			}
 		}
 
-		isSubdivided = false;
+		StoreObjects(nodeIndex, straddlingObjects);
+
+		// Avoid pointless subdivision when every child would repeat all objects
+		if (straddlingObjects.size() == objects.size()) return;
+
+		unsigned int firstChild = (unsigned int)nodes.size();
+		nodes.insert(nodes.end(), children, children + SUBNODE_COUNT);
+		nodes[nodeIndex].firstChild = firstChild;
+
+		for (unsigned int i = 0; i < SUBNODE_COUNT; ++i)
+		{
+			Subdivide(firstChild + i, childObjects[i], depth + 1);
+		}
 	}
 };
@@ -0,0 +1,271 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "../core/math.h"
+#include "../core/aabb.h"
+#include "../core/trianglesoa.h"
+#include "../core/spheresoa.h"
+#include "../objects/object.h"
+#include "../objects/mesh.h"
+#include "../objects/sphere.h"
+#include "../objects/sphereset.h"
+#include "bvh.h"
+
+#include <vector>
+
+// References store the primitive type in the high bits and the slot in the array of that type in the rest
+#define PRIMITIVE_TYPE_SHIFT 30
+#define PRIMITIVE_SLOT_MASK ((1u << PRIMITIVE_TYPE_SHIFT) - 1u)
+
+enum class PrimitiveType : unsigned int { Triangle, Sphere, Object };
+
+/*
+	Render-time copy of the scene with the primitives of all objects in one BVH. Triangles of meshes
+	and spheres (single or from sphere sets) are stored in separate contiguous arrays per type, in the
+	leaf order of the BVH, so the traversal streams through them and picks the test by type instead
+	of a virtual call.
+	Objects of other types (instances, user objects) are kept as Object* and intersected virtually.
+
+	The objects remain the authoring API, hits report the owning object and its element index
+	as the other structures do. The store must be filled again when objects change.
+*/
+class PrimitiveStore
+{
+protected:
+	BVH bvh;
+	std::vector<unsigned int> references;		// leaf order, see PRIMITIVE_TYPE_SHIFT
+
+	TriangleSoA triangles;						// triangleIndex maps a slot to the entries below
+	std::vector<Object*> triangleObjects;
+	std::vector<unsigned int> triangleElements;
+
+	SphereSoA spheres;							// sphereIndex maps a slot to the entries below
+	std::vector<Object*> sphereObjects;
+	std::vector<unsigned int> sphereElements;
+
+	std::vector<Object*> otherObjects;
+
+	inline static unsigned int Reference(PrimitiveType type, unsigned int slot) { return ((unsigned int)type << PRIMITIVE_TYPE_SHIFT) | slot; }
+
+	/*
+		Calls visitRun(type, firstSlot, slotCount) for each run of one type in the leaf [first, first + count).
+		Slots are assigned in leaf order, so the primitives of a type within a leaf are consecutive.
+		Any hit queries stop at the first run which returns true.
+	*/
+	template<bool AnyHit, typename RunFunction>
+	inline bool VisitRuns(unsigned int first, unsigned int count, RunFunction&& visitRun) const
+	{
+		bool result = false;
+		for (unsigned int i = first, end = first + count; i < end;)
+		{
+			unsigned int run = 1;
+			while (i + run < end && references[i + run] == references[i] + run) ++run;
+
+			result |= visitRun(PrimitiveType(references[i] >> PRIMITIVE_TYPE_SHIFT), references[i] & PRIMITIVE_SLOT_MASK, run);
+			if (AnyHit && result) return true;
+			i += run;
+		}
+		return result;
+	}
+
+public:
+	PrimitiveStore() = default;
+	~PrimitiveStore() = default;
+
+	void Clear()
+	{
+		bvh.Clear();
+		references.clear();
+		triangles.Clear();
+		triangleObjects.clear();
+		triangleElements.clear();
+		spheres.Clear();
+		sphereObjects.clear();
+		sphereElements.clear();
+		otherObjects.clear();
+	}
+
+	inline size_t NodeCount() const { return bvh.TraversalNodeCount(); }
+
+	size_t MemoryUsage() const
+	{
+		size_t bytes = bvh.MemoryUsage() + references.capacity() * sizeof(unsigned int);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			bytes += (triangles.vertex0[axis].capacity() + triangles.edge1[axis].capacity() + triangles.edge2[axis].capacity()) * sizeof(float);
+		}
+		bytes += triangles.triangleIndex.capacity() * sizeof(unsigned int) + triangleObjects.capacity() * sizeof(Object*) + triangleElements.capacity() * sizeof(unsigned int);
+		bytes += spheres.MemoryUsage() + sphereObjects.capacity() * sizeof(Object*) + sphereElements.capacity() * sizeof(unsigned int);
+		bytes += otherObjects.capacity() * sizeof(Object*);
+		return bytes;
+	}
+
+	// The object bounds must be up to date, every primitive is stored once so the settings must not use spatial splits
+	void Fill(const std::vector<Object*>& objects, const BVHSettings& settings)
+	{
+		Clear();
+
+		/*
+			Gather the primitives by type, meshes are stored in world space already
+		*/
+		std::vector<Triangle> gatheredTriangles;
+		std::vector<vec3> sphereCenters;
+		std::vector<float> sphereRadii;
+		std::vector<unsigned int> gatheredReferences;
+		std::vector<AABB> primitiveBounds;
+		for (Object* object : objects)
+		{
+			if (TriangleMesh* mesh = dynamic_cast<TriangleMesh*>(object))
+			{
+				for (unsigned int i = 0; i < mesh->triangles.size(); ++i)
+				{
+					gatheredReferences.push_back(Reference(PrimitiveType::Triangle, (unsigned int)gatheredTriangles.size()));
+					primitiveBounds.push_back(mesh->triangles[i].Bounds());
+					gatheredTriangles.push_back(mesh->triangles[i]);
+					triangleObjects.push_back(mesh);
+					triangleElements.push_back(i);
+				}
+			}
+			else if (SphereObject* sphere = dynamic_cast<SphereObject*>(object))
+			{
+				gatheredReferences.push_back(Reference(PrimitiveType::Sphere, (unsigned int)sphereCenters.size()));
+				primitiveBounds.push_back(sphere->aabb);
+				sphereCenters.push_back(sphere->position);
+				sphereRadii.push_back(sphere->radius);
+				sphereObjects.push_back(sphere);
+				sphereElements.push_back(0);
+			}
+			else if (SphereSet* set = dynamic_cast<SphereSet*>(object))
+			{
+				for (unsigned int i = 0; i < set->Size(); ++i)
+				{
+					gatheredReferences.push_back(Reference(PrimitiveType::Sphere, (unsigned int)sphereCenters.size()));
+					primitiveBounds.push_back(AABB(set->centers[i], vec3{ set->radii[i] * 2.0f }));
+					sphereCenters.push_back(set->centers[i]);
+					sphereRadii.push_back(set->radii[i]);
+					sphereObjects.push_back(set);
+					sphereElements.push_back(i);
+				}
+			}
+			else
+			{
+				gatheredReferences.push_back(Reference(PrimitiveType::Object, (unsigned int)otherObjects.size()));
+				primitiveBounds.push_back(object->aabb);
+				otherObjects.push_back(object);
+			}
+		}
+
+		bvh.Configure(settings);
+		bvh.Build(primitiveBounds);
+
+		/*
+			Assign the slots of each type in leaf order
+		*/
+		std::vector<unsigned int> triangleOrder;
+		std::vector<unsigned int> sphereOrder;
+		std::vector<Object*> orderedOthers;
+		references.reserve(gatheredReferences.size());
+		for (unsigned int index : bvh.PrimitiveIndices())
+		{
+			unsigned int reference = gatheredReferences[index];
+			unsigned int gathered = reference & PRIMITIVE_SLOT_MASK;
+			switch (PrimitiveType(reference >> PRIMITIVE_TYPE_SHIFT))
+			{
+			case PrimitiveType::Triangle:
+				references.push_back(Reference(PrimitiveType::Triangle, (unsigned int)triangleOrder.size()));
+				triangleOrder.push_back(gathered);
+				break;
+			case PrimitiveType::Sphere:
+				references.push_back(Reference(PrimitiveType::Sphere, (unsigned int)sphereOrder.size()));
+				sphereOrder.push_back(gathered);
+				break;
+			default:
+				references.push_back(Reference(PrimitiveType::Object, (unsigned int)orderedOthers.size()));
+				orderedOthers.push_back(otherObjects[gathered]);
+				break;
+			}
+		}
+
+		triangles.Build(gatheredTriangles, triangleOrder);
+		spheres.Build(sphereCenters, sphereRadii, sphereOrder);
+		otherObjects.swap(orderedOthers);
+	}
+
+	bool Intersect(const Ray& ray, RayIntersectionInfo& hitInfo) const
+	{
+		hitInfo.Reset();
+
+		RayIntersectionInfo hitTest;
+		bvh.IntersectLeaves(ray, hitInfo.hitDistance, [&](unsigned int first, unsigned int count, float& nearest) {
+			return VisitRuns<false>(first, count, [&](PrimitiveType type, unsigned int slot, unsigned int slotCount) {
+				bool hit = false;
+				switch (type)
+				{
+				case PrimitiveType::Triangle:
+				{
+					unsigned int hitSlot = 0;
+					if (triangles.IntersectRange(slot, slotCount, ray.origin, ray.direction, nearest, hitSlot))
+					{
+						unsigned int triangle = triangles.triangleIndex[hitSlot];
+						hitInfo.object = triangleObjects[triangle];
+						hitInfo.elementIndex = triangleElements[triangle];
+						hit = true;
+					}
+					break;
+				}
+				case PrimitiveType::Sphere:
+				{
+					unsigned int hitSlot = 0;
+					if (spheres.IntersectRange(slot, slotCount, ray.origin, ray.direction, nearest, hitSlot))
+					{
+						unsigned int sphere = spheres.sphereIndex[hitSlot];
+						hitInfo.object = sphereObjects[sphere];
+						hitInfo.elementIndex = sphereElements[sphere];
+						hit = true;
+					}
+					break;
+				}
+				default:
+					for (unsigned int i = slot; i < slot + slotCount; ++i)
+					{
+						if (otherObjects[i]->Intersects(ray.origin, ray.direction, hitTest) && hitTest.hitDistance < nearest)
+						{
+							nearest = hitTest.hitDistance;
+							hitInfo.object = hitTest.object;
+							hitInfo.elementIndex = hitTest.elementIndex;
+							hit = true;
+						}
+					}
+					break;
+				}
+				return hit;
+			});
+		});
+
+		return (hitInfo.object != nullptr);
+	}
+
+	// Any hit closer than maxDistance
+	bool Occluded(const Ray& ray, float maxDistance) const
+	{
+		return bvh.OccludedLeaves(ray, maxDistance, [&](unsigned int first, unsigned int count, float& maxHitDistance) {
+			return VisitRuns<true>(first, count, [&](PrimitiveType type, unsigned int slot, unsigned int slotCount) {
+				switch (type)
+				{
+				case PrimitiveType::Triangle:
+					return triangles.OccludedRange(slot, slotCount, ray.origin, ray.direction, maxHitDistance);
+				case PrimitiveType::Sphere:
+					return spheres.OccludedRange(slot, slotCount, ray.origin, ray.direction, maxHitDistance);
+				default:
+					for (unsigned int i = slot; i < slot + slotCount; ++i)
+					{
+						if (otherObjects[i]->Occludes(ray, maxHitDistance)) return true;
+					}
+					return false;
+				}
+			});
+		});
+	}
+};
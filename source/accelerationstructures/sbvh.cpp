@@ -0,0 +1,358 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#include "bvh.h"
+
+#include <algorithm>
+
+/*
+	Spatial split BVH builder
+
+	Based on "Spatial Splits in Bounding Volume Hierarchies" (Stich et al. 2009).
+	Besides the object splits of the binned SAH builder, a node may be split by a plane through
+	space, in which case primitives crossing the plane are referenced from both children with
+	their bounds clipped to each side. Large primitives (room walls) then no longer inflate the
+	bounds of every node they touch.
+*/
+
+struct BVH::SpatialBuild
+{
+	const std::vector<AABB>& primitiveBounds;
+	float overlapThreshold;			// minimum child overlap area for trying spatial splits
+	size_t referenceLimit;			// the duplication budget
+	size_t referenceCount;
+};
+
+namespace
+{
+	struct SplitCandidate
+	{
+		float cost = FLOAT_INFINITY;
+		int axis = -1;
+		float position = 0.0f;
+		AABB leftBounds = AABB::Empty();
+		AABB rightBounds = AABB::Empty();
+		unsigned int leftCount = 0;
+		unsigned int rightCount = 0;
+	};
+
+	inline void SplitBounds(const SplitPrimitiveFunction& splitPrimitive, unsigned int primitiveIndex, int axis, float position, const AABB& bounds, AABB& left, AABB& right)
+	{
+		if (splitPrimitive)
+		{
+			splitPrimitive(primitiveIndex, axis, position, bounds, left, right);
+		}
+		else
+		{
+			left = bounds;
+			right = bounds;
+		}
+
+		// Whatever the primitive reports, the parts stay inside their half of the clipped bounds
+		left.max[axis] = std::min(left.max[axis], position);
+		right.min[axis] = std::max(right.min[axis], position);
+		left = AABB::Intersection(left, bounds);
+		right = AABB::Intersection(right, bounds);
+	}
+}
+
+void BVH::BuildSpatial(const std::vector<AABB>& primitiveBounds)
+{
+	std::vector<SpatialReference> references(primitiveCount);
+	AABB rootBounds = AABB::Empty();
+	for (unsigned int i = 0; i < primitiveCount; ++i)
+	{
+		references[i] = SpatialReference{ primitiveBounds[i], i };
+		rootBounds.Encapsulate(primitiveBounds[i]);
+	}
+
+	SpatialBuild build{
+		primitiveBounds,
+		spatialSplitOverlap * rootBounds.SurfaceArea(),
+		size_t(float(primitiveCount) * (1.0f + std::max(spatialSplitBudget, 0.0f))),
+		primitiveCount
+	};
+
+	primitiveIndices.reserve(build.referenceLimit);
+	nodes.reserve(2 * build.referenceLimit);
+	nodes.emplace_back();
+	SubdivideSpatial(build, 0, references, 0);
+
+	nodes.shrink_to_fit();
+	primitiveIndices.shrink_to_fit();
+}
+
+void BVH::SubdivideSpatial(SpatialBuild& build, unsigned int nodeIndex, std::vector<SpatialReference>& references, unsigned int depth)
+{
+	unsigned int count = (unsigned int)references.size();
+	AABB nodeBounds = AABB::Empty();
+	AABB centroidBounds = AABB::Empty();
+	for (const SpatialReference& reference : references)
+	{
+		nodeBounds.Encapsulate(reference.bounds);
+		centroidBounds.Encapsulate(reference.bounds.Centroid());
+	}
+
+	nodes[nodeIndex].min = nodeBounds.min;
+	nodes[nodeIndex].max = nodeBounds.max;
+
+	auto makeLeaf = [&]() {
+		nodes[nodeIndex].leftFirst = (unsigned int)primitiveIndices.size();
+		nodes[nodeIndex].count = count;
+		for (const SpatialReference& reference : references)
+		{
+			primitiveIndices.push_back(reference.primitiveIndex);
+		}
+	};
+
+	if (count <= 1 || depth >= BVH_STACK_SIZE - 2)
+	{
+		makeLeaf();
+		return;
+	}
+
+	float nodeArea = nodeBounds.SurfaceArea();
+	float leafCost = float(count) * nodeArea;
+
+	/*
+		Object split, binned by reference centroids
+	*/
+	SplitCandidate objectSplit;
+	std::vector<Bin> bins(binCount);
+	std::vector<AABB> leftBox(binCount), rightBox(binCount);
+	std::vector<unsigned int> leftCount(binCount), rightCount(binCount);
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float boundsMin = centroidBounds.min[axis];
+		float boundsMax = centroidBounds.max[axis];
+		if (boundsMax <= boundsMin) continue;
+
+		std::fill(bins.begin(), bins.end(), Bin{});
+		float scale = float(binCount) / (boundsMax - boundsMin);
+		for (const SpatialReference& reference : references)
+		{
+			unsigned int binIndex = std::min(binCount - 1, (unsigned int)((reference.bounds.Centroid()[axis] - boundsMin) * scale));
+			bins[binIndex].count++;
+			bins[binIndex].bounds.Encapsulate(reference.bounds);
+		}
+
+		AABB left = AABB::Empty(), right = AABB::Empty();
+		unsigned int leftSum = 0, rightSum = 0;
+		for (unsigned int i = 0; i < binCount - 1; ++i)
+		{
+			leftSum += bins[i].count;
+			left.Encapsulate(bins[i].bounds);
+			leftCount[i] = leftSum;
+			leftBox[i] = left;
+
+			rightSum += bins[binCount - 1 - i].count;
+			right.Encapsulate(bins[binCount - 1 - i].bounds);
+			rightCount[binCount - 2 - i] = rightSum;
+			rightBox[binCount - 2 - i] = right;
+		}
+
+		float binWidth = (boundsMax - boundsMin) / float(binCount);
+		for (unsigned int i = 0; i < binCount - 1; ++i)
+		{
+			if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+
+			float cost = traversalCost * nodeArea + leftCount[i] * leftBox[i].SurfaceArea() + rightCount[i] * rightBox[i].SurfaceArea();
+			if (cost < objectSplit.cost)
+			{
+				objectSplit.cost = cost;
+				objectSplit.axis = axis;
+				objectSplit.position = boundsMin + binWidth * float(i + 1);
+				objectSplit.leftBounds = leftBox[i];
+				objectSplit.rightBounds = rightBox[i];
+				objectSplit.leftCount = leftCount[i];
+				objectSplit.rightCount = rightCount[i];
+			}
+		}
+	}
+
+	/*
+		Spatial split, only tried where the object split children overlap noticeably and the budget allows it.
+		References are chopped at every bin plane they cross, entry and exit counts give the child sizes.
+	*/
+	SplitCandidate spatialSplit;
+	AABB overlap = AABB::Intersection(objectSplit.leftBounds, objectSplit.rightBounds);
+	bool trySpatial = (objectSplit.axis < 0) || (!overlap.IsEmpty() && overlap.SurfaceArea() > build.overlapThreshold);
+	if (trySpatial && build.referenceCount < build.referenceLimit)
+	{
+		std::vector<AABB> binBounds(binCount);
+		std::vector<unsigned int> entries(binCount), exits(binCount);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float boundsMin = nodeBounds.min[axis];
+			float boundsMax = nodeBounds.max[axis];
+			if (boundsMax <= boundsMin) continue;
+
+			std::fill(binBounds.begin(), binBounds.end(), AABB::Empty());
+			std::fill(entries.begin(), entries.end(), 0);
+			std::fill(exits.begin(), exits.end(), 0);
+
+			float binWidth = (boundsMax - boundsMin) / float(binCount);
+			float scale = 1.0f / binWidth;
+			for (const SpatialReference& reference : references)
+			{
+				unsigned int firstBin = std::min(binCount - 1, (unsigned int)std::max(0.0f, (reference.bounds.min[axis] - boundsMin) * scale));
+				unsigned int lastBin = std::min(binCount - 1, (unsigned int)std::max(0.0f, (reference.bounds.max[axis] - boundsMin) * scale));
+				lastBin = std::max(firstBin, lastBin);
+
+				AABB remaining = reference.bounds;
+				for (unsigned int bin = firstBin; bin < lastBin; ++bin)
+				{
+					AABB left, right;
+					SplitBounds(splitPrimitive, reference.primitiveIndex, axis, boundsMin + binWidth * float(bin + 1), remaining, left, right);
+					if (!left.IsEmpty()) binBounds[bin].Encapsulate(left);
+					remaining = right;
+				}
+				if (!remaining.IsEmpty()) binBounds[lastBin].Encapsulate(remaining);
+
+				entries[firstBin]++;
+				exits[lastBin]++;
+			}
+
+			AABB left = AABB::Empty(), right = AABB::Empty();
+			unsigned int leftSum = 0, rightSum = 0;
+			for (unsigned int i = 0; i < binCount - 1; ++i)
+			{
+				leftSum += entries[i];
+				left.Encapsulate(binBounds[i]);
+				leftCount[i] = leftSum;
+				leftBox[i] = left;
+
+				rightSum += exits[binCount - 1 - i];
+				right.Encapsulate(binBounds[binCount - 1 - i]);
+				rightCount[binCount - 2 - i] = rightSum;
+				rightBox[binCount - 2 - i] = right;
+			}
+
+			for (unsigned int i = 0; i < binCount - 1; ++i)
+			{
+				if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+
+				// Splits which would exceed the duplication budget are not considered
+				size_t duplicates = leftCount[i] + rightCount[i] - count;
+				if (build.referenceCount + duplicates > build.referenceLimit) continue;
+
+				float cost = traversalCost * nodeArea + leftCount[i] * leftBox[i].SurfaceArea() + rightCount[i] * rightBox[i].SurfaceArea();
+				if (cost < spatialSplit.cost)
+				{
+					spatialSplit.cost = cost;
+					spatialSplit.axis = axis;
+					spatialSplit.position = boundsMin + binWidth * float(i + 1);
+					spatialSplit.leftBounds = leftBox[i];
+					spatialSplit.rightBounds = rightBox[i];
+					spatialSplit.leftCount = leftCount[i];
+					spatialSplit.rightCount = rightCount[i];
+				}
+			}
+		}
+	}
+
+	float bestCost = std::min(objectSplit.cost, spatialSplit.cost);
+	if (bestCost >= leafCost && count <= maxLeafSize)
+	{
+		makeLeaf();
+		return;
+	}
+
+	/*
+		Distribute the references
+	*/
+	std::vector<SpatialReference> leftReferences, rightReferences;
+	leftReferences.reserve(count);
+	rightReferences.reserve(count);
+
+	if (spatialSplit.cost < objectSplit.cost)
+	{
+		int axis = spatialSplit.axis;
+		float position = spatialSplit.position;
+		AABB leftBounds = spatialSplit.leftBounds;
+		AABB rightBounds = spatialSplit.rightBounds;
+		float leftCountF = float(spatialSplit.leftCount);
+		float rightCountF = float(spatialSplit.rightCount);
+
+		for (const SpatialReference& reference : references)
+		{
+			if (reference.bounds.max[axis] <= position)
+			{
+				leftReferences.push_back(reference);
+			}
+			else if (reference.bounds.min[axis] >= position)
+			{
+				rightReferences.push_back(reference);
+			}
+			else
+			{
+				// Unsplitting, a straddling reference goes to one side only if that is cheaper than duplicating it
+				AABB leftWith = leftBounds, rightWith = rightBounds;
+				leftWith.Encapsulate(reference.bounds);
+				rightWith.Encapsulate(reference.bounds);
+				float splitCost = leftBounds.SurfaceArea() * leftCountF + rightBounds.SurfaceArea() * rightCountF;
+				float leftOnlyCost = leftWith.SurfaceArea() * leftCountF + rightBounds.SurfaceArea() * (rightCountF - 1.0f);
+				float rightOnlyCost = leftBounds.SurfaceArea() * (leftCountF - 1.0f) + rightWith.SurfaceArea() * rightCountF;
+
+				AABB left, right;
+				SplitBounds(splitPrimitive, reference.primitiveIndex, axis, position, reference.bounds, left, right);
+
+				if (right.IsEmpty() || (!left.IsEmpty() && leftOnlyCost < splitCost && leftOnlyCost <= rightOnlyCost))
+				{
+					leftReferences.push_back(reference);
+					leftBounds = leftWith;
+					rightCountF -= 1.0f;
+				}
+				else if (left.IsEmpty() || rightOnlyCost < splitCost)
+				{
+					rightReferences.push_back(reference);
+					rightBounds = rightWith;
+					leftCountF -= 1.0f;
+				}
+				else
+				{
+					leftReferences.push_back(SpatialReference{ left, reference.primitiveIndex });
+					rightReferences.push_back(SpatialReference{ right, reference.primitiveIndex });
+					build.referenceCount++;
+				}
+			}
+		}
+	}
+	else if (objectSplit.axis >= 0)
+	{
+		for (const SpatialReference& reference : references)
+		{
+			if (reference.bounds.Centroid()[objectSplit.axis] < objectSplit.position) leftReferences.push_back(reference);
+			else rightReferences.push_back(reference);
+		}
+	}
+
+	if (leftReferences.empty() || rightReferences.empty())
+	{
+		// Neither split separates the references, fall back to a median split along the widest centroid axis
+		vec3 extent = centroidBounds.max - centroidBounds.min;
+		int axis = (extent.y > extent.x) ? 1 : 0;
+		if (extent.z > extent[axis]) axis = 2;
+
+		unsigned int middle = count / 2;
+		std::nth_element(references.begin(), references.begin() + middle, references.end(), [&](const SpatialReference& a, const SpatialReference& b) {
+			return a.bounds.Centroid()[axis] < b.bounds.Centroid()[axis];
+		});
+
+		leftReferences.assign(references.begin(), references.begin() + middle);
+		rightReferences.assign(references.begin() + middle, references.end());
+	}
+
+	// The references of this node are no longer needed, release them before going deeper
+	std::vector<SpatialReference>().swap(references);
+
+	unsigned int leftIndex = (unsigned int)nodes.size();
+	nodes.emplace_back();
+	nodes.emplace_back();
+	nodes[nodeIndex].leftFirst = leftIndex;
+	nodes[nodeIndex].count = 0;
+
+	SubdivideSpatial(build, leftIndex, leftReferences, depth + 1);
+	SubdivideSpatial(build, leftIndex + 1, rightReferences, depth + 1);
+}
@@ -0,0 +1,110 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "../core/math.h"
+#include "../core/ray.h"
+#include "../core/kernels.h"
+
+#include <vector>
+#include <algorithm>
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86_FP)
+#define WIDEBVH_USE_SSE
+#include <immintrin.h>
+#endif
+
+/*
+	Node of a 4- or 8-ary BVH. The bounds of all children are stored as SoA
+	so that one node step can test every child against the ray at once.
+*/
+template<unsigned int Width>
+struct alignas(32) WideBVHNode
+{
+	float minX[Width];
+	float minY[Width];
+	float minZ[Width];
+	float maxX[Width];
+	float maxY[Width];
+	float maxZ[Width];
+	unsigned int child[Width];	// wide node index for interior children, first primitive for leaves
+	unsigned int count[Width];	// primitive count for leaves, 0 for interior children
+	unsigned int childCount;	// valid slots, the remaining slots are never reported as hit
+};
+
+template<unsigned int Width>
+inline void GetChildReferences(const WideBVHNode<Width>& node, unsigned int* references)
+{
+	for (unsigned int i = 0; i < Width; ++i)
+	{
+		references[i] = node.child[i];
+	}
+}
+
+// Starts loading all cache lines of data which will be needed soon
+template<typename T>
+inline void Prefetch(const T& data)
+{
+#ifdef WIDEBVH_USE_SSE
+	const char* bytes = reinterpret_cast<const char*>(&data);
+	for (size_t offset = 0; offset < sizeof(T); offset += 64)
+	{
+		_mm_prefetch(bytes + offset, _MM_HINT_T0);
+	}
+#endif
+}
+
+/*
+	Ray data splatted over the SIMD lanes once per traversal
+*/
+struct WideBVHRay
+{
+	vec3 origin;
+	vec3 invDirection;
+
+#ifdef WIDEBVH_USE_SSE
+	__m128 originX, originY, originZ;
+	__m128 invX, invY, invZ;
+#endif
+#ifdef __AVX__
+	__m256 originX8, originY8, originZ8;
+	__m256 invX8, invY8, invZ8;
+#endif
+
+	WideBVHRay() = default;
+	WideBVHRay(const Ray& ray)
+	{
+		origin = ray.origin;
+		invDirection = ray.invDirection;
+
+#ifdef WIDEBVH_USE_SSE
+		originX = _mm_set1_ps(origin.x);
+		originY = _mm_set1_ps(origin.y);
+		originZ = _mm_set1_ps(origin.z);
+		invX = _mm_set1_ps(invDirection.x);
+		invY = _mm_set1_ps(invDirection.y);
+		invZ = _mm_set1_ps(invDirection.z);
+#endif
+#ifdef __AVX__
+		originX8 = _mm256_set1_ps(origin.x);
+		originY8 = _mm256_set1_ps(origin.y);
+		originZ8 = _mm256_set1_ps(origin.z);
+		invX8 = _mm256_set1_ps(invDirection.x);
+		invY8 = _mm256_set1_ps(invDirection.y);
+		invZ8 = _mm256_set1_ps(invDirection.z);
+#endif
+	}
+};
+
+/*
+	Slab test against all children of a node with the active box kernel (kernels.h).
+	Returns a bit mask of the children which are hit closer than maxDistance, with their entry distances in tEntry.
+*/
+template<unsigned int Width>
+inline unsigned int IntersectChildren(const WideBVHNode<Width>& node, const WideBVHRay& ray, float maxDistance, float* tEntry)
+{
+	BoxStreams boxes{ { node.minX, node.minY, node.minZ }, { node.maxX, node.maxY, node.maxZ } };
+	unsigned int mask = ActiveKernels().intersectBoxes(boxes, Width, &ray.origin.x, &ray.invDirection.x, maxDistance, tEntry);
+	return mask & ((1u << node.childCount) - 1u);
+}
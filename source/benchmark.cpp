@@ -0,0 +1,481 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#include "benchmark.h"
+#include "core/randomization.h"
+#include "core/kernels.h"
+#include "core/trianglesoa.h"
+#include "wavefront.h"
+#include "objects/mesh.h"
+#include "objects/sphereset.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+	struct ShadowRay
+	{
+		Ray ray;
+		float maxDistance;
+	};
+
+	double Seconds(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	std::string SamplesPerSecond(size_t sampleCount, double seconds)
+	{
+		double kiloSamples = (seconds > 0.0) ? double(sampleCount) / seconds / 1e3 : 0.0;
+		return std::to_string(kiloSamples).substr(0, 6) + " Ksamples/s";
+	}
+
+	std::string RaysPerSecond(size_t rayCount, double seconds)
+	{
+		double megaRays = (seconds > 0.0) ? double(rayCount) / seconds / 1e6 : 0.0;
+		return std::to_string(megaRays).substr(0, 6) + " Mrays/s";
+	}
+
+	size_t StructureMemoryUsage(const Scene& scene)
+	{
+		switch (scene.accelerationStructure)
+		{
+		case AccelerationStructure::Octree: return scene.octree.MemoryUsage();
+		case AccelerationStructure::KdTree: return scene.kdTree.MemoryUsage();
+		case AccelerationStructure::BVH: return scene.bvh.MemoryUsage();
+		case AccelerationStructure::FlatBVH: return scene.primitives.MemoryUsage();
+		default: return 0;
+		}
+	}
+
+	// Times the rays through the prepared scene, one line of rays per second and hit counts
+	std::string TraceBenchmarkRays(const Scene& scene, std::vector<Ray>& primaryRays, std::vector<ShadowRay>& shadowRays, std::vector<Ray>& bounceRays)
+	{
+		size_t primaryHits = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (Ray& ray : primaryRays)
+		{
+			RayIntersectionInfo hitInfo;
+			if (scene.IntersectRay(ray, hitInfo)) ++primaryHits;
+		}
+		double primaryTime = Seconds(start);
+
+		size_t occludedCount = 0;
+		start = std::chrono::steady_clock::now();
+		for (ShadowRay& shadowRay : shadowRays)
+		{
+			if (scene.Occluded(shadowRay.ray, shadowRay.maxDistance)) ++occludedCount;
+		}
+		double shadowTime = Seconds(start);
+
+		size_t bounceHits = 0;
+		start = std::chrono::steady_clock::now();
+		for (Ray& ray : bounceRays)
+		{
+			RayIntersectionInfo hitInfo;
+			if (scene.IntersectRay(ray, hitInfo)) ++bounceHits;
+		}
+		double bounceTime = Seconds(start);
+
+		return "  primary " + RaysPerSecond(primaryRays.size(), primaryTime) + " (" + std::to_string(primaryHits) + " hits)"
+			+ ", shadow " + RaysPerSecond(shadowRays.size(), shadowTime) + " (" + std::to_string(occludedCount) + " occluded)"
+			+ ", bounce " + RaysPerSecond(bounceRays.size(), bounceTime) + " (" + std::to_string(bounceHits) + " hits)\r\n";
+	}
+
+	/*
+		One object's own IntersectRays against calling Intersects per ray, for the same incoherent rays.
+		The hit counts should be the same for every group size.
+	*/
+	void BenchmarkObjectStream(const std::string& name, Object& object, const std::vector<Ray>& rays)
+	{
+		size_t hits = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (const Ray& ray : rays)
+		{
+			RayIntersectionInfo hitInfo;
+			if (object.Intersects(ray.origin, ray.direction, hitInfo)) ++hits;
+		}
+		std::cout << name + ": per ray " + RaysPerSecond(rays.size(), Seconds(start)) + " (" + std::to_string(hits) + " hits),";
+
+		std::vector<RayIntersectionInfo> hitInfos(rays.size());
+		for (unsigned int groupSize = 1; groupSize <= BVH_INTERLEAVE_MAX_GROUP; groupSize *= 2)
+		{
+			start = std::chrono::steady_clock::now();
+			object.IntersectRays(rays.data(), (unsigned int)rays.size(), hitInfos.data(), groupSize);
+			double time = Seconds(start);
+
+			hits = 0;
+			for (const RayIntersectionInfo& hitInfo : hitInfos)
+			{
+				if (hitInfo.object) ++hits;
+			}
+			std::cout << " group " + std::to_string(groupSize) + " " + RaysPerSecond(rays.size(), time) + " (" + std::to_string(hits) + " hits)"
+				+ (groupSize < BVH_INTERLEAVE_MAX_GROUP ? "," : "\r\n");
+		}
+	}
+
+	const char* StructureName(AccelerationStructure structure)
+	{
+		switch (structure)
+		{
+		case AccelerationStructure::None: return "Brute force";
+		case AccelerationStructure::Octree: return "Octree";
+		case AccelerationStructure::KdTree: return "Kd-tree";
+		case AccelerationStructure::BVH: return "BVH";
+		case AccelerationStructure::FlatBVH: return "Flat BVH";
+		default: return "";
+		}
+	}
+}
+
+bool RunIntersectionKernelCheck(unsigned int rayCount)
+{
+	const unsigned int triangleCount = 4096;
+	const unsigned int maxRangeSize = 40;
+	const float distanceEpsilon = 1e-4f;
+
+	/*
+		Small random triangles in a box, each ray aims at one triangle of its range so that a good share hits
+	*/
+	UniformRandomGenerator gen;
+	std::vector<Triangle> triangles;
+	std::vector<unsigned int> order(triangleCount);
+	triangles.reserve(triangleCount);
+	for (unsigned int i = 0; i < triangleCount; ++i)
+	{
+		vec3 v0{ gen.RandomFloat(-2.0f, 2.0f), gen.RandomFloat(-2.0f, 2.0f), gen.RandomFloat(-2.0f, 2.0f) };
+		vec3 v1 = v0 + vec3{ gen.RandomFloat(-0.5f, 0.5f), gen.RandomFloat(-0.5f, 0.5f), gen.RandomFloat(-0.5f, 0.5f) };
+		vec3 v2 = v0 + vec3{ gen.RandomFloat(-0.5f, 0.5f), gen.RandomFloat(-0.5f, 0.5f), gen.RandomFloat(-0.5f, 0.5f) };
+		triangles.push_back(Triangle{ v0, v1, v2 });
+		order[i] = i;
+	}
+
+	TriangleSoA soa;
+	soa.Build(triangles, order);
+
+	struct KernelQuery
+	{
+		Ray ray;
+		unsigned int first;
+		unsigned int count;
+		float nearestDistance;		// initial closest distance of the intersection query
+		float maxDistance;			// of the occlusion query
+	};
+
+	std::vector<KernelQuery> queries;
+	queries.reserve(rayCount);
+	for (unsigned int i = 0; i < rayCount; ++i)
+	{
+		KernelQuery query;
+		query.count = std::min(1u + (unsigned int)gen.RandomFloat(0.0f, float(maxRangeSize)), maxRangeSize);
+		query.first = std::min((unsigned int)gen.RandomFloat(0.0f, float(triangleCount - query.count + 1)), triangleCount - query.count);
+
+		const Triangle& target = triangles[query.first + std::min((unsigned int)gen.RandomFloat(0.0f, float(query.count)), query.count - 1)];
+		vec3 aim = (target.vertex0 + target.vertex1 + target.vertex2) / 3.0f + vec3{ gen.RandomFloat(-0.2f, 0.2f), gen.RandomFloat(-0.2f, 0.2f), gen.RandomFloat(-0.2f, 0.2f) };
+		vec3 origin{ gen.RandomFloat(-4.0f, 4.0f), gen.RandomFloat(-4.0f, 4.0f), gen.RandomFloat(-4.0f, 4.0f) };
+		vec3 direction = aim - origin;
+		if (glm::dot(direction, direction) < 1e-6f) direction = vec3{ 0.0f, 0.0f, 1.0f };
+		query.ray = Ray{ origin, glm::normalize(direction) };
+
+		query.nearestDistance = (i % 2 == 0) ? FLOAT_INFINITY : gen.RandomFloat(0.0f, 8.0f);
+		query.maxDistance = gen.RandomFloat(0.0f, 8.0f);
+		queries.push_back(query);
+	}
+
+	/*
+		Reference results, closest hit in slot order like the kernels
+	*/
+	std::vector<unsigned int> referenceSlots(rayCount, triangleCount);
+	std::vector<float> referenceDistances(rayCount);
+	std::vector<char> referenceOccluded(rayCount, 0);
+	size_t referenceHits = 0;
+	for (unsigned int i = 0; i < rayCount; ++i)
+	{
+		const KernelQuery& query = queries[i];
+		float nearestDistance = query.nearestDistance;
+		for (unsigned int slot = query.first; slot < query.first + query.count; ++slot)
+		{
+			float t;
+			if (!triangles[slot].Intersects(query.ray.origin, query.ray.direction, t)) continue;
+
+			if (t < nearestDistance)
+			{
+				nearestDistance = t;
+				referenceSlots[i] = slot;
+			}
+			if (t < query.maxDistance) referenceOccluded[i] = 1;
+		}
+		referenceDistances[i] = nearestDistance;
+		if (referenceSlots[i] < triangleCount) ++referenceHits;
+	}
+
+	std::cout << "\r\nIntersection kernel check: " + std::to_string(rayCount) + " rays against ranges of up to "
+		+ std::to_string(maxRangeSize) + " triangles, " + std::to_string(referenceHits) + " reference hits\r\n";
+
+	/*
+		Same queries through every supported kernel table
+	*/
+	InstructionSet originalInstructionSet = ActiveKernels().instructionSet;
+	bool allMatch = true;
+	for (int i = 0; i < int(InstructionSet::COUNT); ++i)
+	{
+		InstructionSet instructionSet = InstructionSet(i);
+		if (!SelectKernels(instructionSet))
+		{
+			std::cout << "  " + std::string(InstructionSetName(instructionSet)) + ": not supported\r\n";
+			continue;
+		}
+
+		size_t hitMismatches = 0;
+		size_t occludedMismatches = 0;
+		for (unsigned int j = 0; j < rayCount; ++j)
+		{
+			const KernelQuery& query = queries[j];
+			float nearestDistance = query.nearestDistance;
+			unsigned int hitSlot = triangleCount;
+			bool hit = soa.IntersectRange(query.first, query.count, query.ray.origin, query.ray.direction, nearestDistance, hitSlot);
+
+			bool referenceHit = referenceSlots[j] < triangleCount;
+			if (hit != referenceHit || (hit && (hitSlot != referenceSlots[j]
+				|| std::abs(nearestDistance - referenceDistances[j]) > distanceEpsilon * std::max(1.0f, referenceDistances[j]))))
+			{
+				++hitMismatches;
+			}
+
+			bool occluded = soa.OccludedRange(query.first, query.count, query.ray.origin, query.ray.direction, query.maxDistance);
+			if (occluded != (referenceOccluded[j] != 0)) ++occludedMismatches;
+		}
+
+		allMatch &= (hitMismatches == 0 && occludedMismatches == 0);
+		std::cout << "  " + std::string(InstructionSetName(instructionSet)) + ": " + std::to_string(hitMismatches) + " intersection, "
+			+ std::to_string(occludedMismatches) + " occlusion mismatches\r\n";
+	}
+	SelectKernels(originalInstructionSet);
+
+	return allMatch;
+}
+
+void RunAccelerationStructureBenchmark(Scene& scene, const Camera& camera, unsigned int rayCount)
+{
+	AccelerationStructure originalStructure = scene.accelerationStructure;
+
+	/*
+		Generate the rays once, secondary rays start at the primary hits
+	*/
+	scene.accelerationStructure = AccelerationStructure::BVH;
+	scene.PrepareForRayTracing();
+
+	UniformRandomGenerator gen;
+	std::vector<Ray> primaryRays;
+	std::vector<ShadowRay> shadowRays;
+	std::vector<Ray> bounceRays;
+	primaryRays.reserve(rayCount);
+
+	const std::vector<Object*>& lights = scene.Lights();
+	for (unsigned int i = 0; i < rayCount; ++i)
+	{
+		Ray ray = camera.GetPixelRay(gen.RandomFloat(0.0f, float(camera.pixels.width())), gen.RandomFloat(0.0f, float(camera.pixels.height())));
+		primaryRays.push_back(ray);
+
+		RayIntersectionInfo hitInfo;
+		if (!scene.IntersectRay(ray, hitInfo)) continue;
+
+		vec3 point = ray.origin + ray.direction * hitInfo.hitDistance;
+		vec3 normal = hitInfo.object->GetSurfaceNormal(point, hitInfo.elementIndex);
+		if (glm::dot(normal, ray.direction) > 0.0f) normal = -normal;
+		point += normal * INTERSECTION_ERROR_MARGIN;
+
+		if (!lights.empty())
+		{
+			Object* light = lights[std::min(size_t(gen.RandomFloat(0.0f, float(lights.size()))), lights.size() - 1)];
+			vec3 lightDirection = light->GetRandomPointOnSurface(gen) - point;
+			float lightDistance = glm::length(lightDirection);
+			shadowRays.push_back(ShadowRay{ Ray{ point, lightDirection / lightDistance }, lightDistance * SHADOW_RAY_DISTANCE_SCALE });
+		}
+
+		vec3 direction{ gen.RandomFloat(-1.0f, 1.0f), gen.RandomFloat(-1.0f, 1.0f), gen.RandomFloat(-1.0f, 1.0f) };
+		if (glm::dot(direction, direction) < 1e-6f) direction = normal;
+		direction = glm::normalize(direction);
+		if (glm::dot(direction, normal) < 0.0f) direction = -direction;
+		bounceRays.push_back(Ray{ point, direction });
+	}
+
+	std::cout << "\r\nAcceleration structure benchmark: " + std::to_string(primaryRays.size()) + " primary, "
+		+ std::to_string(shadowRays.size()) + " shadow, " + std::to_string(bounceRays.size()) + " bounce rays, "
+		+ InstructionSetName(ActiveKernels().instructionSet) + " kernels\r\n";
+
+	/*
+		Same rays through every structure
+	*/
+	for (int i = 0; i < int(AccelerationStructure::COUNT); ++i)
+	{
+		scene.accelerationStructure = AccelerationStructure(i);
+
+		auto start = std::chrono::steady_clock::now();
+		scene.PrepareForRayTracing();
+		double buildTime = Seconds(start);
+
+		std::cout << std::string(StructureName(scene.accelerationStructure)) + ": build " + std::to_string(buildTime * 1000.0).substr(0, 6) + " ms, "
+			+ std::to_string(StructureMemoryUsage(scene) / 1024) + " KB\r\n"
+			+ TraceBenchmarkRays(scene, primaryRays, shadowRays, bounceRays);
+	}
+
+	/*
+		Stack-based against stackless traversal of the uncompressed BVH, the hit counts must match
+	*/
+	BVHSettings originalSettings = scene.bvhSettings;
+	scene.accelerationStructure = AccelerationStructure::BVH;
+	scene.bvhSettings.compressed = false;
+	for (int stackless = 0; stackless < 2; ++stackless)
+	{
+		scene.bvhSettings.stackless = (stackless != 0);
+		scene.PrepareForRayTracing();
+		std::cout << std::string(stackless ? "BVH stackless" : "BVH stack-based") + ":\r\n"
+			+ TraceBenchmarkRays(scene, primaryRays, shadowRays, bounceRays);
+	}
+	scene.bvhSettings = originalSettings;
+
+	/*
+		Bounce and shadow rays as streams through the BVH, traversals interleaved in groups of increasing size.
+		The hit counts must match the per ray queries.
+	*/
+	scene.accelerationStructure = AccelerationStructure::BVH;
+	scene.PrepareForRayTracing();
+	unsigned int originalGroupSize = scene.rayGroupSize;
+
+	std::vector<Ray> shadowStream;
+	std::vector<float> shadowDistances;
+	for (const ShadowRay& shadowRay : shadowRays)
+	{
+		shadowStream.push_back(shadowRay.ray);
+	}
+
+	size_t bounceHits = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (Ray& ray : bounceRays)
+	{
+		RayIntersectionInfo hitInfo;
+		if (scene.IntersectRay(ray, hitInfo)) ++bounceHits;
+	}
+	std::string bounceLine = "BVH bounce ray stream: per ray " + RaysPerSecond(bounceRays.size(), Seconds(start)) + " (" + std::to_string(bounceHits) + " hits)";
+
+	size_t occludedCount = 0;
+	start = std::chrono::steady_clock::now();
+	for (ShadowRay& shadowRay : shadowRays)
+	{
+		if (scene.Occluded(shadowRay.ray, shadowRay.maxDistance)) ++occludedCount;
+	}
+	std::string shadowLine = "BVH shadow ray stream: per ray " + RaysPerSecond(shadowRays.size(), Seconds(start)) + " (" + std::to_string(occludedCount) + " occluded)";
+
+	std::vector<RayIntersectionInfo> hitInfos(bounceRays.size());
+	for (unsigned int groupSize = 1; groupSize <= BVH_INTERLEAVE_MAX_GROUP; groupSize *= 2)
+	{
+		scene.rayGroupSize = groupSize;
+		start = std::chrono::steady_clock::now();
+		scene.IntersectRays(bounceRays.data(), (unsigned int)bounceRays.size(), hitInfos.data());
+		double bounceTime = Seconds(start);
+
+		shadowDistances.clear();
+		for (const ShadowRay& shadowRay : shadowRays)
+		{
+			shadowDistances.push_back(shadowRay.maxDistance);
+		}
+		start = std::chrono::steady_clock::now();
+		scene.OccludedRays(shadowStream.data(), shadowDistances.data(), (unsigned int)shadowStream.size());
+		double shadowTime = Seconds(start);
+
+		bounceHits = std::count_if(hitInfos.begin(), hitInfos.end(), [](const RayIntersectionInfo& hitInfo) { return hitInfo.object != nullptr; });
+		occludedCount = std::count_if(shadowDistances.begin(), shadowDistances.end(), [](float distance) { return distance < 0.0f; });
+		bounceLine += ", group " + std::to_string(groupSize) + " " + RaysPerSecond(bounceRays.size(), bounceTime) + " (" + std::to_string(bounceHits) + " hits)";
+		shadowLine += ", group " + std::to_string(groupSize) + " " + RaysPerSecond(shadowRays.size(), shadowTime) + " (" + std::to_string(occludedCount) + " occluded)";
+	}
+	scene.rayGroupSize = originalGroupSize;
+	std::cout << bounceLine + "\r\n" + shadowLine + "\r\n";
+
+	/*
+		Bottom-level streams on their own, on a large random mesh and sphere set built with the scene settings
+	*/
+	const unsigned int streamPrimitiveCount = 100000;
+	TriangleMesh mesh;
+	SphereSet sphereSet;
+	mesh.triangles.reserve(streamPrimitiveCount);
+	for (unsigned int i = 0; i < streamPrimitiveCount; ++i)
+	{
+		vec3 center{ gen.RandomFloat(-5.0f, 5.0f), gen.RandomFloat(-5.0f, 5.0f), gen.RandomFloat(-5.0f, 5.0f) };
+		vec3 v1 = center + vec3{ gen.RandomFloat(-0.1f, 0.1f), gen.RandomFloat(-0.1f, 0.1f), gen.RandomFloat(-0.1f, 0.1f) };
+		vec3 v2 = center + vec3{ gen.RandomFloat(-0.1f, 0.1f), gen.RandomFloat(-0.1f, 0.1f), gen.RandomFloat(-0.1f, 0.1f) };
+		mesh.triangles.push_back(Triangle{ center, v1, v2 });
+		sphereSet.AddSphere(center, gen.RandomFloat(0.01f, 0.05f));
+	}
+	mesh.UpdateAABB();
+	mesh.BuildAccelerationStructure(scene.bvhSettings);
+	sphereSet.UpdateAABB();
+	sphereSet.BuildAccelerationStructure(scene.bvhSettings);
+
+	std::vector<Ray> streamRays;
+	streamRays.reserve(bounceRays.size());
+	for (size_t i = 0; i < bounceRays.size(); ++i)
+	{
+		vec3 origin{ gen.RandomFloat(-5.0f, 5.0f), gen.RandomFloat(-5.0f, 5.0f), gen.RandomFloat(-5.0f, 5.0f) };
+		vec3 direction{ gen.RandomFloat(-1.0f, 1.0f), gen.RandomFloat(-1.0f, 1.0f), gen.RandomFloat(-1.0f, 1.0f) };
+		if (glm::dot(direction, direction) < 1e-6f) direction = vec3{ 0.0f, 0.0f, 1.0f };
+		streamRays.push_back(Ray{ origin, glm::normalize(direction) });
+	}
+
+	BenchmarkObjectStream("Mesh of " + std::to_string(streamPrimitiveCount) + " triangles", mesh, streamRays);
+	BenchmarkObjectStream("Set of " + std::to_string(streamPrimitiveCount) + " spheres", sphereSet, streamRays);
+
+	scene.accelerationStructure = originalStructure;
+	scene.PrepareForRayTracing();
+}
+
+void RunPathTracingBenchmark(Scene& scene, const Camera& camera, unsigned int sampleCount, unsigned int traceDepth)
+{
+	UniformRandomGenerator gen;
+	std::vector<Ray> cameraRays;
+	cameraRays.reserve(sampleCount);
+	for (unsigned int i = 0; i < sampleCount; ++i)
+	{
+		cameraRays.push_back(camera.GetPixelRay(gen.RandomFloat(0.0f, float(camera.pixels.width())), gen.RandomFloat(0.0f, float(camera.pixels.height()))));
+	}
+
+	std::cout << "Path tracing benchmark: " + std::to_string(sampleCount) + " camera samples, depth " + std::to_string(traceDepth) + "\r\n";
+	const char* integratorNames[] = { "  TraceRay  ", "  TracePath ", "  Wavefront " };
+	WavefrontIntegrator wavefront{ scene };
+	std::vector<ColorDbl> radiance(sampleCount);
+	for (int integrator = 0; integrator < 3; ++integrator)
+	{
+		UniformRandomGenerator pathGen;
+		ColorDbl sum{ 0.0 };
+		auto start = std::chrono::steady_clock::now();
+		if (integrator == 2)
+		{
+			for (unsigned int first = 0; first < sampleCount; first += WAVEFRONT_DEFAULT_PATH_COUNT)
+			{
+				unsigned int count = std::min(sampleCount - first, (unsigned int)WAVEFRONT_DEFAULT_PATH_COUNT);
+				wavefront.Trace(&cameraRays[first], count, &radiance[first], pathGen, traceDepth);
+			}
+		}
+		else
+		{
+			for (unsigned int i = 0; i < sampleCount; ++i)
+			{
+				radiance[i] = (integrator == 1) ? scene.TracePath(cameraRays[i], pathGen, traceDepth) : scene.TraceRay(cameraRays[i], pathGen, traceDepth);
+			}
+		}
+		double time = Seconds(start);
+
+		for (const ColorDbl& color : radiance)
+		{
+			sum += color;
+		}
+		ColorDbl mean = sum / double(sampleCount);
+		std::cout << std::string(integratorNames[integrator]) + SamplesPerSecond(cameraRays.size(), time)
+			+ ", mean radiance (" + std::to_string(mean.r) + ", " + std::to_string(mean.g) + ", " + std::to_string(mean.b) + ")\r\n";
+	}
+}
@@ -0,0 +1,32 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "scene.h"
+#include "core/camera.h"
+
+/*
+	Compares TriangleSoA::IntersectRange and OccludedRange with Triangle::Intersects for random rays against
+	random slot ranges, once for every kernel table the CPU supports. Prints the mismatches per instruction set
+	and returns true if the hit slots, distances (within a small epsilon) and occlusion results all agree.
+	The previously active kernels are selected again afterwards.
+*/
+bool RunIntersectionKernelCheck(unsigned int rayCount = 100000);
+
+/*
+	Runs one fixed set of primary, shadow and bounce rays through every acceleration structure of the
+	scene (brute force, octree, kd-tree and BVH) and prints build time, memory and rays per second.
+	The hit counts should be the same for every structure, and for the stack-based and stackless
+	traversal of the BVH which are compared next. The bounce and shadow rays are then traced as streams
+	through the scene BVH (Scene::IntersectRays, OccludedRays), and random rays through the IntersectRays
+	of a large mesh and sphere set, each against one query per ray. The scene is prepared with its original structure again afterwards.
+*/
+void RunAccelerationStructureBenchmark(Scene& scene, const Camera& camera, unsigned int rayCount = 100000);
+
+/*
+	Traces the same camera rays with the recursive TraceRay, the iterative TracePath and the
+	WavefrontIntegrator and prints samples per second and the mean radiance of each.
+	The means should agree within the noise.
+*/
+void RunPathTracingBenchmark(Scene& scene, const Camera& camera, unsigned int sampleCount = 20000, unsigned int traceDepth = 100);
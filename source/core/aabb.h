@@ -27,6 +27,26 @@ struct AABB
 		max = vec3{ 0.0f };
 	}
 
+	// Inverted bounds which any point or box can be encapsulated into
+	static AABB Empty()
+	{
+		AABB empty;
+		empty.min = vec3{ FLOAT_INFINITY };
+		empty.max = vec3{ -FLOAT_INFINITY };
+		return empty;
+	}
+
+	inline vec3 Centroid() const
+	{
+		return (min + max) * 0.5f;
+	}
+
+	inline float SurfaceArea() const
+	{
+		vec3 d = max - min;
+		return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
 	inline bool Contains(vec3& point) const
 	{
 		return	point.x >= min.x && point.x <= max.x &&
@@ -46,56 +66,48 @@ struct AABB
 		return true;
 	};
 
-	inline bool IntersectsRay(vec3& rayOrigin, vec3& rayDirection, double t) const
+	// Slab test which reports the entry distance, rejecting boxes behind the ray or beyond maxDistance
+	inline bool IntersectsRay(const Ray& ray, float maxDistance, float& tEntry) const
 	{
-		// https://tavianator.com/fast-branchless-raybounding-box-intersections/
-		// Naive version
-		double tmin = -FLOAT_INFINITY, tmax = FLOAT_INFINITY;
-		double t1;
-		double t2;
+		return RayIntersectsBox(min, max, ray, maxDistance, tEntry);
+	}
 
-		if (rayDirection.x != 0.0) 
-		{
-			t1 = (min.x - rayOrigin.x) / rayDirection.x;
-			t2 = (max.x - rayOrigin.x) / rayDirection.x;
+	inline bool IntersectsRay(const Ray& ray, float maxDistance, float& tEntry, float& tExit) const
+	{
+		return RayIntersectsBox(min, max, ray, maxDistance, tEntry, tExit);
+	}
 
-			tmin = std::max(tmin, std::min(t1, t2));
-			tmax = std::min(tmax, std::max(t1, t2));
-		}
+	/*
+		Branchless slab test (Williams et al. 2005) using the inverse direction and signs cached in the ray.
+		The interval is clamped to [0, maxDistance]. A zero direction component gives infinite
+		plane distances, and the NaN from a ray starting exactly on a plane is ignored by the comparisons.
+	*/
+	static inline bool RayIntersectsBox(const vec3& boxMin, const vec3& boxMax, const Ray& ray, float maxDistance, float& tEntry, float& tExit)
+	{
+		const vec3* bounds[2] = { &boxMin, &boxMax };
 
-		if (rayDirection.y != 0.0) 
+		float tmin = 0.0f;
+		float tmax = maxDistance;
+		for (int axis = 0; axis < 3; ++axis)
 		{
-			t1 = (min.y - rayOrigin.y) / rayDirection.y;
-			t2 = (max.y - rayOrigin.y) / rayDirection.y;
-
-			tmin = std::max(tmin, std::min(t1, t2));
-			tmax = std::min(tmax, std::max(t1, t2));
+			float tNear = ((*bounds[ray.sign[axis]])[axis] - ray.origin[axis]) * ray.invDirection[axis];
+			float tFar = ((*bounds[1 - ray.sign[axis]])[axis] - ray.origin[axis]) * ray.invDirection[axis];
+			tmin = (tNear > tmin) ? tNear : tmin;
+			tmax = (tFar < tmax) ? tFar : tmax;
 		}
 
-		if (rayDirection.z != 0.0) 
-		{
-			t1 = (min.z - rayOrigin.z) / rayDirection.z;
-			t2 = (max.z - rayOrigin.z) / rayDirection.z;
-
-			tmin = std::max(tmin, std::min(t1, t2));
-			tmax = std::min(tmax, std::max(t1, t2));
-		}
+		tEntry = tmin;
+		tExit = tmax;
+		return (tmin <= tmax);
+	}
 
-		if (tmax >= tmin)
-		{
-			t = tmin;
-			return true;
-		}
-		else
-		{
-			// tmax < 0 => ray intersects, but AABB is behind it
-			// tmin > tmax => ray does not intersect AABB
-			t = tmax;
-			return false;
-		}
+	static inline bool RayIntersectsBox(const vec3& boxMin, const vec3& boxMax, const Ray& ray, float maxDistance, float& tEntry)
+	{
+		float tExit = 0.0f;
+		return RayIntersectsBox(boxMin, boxMax, ray, maxDistance, tEntry, tExit);
 	}
 
-	inline void Encapsulate(vec3& point)
+	inline void Encapsulate(const vec3& point)
 	{
 		min.x = std::min(min.x, point.x);
 		min.y = std::min(min.y, point.y);
@@ -106,9 +118,24 @@ struct AABB
 		max.z = std::max(max.z, point.z);
 	}
 
-	inline void Encapsulate(AABB& other)
+	// Union of both boxes, an Empty() box leaves the other unchanged
+	inline void Encapsulate(const AABB& other)
+	{
+		min = glm::min(min, other.min);
+		max = glm::max(max, other.max);
+	}
+
+	// Overlapping part of both boxes, min is larger than max on some axis if they do not overlap
+	static AABB Intersection(const AABB& a, const AABB& b)
+	{
+		AABB result;
+		result.min = glm::max(a.min, b.min);
+		result.max = glm::min(a.max, b.max);
+		return result;
+	}
+
+	inline bool IsEmpty() const
 	{
-		Encapsulate(other.min);
-		Encapsulate(other.max);
+		return min.x > max.x || min.y > max.y || min.z > max.z;
 	}
 };
\ No newline at end of file
@@ -0,0 +1,103 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "../core/math.h"
+#include "../core/material.h"
+#include "../core/kernels.h"
+
+#include <vector>
+#include <algorithm>
+
+/*
+	Directions of many shading evaluations stored as separate coordinate streams (structure of arrays),
+	so that the active kernels (kernels.h) evaluate a whole group at once. All entries of one Evaluate
+	or Fresnel call must share the material, so the caller should group its hits by material first.
+	The streams are padded for the kernels and reused between batches.
+*/
+struct BSDFBatch
+{
+	std::vector<float> incident[3];
+	std::vector<float> outgoing[3];
+	std::vector<float> normal[3];
+	std::vector<float> eta;			// n1 / n2 for Fresnel
+	std::vector<float> cos2t;		// output of Fresnel
+	std::vector<float> result;		// output of Evaluate and Fresnel
+	unsigned int count = 0;
+
+	void Clear() { count = 0; }
+
+	// Returns the index of the new entry, outgoing is ignored by Reflect and Fresnel
+	unsigned int Add(const vec3& incidentDirection, const vec3& outgoingDirection, const vec3& surfaceNormal, float refractionRatio = 1.0f)
+	{
+		if (count + KERNEL_MAX_WIDTH > result.size())
+		{
+			Reserve((count + KERNEL_MAX_WIDTH) * 2);
+		}
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			incident[axis][count] = incidentDirection[axis];
+			outgoing[axis][count] = outgoingDirection[axis];
+			normal[axis][count] = surfaceNormal[axis];
+		}
+		eta[count] = refractionRatio;
+		return count++;
+	}
+
+	inline vec3 Incident(unsigned int i) const { return vec3{ incident[0][i], incident[1][i], incident[2][i] }; }
+	inline vec3 Outgoing(unsigned int i) const { return vec3{ outgoing[0][i], outgoing[1][i], outgoing[2][i] }; }
+	inline vec3 Normal(unsigned int i) const { return vec3{ normal[0][i], normal[1][i], normal[2][i] }; }
+
+	inline ShadingStreams Streams() const
+	{
+		return ShadingStreams{
+			{ incident[0].data(), incident[1].data(), incident[2].data() },
+			{ outgoing[0].data(), outgoing[1].data(), outgoing[2].data() },
+			{ normal[0].data(), normal[1].data(), normal[2].data() }
+		};
+	}
+
+	// Material::BRDF of every entry in result
+	void Evaluate(const Material& material)
+	{
+		switch (material.diffuse)
+		{
+		case DiffuseType::OrenNayar:
+			ActiveKernels().orenNayar(Streams(), count, material.albedo, material.orenNayarA, material.orenNayarB, result.data());
+			break;
+		case DiffuseType::Lambertian:
+		default:
+			std::fill(result.begin(), result.begin() + count, material.albedo);
+			break;
+		}
+	}
+
+	// Mirrors the incident directions, written to outgoing
+	void Reflect()
+	{
+		float* reflected[3] = { outgoing[0].data(), outgoing[1].data(), outgoing[2].data() };
+		ActiveKernels().reflect(Streams(), count, reflected);
+	}
+
+	// Schlick reflectance in result and the squared transmitted cosine in cos2t, the normals must point against the incident directions
+	void Fresnel(const Material& material)
+	{
+		ActiveKernels().fresnel(Streams(), eta.data(), count, material.fresnelR0, cos2t.data(), result.data());
+	}
+
+private:
+	void Reserve(size_t size)
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			incident[axis].resize(size, 0.0f);
+			outgoing[axis].resize(size, 0.0f);
+			normal[axis].resize(size, 0.0f);
+		}
+		eta.resize(size, 0.0f);
+		cos2t.resize(size, 0.0f);
+		result.resize(size, 0.0f);
+	}
+};
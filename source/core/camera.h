@@ -5,6 +5,7 @@
 #pragma once
 #include "pixelbuffer.h"
 #include "../core/ray.h"
+#include "../core/raypacket.h"
 
 class Camera
 {
@@ -55,4 +56,24 @@ public:
 
 		return Ray(position, glm::normalize(direction));
 	}
+
+	// Same projection as GetPixelRay for a group of pixel positions (e.g. one screen tile)
+	void GetPixelRayPacket(const vec2* pixelPositions, unsigned int count, RayPacket& packet) const
+	{
+		// The view rotation is the same for all rays, apply it as three basis vectors
+		vec3 right = vec3(viewMatrix[0]) * (fovPixelScale * float(pixels.aspectRatio()));
+		vec3 up = vec3(viewMatrix[1]) * fovPixelScale;
+		vec3 back = vec3(viewMatrix[2]);
+		float dx = float(pixels.deltaX());
+		float dy = float(pixels.deltaY());
+
+		packet.Clear();
+		count = std::min(count, (unsigned int)RAY_PACKET_MAX_SIZE);
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			vec3 direction = right * (-1.0f + pixelPositions[i].x * dx) + up * (1.0f - pixelPositions[i].y * dy) - back;
+			packet.Add(Ray(position, glm::normalize(direction)));
+		}
+		packet.Finalize();
+	}
 };
\ No newline at end of file
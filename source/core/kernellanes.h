@@ -0,0 +1,370 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+/*
+	Lane-generic intersection and material kernels, included once by each kernel translation unit after defining
+	KERNEL_NAMESPACE. Everything is placed in that namespace so the copies compiled with different
+	instruction set flags never share a symbol, which would let the linker keep the wrong one.
+	Only plain floats and intrinsics are used here for the same reason (no inline library functions).
+*/
+
+#ifndef KERNEL_NAMESPACE
+#error "Define KERNEL_NAMESPACE before including kernellanes.h"
+#endif
+
+#include "kernels.h"
+#include <cfloat>
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86_FP)
+#define KERNEL_LANES_SSE
+#include <immintrin.h>
+#endif
+
+namespace KERNEL_NAMESPACE
+{
+
+/*
+	Lane operations, comparisons return one bit per lane. Min and Max return the second operand
+	for NaN like the SSE instructions.
+*/
+#ifdef KERNEL_LANES_SSE
+struct LanesSSE
+{
+	typedef __m128 Vector;
+	static const unsigned int Width = 4;
+
+	static inline Vector Load(const float* p) { return _mm_loadu_ps(p); }
+	static inline Vector Set(float x) { return _mm_set1_ps(x); }
+	static inline Vector Add(Vector a, Vector b) { return _mm_add_ps(a, b); }
+	static inline Vector Sub(Vector a, Vector b) { return _mm_sub_ps(a, b); }
+	static inline Vector Mul(Vector a, Vector b) { return _mm_mul_ps(a, b); }
+	static inline Vector Div(Vector a, Vector b) { return _mm_div_ps(a, b); }
+	static inline Vector Sqrt(Vector a) { return _mm_sqrt_ps(a); }
+	static inline Vector Min(Vector a, Vector b) { return _mm_min_ps(a, b); }
+	static inline Vector Max(Vector a, Vector b) { return _mm_max_ps(a, b); }
+	static inline unsigned int Less(Vector a, Vector b) { return (unsigned int)_mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+	static inline unsigned int LessEqual(Vector a, Vector b) { return (unsigned int)_mm_movemask_ps(_mm_cmple_ps(a, b)); }
+	static inline unsigned int Greater(Vector a, Vector b) { return (unsigned int)_mm_movemask_ps(_mm_cmpgt_ps(a, b)); }
+	static inline void Store(float* p, Vector a) { _mm_storeu_ps(p, a); }
+};
+#endif
+
+#ifdef __AVX__
+struct LanesAVX
+{
+	typedef __m256 Vector;
+	static const unsigned int Width = 8;
+
+	static inline Vector Load(const float* p) { return _mm256_loadu_ps(p); }
+	static inline Vector Set(float x) { return _mm256_set1_ps(x); }
+	static inline Vector Add(Vector a, Vector b) { return _mm256_add_ps(a, b); }
+	static inline Vector Sub(Vector a, Vector b) { return _mm256_sub_ps(a, b); }
+	static inline Vector Mul(Vector a, Vector b) { return _mm256_mul_ps(a, b); }
+	static inline Vector Div(Vector a, Vector b) { return _mm256_div_ps(a, b); }
+	static inline Vector Sqrt(Vector a) { return _mm256_sqrt_ps(a); }
+	static inline Vector Min(Vector a, Vector b) { return _mm256_min_ps(a, b); }
+	static inline Vector Max(Vector a, Vector b) { return _mm256_max_ps(a, b); }
+	static inline unsigned int Less(Vector a, Vector b) { return (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+	static inline unsigned int LessEqual(Vector a, Vector b) { return (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ)); }
+	static inline unsigned int Greater(Vector a, Vector b) { return (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ)); }
+	static inline void Store(float* p, Vector a) { _mm256_storeu_ps(p, a); }
+};
+#endif
+
+#ifdef __AVX512F__
+struct LanesAVX512
+{
+	typedef __m512 Vector;
+	static const unsigned int Width = 16;
+
+	static inline Vector Load(const float* p) { return _mm512_loadu_ps(p); }
+	static inline Vector Set(float x) { return _mm512_set1_ps(x); }
+	static inline Vector Add(Vector a, Vector b) { return _mm512_add_ps(a, b); }
+	static inline Vector Sub(Vector a, Vector b) { return _mm512_sub_ps(a, b); }
+	static inline Vector Mul(Vector a, Vector b) { return _mm512_mul_ps(a, b); }
+	static inline Vector Div(Vector a, Vector b) { return _mm512_div_ps(a, b); }
+	static inline Vector Sqrt(Vector a) { return _mm512_sqrt_ps(a); }
+	static inline Vector Min(Vector a, Vector b) { return _mm512_min_ps(a, b); }
+	static inline Vector Max(Vector a, Vector b) { return _mm512_max_ps(a, b); }
+	static inline unsigned int Less(Vector a, Vector b) { return (unsigned int)_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+	static inline unsigned int LessEqual(Vector a, Vector b) { return (unsigned int)_mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+	static inline unsigned int Greater(Vector a, Vector b) { return (unsigned int)_mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+	static inline void Store(float* p, Vector a) { _mm512_storeu_ps(p, a); }
+};
+#endif
+
+// Bits of the lanes below laneCount
+template<typename Lanes>
+inline unsigned int LaneMask(unsigned int laneCount)
+{
+	return (laneCount >= Lanes::Width) ? ((Lanes::Width >= 32) ? ~0u : ((1u << Lanes::Width) - 1u)) : ((1u << laneCount) - 1u);
+}
+
+/*
+	One ray against Lanes::Width triangles starting at slot (Moller-Trumbore), the lanes at or beyond laneCount are ignored.
+	Follows TriangleSoA::Intersects operation by operation (including how NaN compares), so both report the same hits
+	unless the compiler contracts the multiply-adds to FMA.
+	Returns a bit mask of the lanes hit closer than maxDistance, with their distances in t.
+*/
+template<typename Lanes>
+inline unsigned int IntersectTriangleLanes(const TriangleStreams& soa, unsigned int slot, unsigned int laneCount, const float* rayOrigin, const float* rayDirection, float maxDistance, float* t)
+{
+	typedef typename Lanes::Vector Vector;
+
+	Vector dx = Lanes::Set(rayDirection[0]);
+	Vector dy = Lanes::Set(rayDirection[1]);
+	Vector dz = Lanes::Set(rayDirection[2]);
+	Vector e1x = Lanes::Load(soa.edge1[0] + slot);
+	Vector e1y = Lanes::Load(soa.edge1[1] + slot);
+	Vector e1z = Lanes::Load(soa.edge1[2] + slot);
+	Vector e2x = Lanes::Load(soa.edge2[0] + slot);
+	Vector e2y = Lanes::Load(soa.edge2[1] + slot);
+	Vector e2z = Lanes::Load(soa.edge2[2] + slot);
+
+	// h = cross(direction, edge2), a = dot(edge1, h)
+	Vector hx = Lanes::Sub(Lanes::Mul(dy, e2z), Lanes::Mul(e2y, dz));
+	Vector hy = Lanes::Sub(Lanes::Mul(dz, e2x), Lanes::Mul(e2z, dx));
+	Vector hz = Lanes::Sub(Lanes::Mul(dx, e2y), Lanes::Mul(e2x, dy));
+	Vector a = Lanes::Add(Lanes::Add(Lanes::Mul(e1x, hx), Lanes::Mul(e1y, hy)), Lanes::Mul(e1z, hz));
+
+	unsigned int mask = LaneMask<Lanes>(laneCount);
+	mask &= ~(Lanes::Less(a, Lanes::Set(FLT_EPSILON)) & Lanes::Greater(a, Lanes::Set(-FLT_EPSILON)));
+	if (!mask) return 0;
+
+	Vector zero = Lanes::Set(0.0f);
+	Vector one = Lanes::Set(1.0f);
+	Vector f = Lanes::Div(one, a);
+	Vector sx = Lanes::Sub(Lanes::Set(rayOrigin[0]), Lanes::Load(soa.vertex0[0] + slot));
+	Vector sy = Lanes::Sub(Lanes::Set(rayOrigin[1]), Lanes::Load(soa.vertex0[1] + slot));
+	Vector sz = Lanes::Sub(Lanes::Set(rayOrigin[2]), Lanes::Load(soa.vertex0[2] + slot));
+	Vector u = Lanes::Mul(f, Lanes::Add(Lanes::Add(Lanes::Mul(sx, hx), Lanes::Mul(sy, hy)), Lanes::Mul(sz, hz)));
+	mask &= ~(Lanes::Less(u, zero) | Lanes::Greater(u, one));
+	if (!mask) return 0;
+
+	// q = cross(s, edge1)
+	Vector qx = Lanes::Sub(Lanes::Mul(sy, e1z), Lanes::Mul(e1y, sz));
+	Vector qy = Lanes::Sub(Lanes::Mul(sz, e1x), Lanes::Mul(e1z, sx));
+	Vector qz = Lanes::Sub(Lanes::Mul(sx, e1y), Lanes::Mul(e1x, sy));
+	Vector v = Lanes::Mul(f, Lanes::Add(Lanes::Add(Lanes::Mul(dx, qx), Lanes::Mul(dy, qy)), Lanes::Mul(dz, qz)));
+	mask &= ~(Lanes::Less(v, zero) | Lanes::Greater(Lanes::Add(u, v), one));
+	if (!mask) return 0;
+
+	Vector distance = Lanes::Mul(f, Lanes::Add(Lanes::Add(Lanes::Mul(e2x, qx), Lanes::Mul(e2y, qy)), Lanes::Mul(e2z, qz)));
+	mask &= Lanes::Greater(distance, Lanes::Set(FLT_EPSILON)) & Lanes::Less(distance, Lanes::Set(maxDistance));
+
+	Lanes::Store(t, distance);
+	return mask;
+}
+
+/*
+	One ray against Lanes::Width spheres starting at slot, the lanes at or beyond laneCount are ignored.
+	Follows IntersectSphere operation by operation, the choice between the near and the far root is made
+	per lane afterwards. Returns a bit mask of the lanes hit closer than maxDistance, with their distances in t.
+*/
+template<typename Lanes>
+inline unsigned int IntersectSphereLanes(const SphereStreams& soa, unsigned int slot, unsigned int laneCount, const float* rayOrigin, const float* rayDirection, float maxDistance, float* t)
+{
+	typedef typename Lanes::Vector Vector;
+
+	Vector radius = Lanes::Load(soa.radius + slot);
+	Vector lx = Lanes::Sub(Lanes::Load(soa.center[0] + slot), Lanes::Set(rayOrigin[0]));
+	Vector ly = Lanes::Sub(Lanes::Load(soa.center[1] + slot), Lanes::Set(rayOrigin[1]));
+	Vector lz = Lanes::Sub(Lanes::Load(soa.center[2] + slot), Lanes::Set(rayOrigin[2]));
+	Vector tca = Lanes::Add(Lanes::Add(Lanes::Mul(lx, Lanes::Set(rayDirection[0])), Lanes::Mul(ly, Lanes::Set(rayDirection[1]))), Lanes::Mul(lz, Lanes::Set(rayDirection[2])));
+
+	Vector zero = Lanes::Set(0.0f);
+	unsigned int mask = LaneMask<Lanes>(laneCount);
+	mask &= ~(Lanes::Less(radius, Lanes::Set(FLT_EPSILON)) | Lanes::Less(tca, zero));
+	if (!mask) return 0;
+
+	Vector radiusSq = Lanes::Mul(radius, radius);
+	Vector lengthSq = Lanes::Add(Lanes::Add(Lanes::Mul(lx, lx), Lanes::Mul(ly, ly)), Lanes::Mul(lz, lz));
+	Vector distanceSq = Lanes::Sub(lengthSq, Lanes::Mul(tca, tca));
+	mask &= ~Lanes::Greater(distanceSq, radiusSq);
+	if (!mask) return 0;
+
+	float t1[Lanes::Width];
+	Vector thc = Lanes::Sqrt(Lanes::Sub(radiusSq, distanceSq));
+	Lanes::Store(t, Lanes::Sub(tca, thc));
+	Lanes::Store(t1, Lanes::Add(tca, thc));
+
+	for (unsigned int i = 0; i < Lanes::Width; ++i)
+	{
+		if (!(mask & (1u << i))) continue;
+
+		if (t[i] < 0.0f) t[i] = t1[i];
+		if (t[i] < 0.0f || !(t[i] < maxDistance)) mask &= ~(1u << i);
+	}
+	return mask;
+}
+
+/*
+	Range loops shared by the triangle and sphere kernels
+*/
+template<typename Lanes, typename Streams, unsigned int(*IntersectLanes)(const Streams&, unsigned int, unsigned int, const float*, const float*, float, float*)>
+bool IntersectRange(const Streams& soa, unsigned int first, unsigned int count, const float* rayOrigin, const float* rayDirection, float& nearestDistance, unsigned int& hitSlot)
+{
+	bool hit = false;
+	float t[Lanes::Width];
+	for (unsigned int slot = first; slot < first + count; slot += Lanes::Width)
+	{
+		unsigned int mask = IntersectLanes(soa, slot, first + count - slot, rayOrigin, rayDirection, nearestDistance, t);
+		for (unsigned int i = 0; mask != 0; ++i, mask >>= 1)
+		{
+			if ((mask & 1u) && t[i] < nearestDistance)
+			{
+				nearestDistance = t[i];
+				hitSlot = slot + i;
+				hit = true;
+			}
+		}
+	}
+	return hit;
+}
+
+template<typename Lanes, typename Streams, unsigned int(*IntersectLanes)(const Streams&, unsigned int, unsigned int, const float*, const float*, float, float*)>
+bool OccludedRange(const Streams& soa, unsigned int first, unsigned int count, const float* rayOrigin, const float* rayDirection, float maxDistance)
+{
+	float t[Lanes::Width];
+	for (unsigned int slot = first; slot < first + count; slot += Lanes::Width)
+	{
+		if (IntersectLanes(soa, slot, first + count - slot, rayOrigin, rayDirection, maxDistance, t)) return true;
+	}
+	return false;
+}
+
+template<typename Lanes>
+bool IntersectTriangles(const TriangleStreams& triangles, unsigned int first, unsigned int count, const float* rayOrigin, const float* rayDirection, float& nearestDistance, unsigned int& hitSlot)
+{
+	return IntersectRange<Lanes, TriangleStreams, IntersectTriangleLanes<Lanes>>(triangles, first, count, rayOrigin, rayDirection, nearestDistance, hitSlot);
+}
+
+template<typename Lanes>
+bool OccludedTriangles(const TriangleStreams& triangles, unsigned int first, unsigned int count, const float* rayOrigin, const float* rayDirection, float maxDistance)
+{
+	return OccludedRange<Lanes, TriangleStreams, IntersectTriangleLanes<Lanes>>(triangles, first, count, rayOrigin, rayDirection, maxDistance);
+}
+
+template<typename Lanes>
+bool IntersectSpheres(const SphereStreams& spheres, unsigned int first, unsigned int count, const float* rayOrigin, const float* rayDirection, float& nearestDistance, unsigned int& hitSlot)
+{
+	return IntersectRange<Lanes, SphereStreams, IntersectSphereLanes<Lanes>>(spheres, first, count, rayOrigin, rayDirection, nearestDistance, hitSlot);
+}
+
+template<typename Lanes>
+bool OccludedSpheres(const SphereStreams& spheres, unsigned int first, unsigned int count, const float* rayOrigin, const float* rayDirection, float maxDistance)
+{
+	return OccludedRange<Lanes, SphereStreams, IntersectSphereLanes<Lanes>>(spheres, first, count, rayOrigin, rayDirection, maxDistance);
+}
+
+/*
+	Slab test of count boxes, count must be a multiple of Lanes::Width.
+	The operand order of Min and Max decides how NaN distances from 0 * infinity resolve, it matches
+	the child test the wide BVH used before the kernels were dispatched at runtime.
+*/
+template<typename Lanes>
+unsigned int IntersectBoxes(const BoxStreams& boxes, unsigned int count, const float* rayOrigin, const float* rayInvDirection, float maxDistance, float* tEntry)
+{
+	typedef typename Lanes::Vector Vector;
+
+	Vector originX = Lanes::Set(rayOrigin[0]), invX = Lanes::Set(rayInvDirection[0]);
+	Vector originY = Lanes::Set(rayOrigin[1]), invY = Lanes::Set(rayInvDirection[1]);
+	Vector originZ = Lanes::Set(rayOrigin[2]), invZ = Lanes::Set(rayInvDirection[2]);
+
+	unsigned int mask = 0;
+	for (unsigned int group = 0; group < count; group += Lanes::Width)
+	{
+		Vector t1 = Lanes::Mul(Lanes::Sub(Lanes::Load(boxes.min[0] + group), originX), invX);
+		Vector t2 = Lanes::Mul(Lanes::Sub(Lanes::Load(boxes.max[0] + group), originX), invX);
+		Vector tmin = Lanes::Max(Lanes::Min(t1, t2), Lanes::Set(0.0f));
+		Vector tmax = Lanes::Min(Lanes::Max(t1, t2), Lanes::Set(maxDistance));
+
+		t1 = Lanes::Mul(Lanes::Sub(Lanes::Load(boxes.min[1] + group), originY), invY);
+		t2 = Lanes::Mul(Lanes::Sub(Lanes::Load(boxes.max[1] + group), originY), invY);
+		tmin = Lanes::Max(tmin, Lanes::Min(t1, t2));
+		tmax = Lanes::Min(tmax, Lanes::Max(t1, t2));
+
+		t1 = Lanes::Mul(Lanes::Sub(Lanes::Load(boxes.min[2] + group), originZ), invZ);
+		t2 = Lanes::Mul(Lanes::Sub(Lanes::Load(boxes.max[2] + group), originZ), invZ);
+		tmin = Lanes::Max(tmin, Lanes::Min(t1, t2));
+		tmax = Lanes::Min(tmax, Lanes::Max(t1, t2));
+
+		Lanes::Store(tEntry + group, tmin);
+		mask |= Lanes::LessEqual(tmin, tmax) << group;
+	}
+	return mask;
+}
+
+/*
+	Material kernels, every Lanes::Width entries are evaluated together and the last group may run past count
+*/
+template<typename Lanes>
+inline typename Lanes::Vector DotLanes(const float* const a[3], const float* const b[3], unsigned int i)
+{
+	return Lanes::Add(Lanes::Add(Lanes::Mul(Lanes::Load(a[0] + i), Lanes::Load(b[0] + i)), Lanes::Mul(Lanes::Load(a[1] + i), Lanes::Load(b[1] + i))), Lanes::Mul(Lanes::Load(a[2] + i), Lanes::Load(b[2] + i)));
+}
+
+// Follows OrenNayarFactor (material.h)
+template<typename Lanes>
+void EvaluateOrenNayar(const ShadingStreams& streams, unsigned int count, float albedo, float A, float B, float* brdf)
+{
+	typedef typename Lanes::Vector Vector;
+
+	Vector zero = Lanes::Set(0.0f);
+	Vector one = Lanes::Set(1.0f);
+	for (unsigned int i = 0; i < count; i += Lanes::Width)
+	{
+		Vector cosIn = DotLanes<Lanes>(streams.incident, streams.normal, i);
+		Vector cosOut = DotLanes<Lanes>(streams.outgoing, streams.normal, i);
+		Vector cosInOut = DotLanes<Lanes>(streams.incident, streams.outgoing, i);
+
+		Vector cosAlpha = Lanes::Min(cosIn, cosOut);
+		Vector cosBeta = Lanes::Max(cosIn, cosOut);
+		Vector sinAlpha = Lanes::Sqrt(Lanes::Max(Lanes::Sub(one, Lanes::Mul(cosAlpha, cosAlpha)), zero));
+		Vector tanBeta = Lanes::Div(Lanes::Sqrt(Lanes::Max(Lanes::Sub(one, Lanes::Mul(cosBeta, cosBeta)), zero)), cosBeta);
+
+		Vector factor = Lanes::Add(Lanes::Set(A), Lanes::Mul(Lanes::Mul(Lanes::Mul(Lanes::Set(B), Lanes::Max(cosInOut, zero)), sinAlpha), tanBeta));
+		Lanes::Store(brdf + i, Lanes::Mul(Lanes::Set(albedo), factor));
+	}
+}
+
+// incident - 2 * dot(normal, incident) * normal, like glm::reflect
+template<typename Lanes>
+void Reflect(const ShadingStreams& streams, unsigned int count, float* const reflected[3])
+{
+	typedef typename Lanes::Vector Vector;
+
+	Vector two = Lanes::Set(2.0f);
+	for (unsigned int i = 0; i < count; i += Lanes::Width)
+	{
+		Vector scale = Lanes::Mul(DotLanes<Lanes>(streams.normal, streams.incident, i), two);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			Vector normal = Lanes::Load(streams.normal[axis] + i);
+			Lanes::Store(reflected[axis] + i, Lanes::Sub(Lanes::Load(streams.incident[axis] + i), Lanes::Mul(normal, scale)));
+		}
+	}
+}
+
+// Same operations as the refraction in Scene::TracePath
+template<typename Lanes>
+void Fresnel(const ShadingStreams& streams, const float* eta, unsigned int count, float R0, float* cos2t, float* reflectance)
+{
+	typedef typename Lanes::Vector Vector;
+
+	Vector one = Lanes::Set(1.0f);
+	Vector r0 = Lanes::Set(R0);
+	for (unsigned int i = 0; i < count; i += Lanes::Width)
+	{
+		Vector cosI = DotLanes<Lanes>(streams.incident, streams.normal, i);
+		Vector n = Lanes::Load(eta + i);
+		Lanes::Store(cos2t + i, Lanes::Sub(one, Lanes::Mul(Lanes::Mul(n, n), Lanes::Sub(one, Lanes::Mul(cosI, cosI)))));
+
+		Vector c = Lanes::Add(one, cosI);
+		Vector c5 = Lanes::Mul(Lanes::Mul(Lanes::Mul(Lanes::Mul(c, c), c), c), c);
+		Lanes::Store(reflectance + i, Lanes::Add(r0, Lanes::Mul(Lanes::Sub(one, r0), c5)));
+	}
+}
+
+} // namespace KERNEL_NAMESPACE
@@ -0,0 +1,181 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#include "kernels.h"
+#include <cmath>
+#include <cctype>
+#include <cstring>
+
+#define KERNEL_NAMESPACE KernelsScalar
+#include "kernellanes.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define KERNELS_HAVE_CPUID
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#define KERNELS_HAVE_CPUID
+#include <cpuid.h>
+#endif
+
+namespace KernelsScalar
+{
+	// One lane, the fallback for CPUs without the instruction sets above and for A/B comparisons
+	struct LanesScalar
+	{
+		typedef float Vector;
+		static const unsigned int Width = 1;
+
+		static inline Vector Load(const float* p) { return *p; }
+		static inline Vector Set(float x) { return x; }
+		static inline Vector Add(Vector a, Vector b) { return a + b; }
+		static inline Vector Sub(Vector a, Vector b) { return a - b; }
+		static inline Vector Mul(Vector a, Vector b) { return a * b; }
+		static inline Vector Div(Vector a, Vector b) { return a / b; }
+		static inline Vector Sqrt(Vector a) { return std::sqrt(a); }
+		static inline Vector Min(Vector a, Vector b) { return (a < b) ? a : b; }
+		static inline Vector Max(Vector a, Vector b) { return (a > b) ? a : b; }
+		static inline unsigned int Less(Vector a, Vector b) { return (a < b) ? 1u : 0u; }
+		static inline unsigned int LessEqual(Vector a, Vector b) { return (a <= b) ? 1u : 0u; }
+		static inline unsigned int Greater(Vector a, Vector b) { return (a > b) ? 1u : 0u; }
+		static inline void Store(float* p, Vector a) { *p = a; }
+	};
+
+	static const IntersectionKernels kernels = {
+		InstructionSet::Scalar, LanesScalar::Width, 4,
+		&IntersectTriangles<LanesScalar>, &OccludedTriangles<LanesScalar>,
+		&IntersectSpheres<LanesScalar>, &OccludedSpheres<LanesScalar>,
+		&IntersectBoxes<LanesScalar>,
+		&EvaluateOrenNayar<LanesScalar>, &Reflect<LanesScalar>, &Fresnel<LanesScalar>
+	};
+}
+
+const IntersectionKernels* ScalarKernels() { return &KernelsScalar::kernels; }
+
+namespace
+{
+	const IntersectionKernels* CompiledKernels(InstructionSet instructionSet)
+	{
+		switch (instructionSet)
+		{
+		case InstructionSet::Scalar: return ScalarKernels();
+		case InstructionSet::SSE42:  return SSE42Kernels();
+		case InstructionSet::AVX2:   return AVX2Kernels();
+		case InstructionSet::AVX512: return AVX512Kernels();
+		default:                     return nullptr;
+		}
+	}
+
+#ifdef KERNELS_HAVE_CPUID
+	void CPUID(unsigned int leaf, unsigned int subleaf, unsigned int registers[4])
+	{
+#ifdef _MSC_VER
+		__cpuidex(reinterpret_cast<int*>(registers), (int)leaf, (int)subleaf);
+#else
+		__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+	}
+
+	// Register state the operating system saves on context switches
+	unsigned long long EnabledStateMask()
+	{
+#ifdef _MSC_VER
+		return _xgetbv(0);
+#else
+		unsigned int low, high;
+		__asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+		return ((unsigned long long)high << 32) | low;
+#endif
+	}
+#endif
+
+	bool CPUSupports(InstructionSet instructionSet)
+	{
+		if (instructionSet == InstructionSet::Scalar) return true;
+
+#ifdef KERNELS_HAVE_CPUID
+		unsigned int registers[4] = { 0, 0, 0, 0 };	// eax, ebx, ecx, edx
+		CPUID(0, 0, registers);
+		unsigned int maxLeaf = registers[0];
+		if (maxLeaf < 1) return false;
+
+		CPUID(1, 0, registers);
+		bool sse42 = (registers[2] & (1u << 20)) != 0;
+		bool osxsave = (registers[2] & (1u << 27)) != 0;
+		bool avx = (registers[2] & (1u << 28)) != 0;
+		if (instructionSet == InstructionSet::SSE42) return sse42;
+		if (!sse42 || !osxsave || !avx || maxLeaf < 7) return false;
+
+		// XMM and YMM state, plus the opmask and ZMM state for AVX-512
+		unsigned long long stateMask = EnabledStateMask();
+		bool avxState = (stateMask & 0x6) == 0x6;
+		bool avx512State = (stateMask & 0xE6) == 0xE6;
+
+		CPUID(7, 0, registers);
+		bool avx2 = (registers[1] & (1u << 5)) != 0;
+		bool avx512f = (registers[1] & (1u << 16)) != 0;
+		if (instructionSet == InstructionSet::AVX2) return avx2 && avxState;
+		if (instructionSet == InstructionSet::AVX512) return avx2 && avx512f && avx512State;
+#endif
+		return false;
+	}
+}
+
+bool IsSupported(InstructionSet instructionSet)
+{
+	return CompiledKernels(instructionSet) != nullptr && CPUSupports(instructionSet);
+}
+
+InstructionSet BestSupportedInstructionSet()
+{
+	for (int i = (int)InstructionSet::COUNT - 1; i > 0; --i)
+	{
+		if (IsSupported(InstructionSet(i))) return InstructionSet(i);
+	}
+	return InstructionSet::Scalar;
+}
+
+const IntersectionKernels* activeKernels = CompiledKernels(BestSupportedInstructionSet());
+
+bool SelectKernels(InstructionSet instructionSet)
+{
+	if (!IsSupported(instructionSet)) return false;
+
+	activeKernels = CompiledKernels(instructionSet);
+	return true;
+}
+
+const char* InstructionSetName(InstructionSet instructionSet)
+{
+	switch (instructionSet)
+	{
+	case InstructionSet::Scalar: return "scalar";
+	case InstructionSet::SSE42:  return "sse4.2";
+	case InstructionSet::AVX2:   return "avx2";
+	case InstructionSet::AVX512: return "avx512";
+	default:                     return "unknown";
+	}
+}
+
+bool ParseInstructionSet(const char* name, InstructionSet& instructionSet)
+{
+	for (int i = 0; i < (int)InstructionSet::COUNT; ++i)
+	{
+		const char* candidate = InstructionSetName(InstructionSet(i));
+		size_t length = std::strlen(candidate);
+		if (std::strlen(name) != length) continue;
+
+		bool equal = true;
+		for (size_t c = 0; c < length && equal; ++c)
+		{
+			equal = std::tolower((unsigned char)name[c]) == candidate[c];
+		}
+
+		if (equal)
+		{
+			instructionSet = InstructionSet(i);
+			return true;
+		}
+	}
+	return false;
+}
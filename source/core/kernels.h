@@ -0,0 +1,100 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+
+/*
+	Instruction sets the intersection and material kernels are compiled for. Each one is built in its own
+	translation unit with matching compiler flags (kernels_sse42.cpp, kernels_avx2.cpp, kernels_avx512.cpp),
+	the rest of the program is built for the generic target and calls the kernels through the
+	active IntersectionKernels table, which is picked at startup from what the CPU supports.
+*/
+enum class InstructionSet { Scalar, SSE42, AVX2, AVX512, COUNT };
+
+// Input streams of the kernels, the layouts of TriangleSoA, SphereSoA and WideBVHNode
+struct TriangleStreams
+{
+	const float* vertex0[3];
+	const float* edge1[3];
+	const float* edge2[3];
+};
+
+struct SphereStreams
+{
+	const float* center[3];
+	const float* radius;
+};
+
+struct BoxStreams
+{
+	const float* min[3];
+	const float* max[3];
+};
+
+// Per evaluation directions of a BSDFBatch (bsdf.h)
+struct ShadingStreams
+{
+	const float* incident[3];
+	const float* outgoing[3];
+	const float* normal[3];
+};
+
+/*
+	Origins and directions are passed as three floats. The triangle and sphere streams must be readable
+	for KERNEL_MAX_WIDTH slots past the range, their padding slots never hit. The shading streams and
+	outputs must be readable and writable for KERNEL_MAX_WIDTH entries past count.
+*/
+#define KERNEL_MAX_WIDTH 16
+
+struct IntersectionKernels
+{
+	InstructionSet instructionSet;
+	unsigned int triangleWidth;			// triangles or spheres tested per step
+	unsigned int bvhWidth;				// preferred wide BVH branching factor, 4 or 8
+
+	// Closest hit among the slots [first, first + count) closer than nearestDistance, updates nearestDistance and hitSlot on a hit
+	bool (*intersectTriangles)(const TriangleStreams& triangles, unsigned int first, unsigned int count, const float* rayOrigin, const float* rayDirection, float& nearestDistance, unsigned int& hitSlot);
+	bool (*occludedTriangles)(const TriangleStreams& triangles, unsigned int first, unsigned int count, const float* rayOrigin, const float* rayDirection, float maxDistance);
+	bool (*intersectSpheres)(const SphereStreams& spheres, unsigned int first, unsigned int count, const float* rayOrigin, const float* rayDirection, float& nearestDistance, unsigned int& hitSlot);
+	bool (*occludedSpheres)(const SphereStreams& spheres, unsigned int first, unsigned int count, const float* rayOrigin, const float* rayDirection, float maxDistance);
+
+	// Slab test against count boxes (4 or 8), bit mask of the boxes hit closer than maxDistance with their entry distances in tEntry
+	unsigned int (*intersectBoxes)(const BoxStreams& boxes, unsigned int count, const float* rayOrigin, const float* rayInvDirection, float maxDistance, float* tEntry);
+
+	// Material::BRDF of an Oren-Nayar material for count evaluations, A and B from Material::Prepare
+	void (*orenNayar)(const ShadingStreams& streams, unsigned int count, float albedo, float A, float B, float* brdf);
+
+	// Incident directions mirrored about the normals
+	void (*reflect)(const ShadingStreams& streams, unsigned int count, float* const reflected[3]);
+
+	// Schlick reflectance and the squared cosine of the transmitted direction (negative on total internal reflection), normals pointing against the incident directions
+	void (*fresnel)(const ShadingStreams& streams, const float* eta, unsigned int count, float R0, float* cos2t, float* reflectance);
+};
+
+// Kernel tables of each translation unit, nullptr if the compiler could not target the instruction set
+const IntersectionKernels* ScalarKernels();
+const IntersectionKernels* SSE42Kernels();
+const IntersectionKernels* AVX2Kernels();
+const IntersectionKernels* AVX512Kernels();
+
+extern const IntersectionKernels* activeKernels;
+
+inline const IntersectionKernels& ActiveKernels() { return *activeKernels; }
+
+// Compiled in and supported by the CPU and the operating system (CPUID and XGETBV)
+bool IsSupported(InstructionSet instructionSet);
+
+InstructionSet BestSupportedInstructionSet();
+
+/*
+	Switches all kernels, returns false and keeps the current ones if the instruction set is not supported.
+	Must not be called while other threads trace rays, and acceleration structures built before the
+	call keep the wide BVH width of the previous kernels.
+*/
+bool SelectKernels(InstructionSet instructionSet);
+
+const char* InstructionSetName(InstructionSet instructionSet);
+
+// Accepts the names returned by InstructionSetName, case insensitive ("scalar", "sse4.2", "avx2", "avx512")
+bool ParseInstructionSet(const char* name, InstructionSet& instructionSet);
@@ -0,0 +1,33 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+// Built with AVX2 code generation (premake5.lua), only called when the CPU supports it
+#include "kernels.h"
+
+#if defined(__AVX2__)
+#define KERNEL_NAMESPACE KernelsAVX2
+#include "kernellanes.h"
+
+namespace KernelsAVX2
+{
+	// 4-wide nodes are tested with SSE lanes (VEX encoded)
+	static unsigned int IntersectNodeBoxes(const BoxStreams& boxes, unsigned int count, const float* rayOrigin, const float* rayInvDirection, float maxDistance, float* tEntry)
+	{
+		if (count % LanesAVX::Width == 0) return IntersectBoxes<LanesAVX>(boxes, count, rayOrigin, rayInvDirection, maxDistance, tEntry);
+		return IntersectBoxes<LanesSSE>(boxes, count, rayOrigin, rayInvDirection, maxDistance, tEntry);
+	}
+
+	static const IntersectionKernels kernels = {
+		InstructionSet::AVX2, LanesAVX::Width, 8,
+		&IntersectTriangles<LanesAVX>, &OccludedTriangles<LanesAVX>,
+		&IntersectSpheres<LanesAVX>, &OccludedSpheres<LanesAVX>,
+		&IntersectNodeBoxes,
+		&EvaluateOrenNayar<LanesAVX>, &Reflect<LanesAVX>, &Fresnel<LanesAVX>
+	};
+}
+
+const IntersectionKernels* AVX2Kernels() { return &KernelsAVX2::kernels; }
+#else
+const IntersectionKernels* AVX2Kernels() { return nullptr; }
+#endif
@@ -0,0 +1,33 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+// Built with AVX-512 code generation (premake5.lua), only called when the CPU supports it
+#include "kernels.h"
+
+#if defined(__AVX512F__)
+#define KERNEL_NAMESPACE KernelsAVX512
+#include "kernellanes.h"
+
+namespace KernelsAVX512
+{
+	// Wide BVH nodes have at most 8 children, they are tested with AVX lanes
+	static unsigned int IntersectNodeBoxes(const BoxStreams& boxes, unsigned int count, const float* rayOrigin, const float* rayInvDirection, float maxDistance, float* tEntry)
+	{
+		if (count % LanesAVX::Width == 0) return IntersectBoxes<LanesAVX>(boxes, count, rayOrigin, rayInvDirection, maxDistance, tEntry);
+		return IntersectBoxes<LanesSSE>(boxes, count, rayOrigin, rayInvDirection, maxDistance, tEntry);
+	}
+
+	static const IntersectionKernels kernels = {
+		InstructionSet::AVX512, LanesAVX512::Width, 8,
+		&IntersectTriangles<LanesAVX512>, &OccludedTriangles<LanesAVX512>,
+		&IntersectSpheres<LanesAVX512>, &OccludedSpheres<LanesAVX512>,
+		&IntersectNodeBoxes,
+		&EvaluateOrenNayar<LanesAVX512>, &Reflect<LanesAVX512>, &Fresnel<LanesAVX512>
+	};
+}
+
+const IntersectionKernels* AVX512Kernels() { return &KernelsAVX512::kernels; }
+#else
+const IntersectionKernels* AVX512Kernels() { return nullptr; }
+#endif
@@ -0,0 +1,26 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+// Built with SSE4.2 code generation (premake5.lua), only called when the CPU supports it
+#include "kernels.h"
+
+#if defined(__SSE4_2__) || defined(_M_X64)
+#define KERNEL_NAMESPACE KernelsSSE42
+#include "kernellanes.h"
+
+namespace KernelsSSE42
+{
+	static const IntersectionKernels kernels = {
+		InstructionSet::SSE42, LanesSSE::Width, 4,
+		&IntersectTriangles<LanesSSE>, &OccludedTriangles<LanesSSE>,
+		&IntersectSpheres<LanesSSE>, &OccludedSpheres<LanesSSE>,
+		&IntersectBoxes<LanesSSE>,
+		&EvaluateOrenNayar<LanesSSE>, &Reflect<LanesSSE>, &Fresnel<LanesSSE>
+	};
+}
+
+const IntersectionKernels* SSE42Kernels() { return &KernelsSSE42::kernels; }
+#else
+const IntersectionKernels* SSE42Kernels() { return nullptr; }
+#endif
@@ -8,6 +8,20 @@
 enum class SurfaceType { Diffuse, Specular, Diffuse_Specular, Refractive, COUNT };
 enum class DiffuseType { Lambertian, OrenNayar, COUNT };
 
+/*
+	Oren-Nayar factor A + B * max(0, cos(phi)) * sin(alpha) * tan(beta) with alpha = max(theta_in, theta_out)
+	and beta = min(theta_in, theta_out), computed from the cosines without inverse trigonometry:
+	the larger angle has the smaller cosine, sin(acos(c)) = sqrt(1 - c^2) and tan(acos(c)) = sqrt(1 - c^2) / c.
+*/
+inline float OrenNayarFactor(float A, float B, float cosIn, float cosOut, float cosInOut)
+{
+	float cosAlpha = glm::min(cosIn, cosOut);
+	float cosBeta = glm::max(cosIn, cosOut);
+	float sinAlpha = sqrtf(glm::max(1.0f - cosAlpha * cosAlpha, 0.0f));
+	float tanBeta = sqrtf(glm::max(1.0f - cosBeta * cosBeta, 0.0f)) / cosBeta;
+	return A + B * glm::max(cosInOut, 0.0f) * sinAlpha * tanBeta;
+}
+
 struct Material
 {
 	ColorDbl color = ColorDbl{ 1.0f, 1.0f, 1.0f };
@@ -18,30 +32,72 @@ struct Material
 	float roughness = 1.0f;
 	float refractiveIndex = 1.52f; // window glass
 
+	// Derived from roughness and refractiveIndex by Prepare
+	float orenNayarA = 1.0f;
+	float orenNayarB = 0.0f;
+	float fresnelR0 = 0.0f;		// Schlick reflectance at normal incidence, the same from both sides
+
+	Material() { Prepare(); }
+
+	// Must be called after changing roughness or refractiveIndex, Scene::PrepareForRayTracing does it for all objects
+	void Prepare()
+	{
+		float sigma2 = roughness * roughness;
+		orenNayarA = 1.0f - 0.5f * sigma2 / (sigma2 + 0.57f);
+		orenNayarB = 0.45f * sigma2 / (sigma2 + 0.09f);
+
+		fresnelR0 = (refractiveIndex - 1.0f) / (refractiveIndex + 1.0f);
+		fresnelR0 *= fresnelR0;
+	}
+
+	// Flips the normal of a refractive surface to point against the incident direction, returns n1 / n2 for the side hit
+	float OrientForRefraction(const vec3& incident, vec3& normal) const
+	{
+		if (glm::dot(normal, incident) >= 0.0f)
+		{
+			normal = -normal;
+			return refractiveIndex;		// leaving the material into air
+		}
+		return 1.0f / refractiveIndex;
+	}
+
+	/*
+		Schlick's approximation of the Fresnel equations with the oriented normal and eta from OrientForRefraction.
+		Returns false on total internal reflection, otherwise the transmitted direction and the reflectance R
+		(1 - R is refracted). BSDFBatch::Fresnel computes R and cos2t of many hits at once.
+	*/
+	bool Refract(const vec3& incident, const vec3& normal, float eta, vec3& transmitted, float& reflectance) const
+	{
+		float cosI = glm::dot(incident, normal);
+		float cos2t = 1.0f - eta * eta * (1.0f - cosI * cosI);
+		if (cos2t < 0.0f) return false;
+
+		transmitted = TransmittedDirection(incident, normal, eta, cos2t);
+		float c = 1.0f + cosI;
+		reflectance = fresnelR0 + (1.0f - fresnelR0) * c * c * c * c * c;
+		return true;
+	}
+
+	static vec3 TransmittedDirection(const vec3& incident, const vec3& normal, float eta, float cos2t)
+	{
+		return incident * eta - normal * (glm::dot(incident, normal) * eta + sqrtf(cos2t));
+	}
+
 	// The PI was removed for optimization.
 	// The 1/PI here was multiplied by PI from the hemisphere PDF in the scene tracer.
 	// BRDF/PDF = (albedo/PI) / (1/(2.0*PI)) = albedo*2.0
+	// BSDFBatch (bsdf.h) evaluates the same for many directions at once.
 	double BRDF(vec3& incident, vec3& reflection, vec3& normal)
 	{
 		switch (diffuse)
 		{
 		case DiffuseType::OrenNayar: 
 		{
-			float sigma2 = roughness * roughness;
-			float A = 1.0f - 0.5f * sigma2 / (sigma2 + 0.57f);
-			float B = 0.45f * sigma2 / (sigma2 + 0.09f);
-
 			float cos_in = glm::dot(incident, normal);
 			float cos_out = glm::dot(reflection, normal);
 			float cos_in_out = glm::dot(incident, reflection);
 
-			float theta_in = glm::acos(cos_in);
-			float theta_out = glm::acos(cos_out);
-
-			float alpha = glm::max(theta_out, theta_in);
-			float beta = glm::min(theta_out, theta_in);
-
-			double ON = (A + (B * glm::max(0.0f, cos_in_out)) * glm::sin(alpha) * glm::tan(beta));
+			double ON = OrenNayarFactor(orenNayarA, orenNayarB, cos_in, cos_out, cos_in_out);
 			return albedo * ON;
 		}
 		case DiffuseType::Lambertian: 
@@ -51,4 +107,4 @@ struct Material
 
 		return 1.0;
 	}
-};
+};
\ No newline at end of file
@@ -33,10 +33,15 @@
 
 #define INTERSECTION_ERROR_MARGIN FLT_EPSILON*20.0f
 
+// Shadow rays stop just short of the sampled light point so that the light itself does not occlude it
+#define SHADOW_RAY_DISTANCE_SCALE 0.9999f
+
 /*
 	Basic types
 */
 typedef glm::vec2 vec2;
 typedef glm::vec3 vec3;
+typedef glm::mat3 mat3;
+typedef glm::mat4 mat4;
 typedef glm::dvec3 ColorDbl;
 typedef std::int32_t int32;
\ No newline at end of file
@@ -0,0 +1,49 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+/*
+	Minimal fork-join helpers for build steps which run before rendering starts
+*/
+inline unsigned int ParallelThreadCount()
+{
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Runs function(threadIndex) once on each of threadCount threads, the calling thread takes index 0
+template<typename Function>
+void ParallelForThreads(unsigned int threadCount, Function&& function)
+{
+	std::vector<std::thread> workers;
+	workers.reserve(threadCount);
+	for (unsigned int i = 1; i < threadCount; ++i)
+	{
+		workers.emplace_back([&function, i]() { function(i); });
+	}
+
+	function(0);
+
+	for (std::thread& worker : workers)
+	{
+		worker.join();
+	}
+}
+
+// Splits [0, count) into one contiguous range per thread and runs function(begin, end) on each
+template<typename Function>
+void ParallelForRange(unsigned int count, Function&& function, unsigned int minRangeSize = 4096)
+{
+	unsigned int threadCount = std::min(ParallelThreadCount(), std::max(1u, count / minRangeSize));
+	unsigned int rangeSize = (count + threadCount - 1) / threadCount;
+
+	ParallelForThreads(threadCount, [&](unsigned int threadIndex) {
+		unsigned int begin = std::min(count, threadIndex * rangeSize);
+		unsigned int end = std::min(count, begin + rangeSize);
+		function(begin, end);
+	});
+}
@@ -10,8 +10,18 @@ struct Ray
 	vec3 origin;
 	vec3 direction;
 
+	// Precomputed for slab tests, a zero direction component gives an infinite inverse
+	vec3 invDirection;
+	unsigned int sign[3];		// 1 if the direction is negative along the axis
+
 	Ray() = default;
-	Ray(vec3 start, vec3 dir) : origin{ start }, direction{ dir } {}
+	Ray(vec3 start, vec3 dir) : origin{ start }, direction{ dir }
+	{
+		invDirection = vec3{ 1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z };
+		sign[0] = (invDirection.x < 0.0f) ? 1 : 0;
+		sign[1] = (invDirection.y < 0.0f) ? 1 : 0;
+		sign[2] = (invDirection.z < 0.0f) ? 1 : 0;
+	}
 };
 
 struct RayIntersectionInfo
@@ -0,0 +1,96 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "../core/math.h"
+#include "../core/ray.h"
+
+#include <algorithm>
+
+#define RAY_PACKET_MAX_SIZE 16
+
+/*
+	A group of coherent rays (typically camera rays through one screen tile) which are traversed together.
+
+	If all rays share the origin and the direction signs, the packet also stores the range of
+	inverse directions which lets a traversal reject a box for every ray with one interval test.
+*/
+struct RayPacket
+{
+	Ray rays[RAY_PACKET_MAX_SIZE];
+	unsigned int size = 0;
+
+	bool isCoherent = false;
+	vec3 invDirectionMin;
+	vec3 invDirectionMax;
+	vec3 meanDirection;
+
+	void Clear() { size = 0; }
+
+	void Add(const Ray& ray)
+	{
+		rays[size++] = ray;
+	}
+
+	// Must be called after the last ray is added
+	void Finalize()
+	{
+		isCoherent = (size > 0);
+		meanDirection = vec3{ 0.0f };
+		invDirectionMin = vec3{ FLOAT_INFINITY };
+		invDirectionMax = vec3{ -FLOAT_INFINITY };
+
+		for (unsigned int i = 0; i < size; ++i)
+		{
+			const Ray& ray = rays[i];
+			meanDirection += ray.direction;
+
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				float inv = ray.invDirection[axis];
+				invDirectionMin[axis] = std::min(invDirectionMin[axis], inv);
+				invDirectionMax[axis] = std::max(invDirectionMax[axis], inv);
+
+				if (ray.direction[axis] == 0.0f || std::signbit(ray.direction[axis]) != std::signbit(rays[0].direction[axis]))
+				{
+					isCoherent = false;
+				}
+			}
+
+			if (ray.origin != rays[0].origin)
+			{
+				isCoherent = false;
+			}
+		}
+	}
+
+	/*
+		Conservative interval test. Returns false only if no ray in the packet can hit the box closer than maxDistance.
+	*/
+	inline bool MayIntersect(const vec3& boxMin, const vec3& boxMax, float maxDistance) const
+	{
+		if (!isCoherent) return true;
+
+		const vec3& origin = rays[0].origin;
+		float entry = 0.0f;
+		float exit = maxDistance;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			// With a shared origin and sign, the near and far planes are the same for every ray
+			bool positive = invDirectionMin[axis] > 0.0f;
+			float nearPlane = (positive ? boxMin[axis] : boxMax[axis]) - origin[axis];
+			float farPlane = (positive ? boxMax[axis] : boxMin[axis]) - origin[axis];
+
+			float nearA = nearPlane * invDirectionMin[axis];
+			float nearB = nearPlane * invDirectionMax[axis];
+			float farA = farPlane * invDirectionMin[axis];
+			float farB = farPlane * invDirectionMax[axis];
+
+			entry = std::max(entry, std::min(nearA, nearB));
+			exit = std::min(exit, std::max(farA, farB));
+		}
+
+		return entry <= exit;
+	}
+};
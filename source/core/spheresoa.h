@@ -0,0 +1,122 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "../core/math.h"
+#include "../core/kernels.h"
+
+#include <vector>
+
+// Must be at least KERNEL_MAX_WIDTH
+#define SPHERE_SOA_PADDING 16
+
+// Nearest distance in front of the ray origin
+inline bool IntersectSphere(const vec3& center, float radius, const vec3& rayOrigin, const vec3& rayDirection, float& t)
+{
+	if (radius < FLT_EPSILON) return false;
+
+	float radiusSq = radius * radius;
+
+	/*
+	Code based on ScratchAPixel guide
+	*/
+	float t0, t1;
+
+	vec3 L = center - rayOrigin;
+
+	float tca = glm::dot(L, rayDirection);
+	if (tca < 0) return false;
+
+	float distanceSq = glm::dot(L, L) - tca * tca;
+	if (distanceSq > radiusSq) return false;
+
+	float thc = sqrt(radiusSq - distanceSq);
+	t0 = tca - thc;
+	t1 = tca + thc;
+
+	if (t0 > t1) std::swap(t0, t1);
+
+	if (t0 < 0)
+	{
+		t0 = t1; // if t0 is negative, let's use t1 instead
+		if (t0 < 0) return false; // both t0 and t1 are negative
+	}
+
+	t = t0;
+	return true;
+}
+
+/*
+	Spheres prepared for intersection, centers and radii as separate streams in the order given
+	at build time (the leaf order of the acceleration structure). The streams are padded with
+	spheres of radius 0 which never hit, so a wide kernel can read a full register from any slot.
+*/
+struct SphereSoA
+{
+	std::vector<float> center[3];
+	std::vector<float> radius;
+	std::vector<unsigned int> sphereIndex;	// slot to index in the source sphere list
+
+	unsigned int Size() const { return (unsigned int)sphereIndex.size(); }
+
+	void Build(const std::vector<vec3>& centers, const std::vector<float>& radii, const std::vector<unsigned int>& order)
+	{
+		unsigned int count = (unsigned int)order.size();
+		sphereIndex = order;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			center[axis].assign(count + SPHERE_SOA_PADDING, 0.0f);
+		}
+		radius.assign(count + SPHERE_SOA_PADDING, 0.0f);
+
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				center[axis][i] = centers[order[i]][axis];
+			}
+			radius[i] = radii[order[i]];
+		}
+	}
+
+	void Clear()
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			center[axis].clear();
+		}
+		radius.clear();
+		sphereIndex.clear();
+	}
+
+	size_t MemoryUsage() const
+	{
+		return (center[0].capacity() + center[1].capacity() + center[2].capacity() + radius.capacity()) * sizeof(float) + sphereIndex.capacity() * sizeof(unsigned int);
+	}
+
+	inline bool Intersects(unsigned int slot, const vec3& rayOrigin, const vec3& rayDirection, float& t) const
+	{
+		return IntersectSphere(vec3{ center[0][slot], center[1][slot], center[2][slot] }, radius[slot], rayOrigin, rayDirection, t);
+	}
+
+	inline SphereStreams Streams() const
+	{
+		return SphereStreams{ { center[0].data(), center[1].data(), center[2].data() }, radius.data() };
+	}
+
+	// Closest hit among the slots [first, first + count), see TriangleSoA::IntersectRange
+	inline bool IntersectRange(unsigned int first, unsigned int count, const vec3& rayOrigin, const vec3& rayDirection, float& nearestDistance, unsigned int& hitSlot) const;
+
+	inline bool OccludedRange(unsigned int first, unsigned int count, const vec3& rayOrigin, const vec3& rayDirection, float maxDistance) const;
+};
+
+inline bool SphereSoA::IntersectRange(unsigned int first, unsigned int count, const vec3& rayOrigin, const vec3& rayDirection, float& nearestDistance, unsigned int& hitSlot) const
+{
+	return ActiveKernels().intersectSpheres(Streams(), first, count, &rayOrigin.x, &rayDirection.x, nearestDistance, hitSlot);
+}
+
+inline bool SphereSoA::OccludedRange(unsigned int first, unsigned int count, const vec3& rayOrigin, const vec3& rayDirection, float maxDistance) const
+{
+	return ActiveKernels().occludedSpheres(Streams(), first, count, &rayOrigin.x, &rayDirection.x, maxDistance);
+}
@@ -4,6 +4,7 @@
 
 #pragma once
 #include "../core/math.h"
+#include "../core/aabb.h"
 
 struct Triangle
 {
@@ -14,7 +15,7 @@ struct Triangle
 	vec3 normal;
 
 	// The points must be defined in clockwise order in respect to their normal
-	Triangle(vec3& v0, vec3& v1, vec3& v2)
+	Triangle(const vec3& v0, const vec3& v1, const vec3& v2)
 		: vertex0{ v0 }, vertex1{ v1 }, vertex2{ v2 }
 	{
 		vec3 u = v1 - v0;
@@ -22,7 +23,46 @@ struct Triangle
 		normal = glm::normalize(glm::cross(u, v));
 	}
 
-	bool Intersects(vec3 rayOrigin, vec3 rayDirection, float& t)
+	AABB Bounds() const
+	{
+		AABB bounds = AABB::Empty();
+		bounds.Encapsulate(vertex0);
+		bounds.Encapsulate(vertex1);
+		bounds.Encapsulate(vertex2);
+		return bounds;
+	}
+
+	// Bounds of the parts on each side of the plane at position along axis, limited to bounds (used by the spatial split BVH)
+	void SplitBounds(int axis, float position, const AABB& bounds, AABB& left, AABB& right) const
+	{
+		left = AABB::Empty();
+		right = AABB::Empty();
+
+		const vec3* vertices[3] = { &vertex0, &vertex1, &vertex2 };
+		for (int i = 0; i < 3; ++i)
+		{
+			const vec3& a = *vertices[i];
+			const vec3& b = *vertices[(i + 1) % 3];
+
+			if (a[axis] <= position) left.Encapsulate(a);
+			if (a[axis] >= position) right.Encapsulate(a);
+
+			// Edge crosses the plane
+			if ((a[axis] < position && b[axis] > position) || (a[axis] > position && b[axis] < position))
+			{
+				float t = (position - a[axis]) / (b[axis] - a[axis]);
+				vec3 point = a + (b - a) * t;
+				point[axis] = position;
+				left.Encapsulate(point);
+				right.Encapsulate(point);
+			}
+		}
+
+		left = AABB::Intersection(left, bounds);
+		right = AABB::Intersection(right, bounds);
+	}
+
+	bool Intersects(vec3 rayOrigin, vec3 rayDirection, float& t) const
 	{
 		// Code referenced from https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
 		/*
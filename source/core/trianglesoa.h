@@ -0,0 +1,116 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "../core/math.h"
+#include "../core/triangle.h"
+#include "../core/kernels.h"
+
+#include <vector>
+
+// Must be at least KERNEL_MAX_WIDTH
+#define TRIANGLE_SOA_PADDING 16
+
+/*
+	Triangles prepared for intersection, vertex0 and both edges are stored as separate
+	coordinate streams (structure of arrays) in the order given at build time.
+
+	The order should match the leaves of the acceleration structure so that a leaf reads a
+	contiguous range of each stream. The streams are padded with degenerate triangles which
+	never hit, so a wide kernel can always read a full register from any slot.
+*/
+struct TriangleSoA
+{
+	std::vector<float> vertex0[3];
+	std::vector<float> edge1[3];
+	std::vector<float> edge2[3];
+	std::vector<unsigned int> triangleIndex;	// slot to index in the source triangle list
+
+	unsigned int Size() const { return (unsigned int)triangleIndex.size(); }
+
+	void Build(const std::vector<Triangle>& triangles, const std::vector<unsigned int>& order)
+	{
+		unsigned int count = (unsigned int)order.size();
+		triangleIndex = order;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			vertex0[axis].assign(count + TRIANGLE_SOA_PADDING, 0.0f);
+			edge1[axis].assign(count + TRIANGLE_SOA_PADDING, 0.0f);
+			edge2[axis].assign(count + TRIANGLE_SOA_PADDING, 0.0f);
+		}
+
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			const Triangle& t = triangles[order[i]];
+			vec3 e1 = t.vertex1 - t.vertex0;
+			vec3 e2 = t.vertex2 - t.vertex0;
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				vertex0[axis][i] = t.vertex0[axis];
+				edge1[axis][i] = e1[axis];
+				edge2[axis][i] = e2[axis];
+			}
+		}
+	}
+
+	void Clear()
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			vertex0[axis].clear();
+			edge1[axis].clear();
+			edge2[axis].clear();
+		}
+		triangleIndex.clear();
+	}
+
+	// Same test as Triangle::Intersects without recomputing the edges
+	inline bool Intersects(unsigned int slot, const vec3& rayOrigin, const vec3& rayDirection, float& t) const
+	{
+		vec3 e1{ edge1[0][slot], edge1[1][slot], edge1[2][slot] };
+		vec3 e2{ edge2[0][slot], edge2[1][slot], edge2[2][slot] };
+		vec3 h = glm::cross(rayDirection, e2);
+		float a = glm::dot(e1, h);
+		if (abs(a) < FLT_EPSILON) return false;
+
+		float f = 1.0f / a;
+		vec3 s = rayOrigin - vec3{ vertex0[0][slot], vertex0[1][slot], vertex0[2][slot] };
+		float u = f * glm::dot(s, h);
+		if (u < 0.0f || u > 1.0f) return false;
+
+		vec3 q = glm::cross(s, e1);
+		float v = f * glm::dot(rayDirection, q);
+		if (v < 0.0f || u + v > 1.0f) return false;
+
+		t = f * glm::dot(e2, q);
+		return (t > FLT_EPSILON);
+	}
+
+	inline TriangleStreams Streams() const
+	{
+		return TriangleStreams{
+			{ vertex0[0].data(), vertex0[1].data(), vertex0[2].data() },
+			{ edge1[0].data(), edge1[1].data(), edge1[2].data() },
+			{ edge2[0].data(), edge2[1].data(), edge2[2].data() }
+		};
+	}
+
+	/*
+		Closest hit among the slots [first, first + count). Only hits closer than nearestDistance are accepted,
+		on a hit nearestDistance and hitSlot are updated. Tested by the active kernels (kernels.h).
+	*/
+	inline bool IntersectRange(unsigned int first, unsigned int count, const vec3& rayOrigin, const vec3& rayDirection, float& nearestDistance, unsigned int& hitSlot) const;
+
+	inline bool OccludedRange(unsigned int first, unsigned int count, const vec3& rayOrigin, const vec3& rayDirection, float maxDistance) const;
+};
+
+inline bool TriangleSoA::IntersectRange(unsigned int first, unsigned int count, const vec3& rayOrigin, const vec3& rayDirection, float& nearestDistance, unsigned int& hitSlot) const
+{
+	return ActiveKernels().intersectTriangles(Streams(), first, count, &rayOrigin.x, &rayDirection.x, nearestDistance, hitSlot);
+}
+
+inline bool TriangleSoA::OccludedRange(unsigned int first, unsigned int count, const vec3& rayOrigin, const vec3& rayDirection, float maxDistance) const
+{
+	return ActiveKernels().occludedTriangles(Streams(), first, count, &rayOrigin.x, &rayDirection.x, maxDistance);
+}
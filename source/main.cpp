@@ -22,7 +22,10 @@
 #include "opengl/screenshot.h"
 #include "helpers/clock.h"
 #include "scene.h"
+#include "benchmark.h"
+#include "wavefront.h"
 #include "core/randomization.h"
+#include "core/kernels.h"
 
 UniformRandomGenerator uniformGenerator;
 
@@ -39,13 +42,34 @@ static const float CAMERA_FOV = 90.0f;
 static const bool RAY_TRACE_UNLIT = false;
 static const bool RAY_TRACE_RANDOM = true;
 static const unsigned int RAY_TRACE_DEPTH = 100;
+static const bool RAY_TRACE_ITERATIVE = true;			// loop-based path integrator (Scene::TracePath) instead of the recursive TraceRay
 static const unsigned int RAY_COUNT_PER_PIXEL = RAY_TRACE_UNLIT ? 1 : 1;
-static const float LIGHT_STRENGTH = 10.0f;
+static const bool RAY_TRACE_PACKETS = true;				// trace camera rays for a whole screen tile together
+static const bool RAY_TRACE_WAVEFRONT = false;			// trace batches of paths stage by stage (WavefrontIntegrator), takes precedence over packets
+static const unsigned int WAVEFRONT_PATH_COUNT = WAVEFRONT_DEFAULT_PATH_COUNT;
+static const unsigned int RAY_PACKET_TILE_WIDTH = 4;
+static const unsigned int RAY_PACKET_TILE_HEIGHT = 4;
+static_assert(RAY_PACKET_TILE_WIDTH * RAY_PACKET_TILE_HEIGHT <= RAY_PACKET_MAX_SIZE, "Tile does not fit in a ray packet");
+static const LightSampling LIGHT_SAMPLING = LightSampling::MISBalance;	// shadow rays and bounces combined with multiple importance sampling (Scene::lightSampling)
+static const float LIGHT_STRENGTH = 10.0f;	// emitted radiance of the example light, the same for every LIGHT_SAMPLING mode
+static const bool FAST_BVH_BUILD = false;	// parallel linear BVH build, faster startup but slower rendering
+static const bool SPATIAL_SPLIT_BVH = false;	// spatial split BVH build, slower startup but faster rendering of large overlapping triangles
+static const bool COMPRESSED_BVH = false;	// quantized BVH nodes, fits larger meshes in memory at a small traversal cost
+static const bool STACKLESS_BVH = false;	// BVH traversal without a per-ray stack, for threads with little stack space
+static const bool PROGRESSIVE_BVH_BUILD = false;	// render against fast mesh BVHs while the ones above are built in the background
+
+static const unsigned int RAY_GROUP_SIZE = 8;			// rays interleaved by stream traversals (Scene::IntersectRays)
+static const bool RUN_BENCHMARK = false;		// compare the acceleration structures on the scene before rendering
 
 static const bool APPLY_TONE_MAPPING = true;
 static const bool USE_SIMPLE_TONE_MAPPER = true;
 static const double TONE_MAP_GAMMA = 2.2;
-static const double TONE_MAP_EXPOSURE = 1.0;
+/*
+	Scales the radiance before either tone mapper. The MIS modes estimate the radiance of the scene, the Explicit
+	estimator leaves out the solid angle of the light and counts light hits twice, which makes the Cornell box
+	about 7 times brighter at the same emission. Use 1.0 with Explicit.
+*/
+static const double TONE_MAP_EXPOSURE = 7.0;
 
 static const bool USE_MULTITHREADING = true;
 struct ThreadInfo
@@ -60,6 +84,7 @@ const unsigned int NUM_SUPPORTED_THREADS = std::thread::hardware_concurrency();
 std::vector<std::thread> threads(NUM_SUPPORTED_THREADS);
 std::vector<ThreadInfo> threadInfos(NUM_SUPPORTED_THREADS);
 std::vector<UniformRandomGenerator> uniformGenerators(NUM_SUPPORTED_THREADS);
+std::vector<std::unique_ptr<WavefrontIntegrator>> wavefrontIntegrators(NUM_SUPPORTED_THREADS);
 
 /*
 	Main ray tracing function
@@ -97,6 +122,57 @@ inline bool GetNextPixelToRender(unsigned int& nextIndex, unsigned int& x, unsig
 
 }
 
+std::atomic_uint threaded_currentTileIndex = 0;
+inline bool GetNextTileToRender(unsigned int& tileX, unsigned int& tileY)
+{
+	const unsigned int tileCountX = (SCREEN_WIDTH + RAY_PACKET_TILE_WIDTH - 1) / RAY_PACKET_TILE_WIDTH;
+	const unsigned int tileCountY = (SCREEN_HEIGHT + RAY_PACKET_TILE_HEIGHT - 1) / RAY_PACKET_TILE_HEIGHT;
+
+	if constexpr (RAY_TRACE_RANDOM)
+	{
+		// Same reasoning as for random pixels, overlapping writes are extremely unlikely
+		tileX = std::min((unsigned int)(uniformGenerator.RandomFloat(0.0f, float(tileCountX))), tileCountX - 1);
+		tileY = std::min((unsigned int)(uniformGenerator.RandomFloat(0.0f, float(tileCountY))), tileCountY - 1);
+		return true;
+	}
+	else
+	{
+		unsigned int tileIndex = threaded_currentTileIndex++;
+		tileX = tileIndex % tileCountX;
+		tileY = tileIndex / tileCountX;
+		return (tileY < tileCountY);
+	}
+}
+
+void WriteOutputPixel(Camera& camera, GLFullscreenImage& glImage, unsigned int x, unsigned int y, unsigned int pixelIndex)
+{
+	// Normalize colors by the number of accumulated rays
+	ColorDbl outputColor = camera.pixels.GetPixelColor(x, y) / double(camera.pixels.GetRayCount(pixelIndex));
+
+	if constexpr (!APPLY_TONE_MAPPING)
+	{
+		glImage.buffer.SetPixel(x, y, outputColor.r, outputColor.g, outputColor.b, 1.0);
+	}
+	else
+	{
+		if constexpr (USE_SIMPLE_TONE_MAPPER)
+		{
+			// Reinhard Tone Mapping
+			outputColor *= TONE_MAP_EXPOSURE;
+			outputColor = outputColor / (outputColor + ColorDbl(1.0));
+			outputColor = pow(outputColor, ColorDbl(1.0 / TONE_MAP_GAMMA));
+		}
+		else
+		{
+			// Exposure tone mapping
+			outputColor = ColorDbl(1.0) - glm::exp(-outputColor * TONE_MAP_EXPOSURE);
+			outputColor = pow(outputColor, ColorDbl(1.0 / TONE_MAP_GAMMA));
+		}
+
+		glImage.buffer.SetPixel(x, y, outputColor.r, outputColor.g, outputColor.b, 1.0);
+	}
+}
+
 bool RayTraceNextPixel(unsigned int threadId)
 {
 	ThreadInfo& thread = threadInfos[threadId];
@@ -133,50 +209,159 @@ bool RayTraceNextPixel(unsigned int threadId)
 		}
 
 		if constexpr (RAY_TRACE_UNLIT) rayColor = scene.TraceUnlit(cameraRay);
+		else if constexpr (RAY_TRACE_ITERATIVE) rayColor = scene.TracePath(cameraRay, uniformGenerators[thread.id], RAY_TRACE_DEPTH);
 		else						   rayColor = scene.TraceRay(cameraRay, uniformGenerators[thread.id], RAY_TRACE_DEPTH);
 
 		camera.pixels.Accumulate(pixelIndex, rayColor);
 	}
 
-	// When done, normalize colors
-	ColorDbl outputColor = camera.pixels.GetPixelColor(x, y) / double(camera.pixels.GetRayCount(pixelIndex));
+	WriteOutputPixel(camera, glImage, x, y, pixelIndex);
+	return true;
+}
 
-	if constexpr (!APPLY_TONE_MAPPING)
+bool RayTraceNextTile(unsigned int threadId)
+{
+	ThreadInfo& thread = threadInfos[threadId];
+	unsigned int tileX = 0;
+	unsigned int tileY = 0;
+
+	if (!GetNextTileToRender(tileX, tileY))
 	{
-		glImage.buffer.SetPixel(x, y, outputColor.r, outputColor.g, outputColor.b, 1.0);
+		return false;
 	}
-	else
+
+	Camera& camera = *thread.camera;
+	Scene& scene = *thread.scene;
+	GLFullscreenImage& glImage = *thread.glImage;
+
+	// Pixels covered by the tile, clipped at the image border
+	unsigned int pixelX[RAY_PACKET_MAX_SIZE];
+	unsigned int pixelY[RAY_PACKET_MAX_SIZE];
+	unsigned int pixelCount = 0;
+	for (unsigned int ty = 0; ty < RAY_PACKET_TILE_HEIGHT; ++ty)
 	{
-		if constexpr (USE_SIMPLE_TONE_MAPPER)
+		for (unsigned int tx = 0; tx < RAY_PACKET_TILE_WIDTH; ++tx)
 		{
-			// Reinhard Tone Mapping
-			outputColor = outputColor / (outputColor + ColorDbl(1.0));
-			outputColor = pow(outputColor, ColorDbl(1.0 / TONE_MAP_GAMMA));
+			unsigned int x = tileX * RAY_PACKET_TILE_WIDTH + tx;
+			unsigned int y = tileY * RAY_PACKET_TILE_HEIGHT + ty;
+			if (x < SCREEN_WIDTH && y < SCREEN_HEIGHT)
+			{
+				pixelX[pixelCount] = x;
+				pixelY[pixelCount++] = y;
+			}
 		}
-		else
+	}
+
+	// Run trace for all rays, the first hit of every ray in the tile is found by one packet traversal
+	vec2 pixelPositions[RAY_PACKET_MAX_SIZE];
+	RayPacket packet;
+	RayIntersectionInfo hitInfos[RAY_PACKET_MAX_SIZE];
+	ColorDbl rayColor;
+	int rayCount = RAY_COUNT_PER_PIXEL;
+	while (--rayCount >= 0)
+	{
+		for (unsigned int i = 0; i < pixelCount; ++i)
 		{
-			// Exposure tone mapping
-			outputColor = ColorDbl(1.0) - glm::exp(-outputColor * TONE_MAP_EXPOSURE);
-			outputColor = pow(outputColor, ColorDbl(1.0 / TONE_MAP_GAMMA));
+			if constexpr (RAY_TRACE_UNLIT) pixelPositions[i] = vec2{ float(pixelX[i]) + 0.5f, float(pixelY[i]) + 0.5f };
+			else						   pixelPositions[i] = vec2{ float(pixelX[i]) + uniformGenerator.RandomFloat(), float(pixelY[i]) + uniformGenerator.RandomFloat() };
 		}
 
-		glImage.buffer.SetPixel(x, y, outputColor.r, outputColor.g, outputColor.b, 1.0);
+		camera.GetPixelRayPacket(pixelPositions, pixelCount, packet);
+		scene.IntersectPacket(packet, hitInfos);
+
+		for (unsigned int i = 0; i < pixelCount; ++i)
+		{
+			if constexpr (RAY_TRACE_UNLIT) rayColor = scene.TraceUnlit(packet.rays[i], hitInfos[i]);
+			else if constexpr (RAY_TRACE_ITERATIVE) rayColor = scene.TracePath(packet.rays[i], hitInfos[i], uniformGenerators[thread.id], RAY_TRACE_DEPTH);
+			else						   rayColor = scene.TraceRay(packet.rays[i], hitInfos[i], uniformGenerators[thread.id], RAY_TRACE_DEPTH);
+
+			camera.pixels.Accumulate(camera.pixels.PixelArrayIndex(pixelX[i], pixelY[i]), rayColor);
+		}
+	}
+
+	for (unsigned int i = 0; i < pixelCount; ++i)
+	{
+		WriteOutputPixel(camera, glImage, pixelX[i], pixelY[i], camera.pixels.PixelArrayIndex(pixelX[i], pixelY[i]));
+	}
+
+	return true;
+}
+
+bool RayTraceNextWavefront(unsigned int threadId)
+{
+	ThreadInfo& thread = threadInfos[threadId];
+	Camera& camera = *thread.camera;
+	Scene& scene = *thread.scene;
+	GLFullscreenImage& glImage = *thread.glImage;
+
+	if (!wavefrontIntegrators[threadId])
+	{
+		wavefrontIntegrators[threadId] = std::make_unique<WavefrontIntegrator>(scene);
+	}
+
+	// Pixels of the batch, each one gets RAY_COUNT_PER_PIXEL paths
+	const unsigned int maxPixelCount = std::max(1u, WAVEFRONT_PATH_COUNT / RAY_COUNT_PER_PIXEL);
+	std::vector<unsigned int> pixelX;
+	std::vector<unsigned int> pixelY;
+	std::vector<unsigned int> pixelIndices;
+	unsigned int pixelIndex = 0;
+	unsigned int x = 0;
+	unsigned int y = 0;
+	while (pixelIndices.size() < maxPixelCount && GetNextPixelToRender(pixelIndex, x, y, thread.id, camera.pixels))
+	{
+		pixelX.push_back(x);
+		pixelY.push_back(y);
+		pixelIndices.push_back(pixelIndex);
+	}
+
+	if (pixelIndices.empty())
+	{
+		return false;
+	}
+
+	std::vector<Ray> cameraRays;
+	cameraRays.reserve(pixelIndices.size() * RAY_COUNT_PER_PIXEL);
+	for (unsigned int i = 0; i < pixelIndices.size(); ++i)
+	{
+		for (unsigned int r = 0; r < RAY_COUNT_PER_PIXEL; ++r)
+		{
+			cameraRays.push_back(camera.GetPixelRay(float(pixelX[i]) + uniformGenerator.RandomFloat(), float(pixelY[i]) + uniformGenerator.RandomFloat()));
+		}
+	}
+
+	std::vector<ColorDbl> rayColors(cameraRays.size());
+	wavefrontIntegrators[threadId]->Trace(cameraRays.data(), (unsigned int)cameraRays.size(), rayColors.data(), uniformGenerators[thread.id], RAY_TRACE_DEPTH);
+
+	for (unsigned int i = 0; i < pixelIndices.size(); ++i)
+	{
+		for (unsigned int r = 0; r < RAY_COUNT_PER_PIXEL; ++r)
+		{
+			camera.pixels.Accumulate(pixelIndices[i], rayColors[i * RAY_COUNT_PER_PIXEL + r]);
+		}
+		WriteOutputPixel(camera, glImage, pixelX[i], pixelY[i], pixelIndices[i]);
 	}
 
 	return true;
 }
 
+inline bool RayTraceNext(unsigned int threadId)
+{
+	if constexpr (RAY_TRACE_WAVEFRONT && !RAY_TRACE_UNLIT) return RayTraceNextWavefront(threadId);
+	else if constexpr (RAY_TRACE_PACKETS) return RayTraceNextTile(threadId);
+	else							 return RayTraceNextPixel(threadId);
+}
+
 bool TracePixels(unsigned int threadId = 0)
 {
 	if (threadId == 0)
 	{
 		// Don't loop the main thread
-		return RayTraceNextPixel(threadId);
+		return RayTraceNext(threadId);
 	}
 	else
 	{
 		// Extra threads continue to run independently
-		while (RayTraceNextPixel(threadId) && !quit) {}
+		while (RayTraceNext(threadId) && !quit) {}
 		threadInfos[threadId].isDone = true;
 
 		return true;
@@ -217,8 +402,38 @@ std::string TimeString(float time)
 }
 std::string FpsString(float deltaTime) { return std::to_string(int(round(1.0f / deltaTime))); }
 
-int main()
+/*
+	--isa scalar|sse4.2|avx2|avx512 forces the intersection kernels (for A/B benchmarks),
+	by default the best instruction set supported by the CPU is used.
+*/
+void SelectKernelsFromArguments(int argc, char* argv[])
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string argument = argv[i];
+		std::string name;
+		if (argument == "--isa" && i + 1 < argc) name = argv[++i];
+		else if (argument.compare(0, 6, "--isa=") == 0) name = argument.substr(6);
+		else continue;
+
+		InstructionSet instructionSet;
+		if (!ParseInstructionSet(name.c_str(), instructionSet))
+		{
+			std::cout << "Unknown instruction set '" + name + "', expected scalar, sse4.2, avx2 or avx512\r\n";
+		}
+		else if (!SelectKernels(instructionSet))
+		{
+			std::cout << "Instruction set " + name + " is not supported on this machine\r\n";
+		}
+	}
+
+	std::cout << "Intersection kernels: " + std::string(InstructionSetName(ActiveKernels().instructionSet)) + "\r\n";
+}
+
+int main(int argc, char* argv[])
 {
+	SelectKernelsFromArguments(argc, argv);
+
 	OpenGLWindow window("OpenGL", SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_FULLSCREEN, SCREEN_VSYNC);
 	window.SetClearColor(0.0, 0.0, 0.0, 1.0f);
 	window.Clear();
@@ -239,7 +454,20 @@ int main()
 	scene.MoveCameraToRecommendedPosition(camera);
 	scene.AddExampleObjects();
 	scene.AddExampleLight(ColorDbl{ LIGHT_STRENGTH });
+	scene.bvhSettings.builder = FAST_BVH_BUILD ? BVHBuilder::Linear : (SPATIAL_SPLIT_BVH ? BVHBuilder::Spatial : BVHBuilder::BinnedSAH);
+	scene.bvhSettings.compressed = COMPRESSED_BVH;
+	scene.bvhSettings.stackless = STACKLESS_BVH;
+	scene.rayGroupSize = RAY_GROUP_SIZE;
+	scene.progressiveBuild = PROGRESSIVE_BVH_BUILD;
+	scene.lightSampling = LIGHT_SAMPLING;
 	scene.PrepareForRayTracing();
+	if (RUN_BENCHMARK)
+	{
+		scene.PrintBVHMemoryUsage();
+		RunIntersectionKernelCheck();
+		RunAccelerationStructureBenchmark(scene, camera);
+		RunPathTracingBenchmark(scene, camera, 20000, RAY_TRACE_DEPTH);
+	}
 	//scene.octree.PrintDebug();
 
 
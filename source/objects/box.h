@@ -11,9 +11,11 @@ public:
 	Box() = default;
 	~Box() = default;
 
+	// Can be called again to move the box, the bottom-level BVH is then refitted
 	void SetGeometry(vec3 basePosition, vec3 upVector, vec3 sideVector, float width, float depth, float height)
 	{
 		position = basePosition;
+		triangles.clear();
 
 		upVector = glm::normalize(upVector);
 		sideVector = glm::normalize(sideVector);
@@ -0,0 +1,147 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "mesh.h"
+
+/*
+	Places shared mesh geometry in the scene through a transform, many instances can reference the
+	same mesh and its bottom-level BVH. Rays are moved into object space instead of the triangles into
+	world space. The object space direction is not normalized so hit distances stay in world units.
+*/
+class MeshInstance : public Object
+{
+protected:
+	TriangleMesh* mesh = nullptr;		// not owned, see Scene::CreateSharedMesh
+	mat4 objectToWorld{ 1.0f };
+	mat4 worldToObject{ 1.0f };
+	mat3 normalToWorld{ 1.0f };
+
+	inline vec3 OriginToObject(const vec3& origin) const { return vec3{ worldToObject * glm::vec4{ origin, 1.0f } }; }
+	inline vec3 DirectionToObject(const vec3& direction) const { return mat3{ worldToObject } * direction; }
+
+	std::vector<Ray> RaysToObject(const Ray* rays, unsigned int rayCount) const
+	{
+		std::vector<Ray> localRays;
+		localRays.reserve(rayCount);
+		for (unsigned int i = 0; i < rayCount; ++i)
+		{
+			localRays.push_back(Ray{ OriginToObject(rays[i].origin), DirectionToObject(rays[i].direction) });
+		}
+		return localRays;
+	}
+
+public:
+	MeshInstance() = default;
+	~MeshInstance() = default;
+
+	void SetMesh(TriangleMesh* sharedMesh) { mesh = sharedMesh; }
+	TriangleMesh* Mesh() const { return mesh; }
+
+	void SetTransform(const mat4& transform)
+	{
+		objectToWorld = transform;
+		worldToObject = glm::inverse(transform);
+		normalToWorld = glm::transpose(mat3{ worldToObject });
+		position = vec3{ transform[3] };
+	}
+
+	const mat4& Transform() const { return objectToWorld; }
+
+	virtual bool Intersects(vec3 rayOrigin, vec3 rayDirection, RayIntersectionInfo& hitInfo)
+	{
+		if (!mesh || !mesh->Intersects(OriginToObject(rayOrigin), DirectionToObject(rayDirection), hitInfo)) return false;
+
+		hitInfo.object = this;
+		return true;
+	}
+
+	virtual bool Occludes(const Ray& ray, float maxDistance) override
+	{
+		return mesh && mesh->Occludes(Ray{ OriginToObject(ray.origin), DirectionToObject(ray.direction) }, maxDistance);
+	}
+
+	virtual void IntersectPacket(RayPacket& packet, unsigned int firstRay, float* nearestDistances, RayIntersectionInfo* hitInfos) override
+	{
+		if (!mesh) return;
+
+		// Transforming keeps a shared origin shared, so coherent packets stay coherent
+		RayPacket localPacket;
+		for (unsigned int i = 0; i < packet.size; ++i)
+		{
+			localPacket.Add(Ray{ OriginToObject(packet.rays[i].origin), DirectionToObject(packet.rays[i].direction) });
+		}
+		localPacket.Finalize();
+
+		mesh->IntersectPacket(localPacket, firstRay, nearestDistances, hitInfos);
+
+		for (unsigned int i = firstRay; i < packet.size; ++i)
+		{
+			if (hitInfos[i].object == mesh) hitInfos[i].object = this;
+		}
+	}
+
+	// The whole stream is moved into object space, so the mesh interleaves the traversals
+	virtual void IntersectRays(const Ray* rays, unsigned int rayCount, RayIntersectionInfo* hitInfos, unsigned int groupSize) override
+	{
+		if (!mesh)
+		{
+			for (unsigned int i = 0; i < rayCount; ++i)
+			{
+				hitInfos[i].Reset();
+			}
+			return;
+		}
+
+		std::vector<Ray> localRays = RaysToObject(rays, rayCount);
+		mesh->IntersectRays(localRays.data(), rayCount, hitInfos, groupSize);
+		for (unsigned int i = 0; i < rayCount; ++i)
+		{
+			if (hitInfos[i].object == mesh) hitInfos[i].object = this;
+		}
+	}
+
+	virtual void OccludedRays(const Ray* rays, float* maxDistances, unsigned int rayCount, unsigned int groupSize) override
+	{
+		if (!mesh) return;
+
+		std::vector<Ray> localRays = RaysToObject(rays, rayCount);
+		mesh->OccludedRays(localRays.data(), maxDistances, rayCount, groupSize);
+	}
+
+	virtual vec3 GetSurfaceNormal(vec3 location, unsigned int index)
+	{
+		return glm::normalize(normalToWorld * mesh->triangles[index].normal);
+	}
+
+	virtual void UpdateAABB()
+	{
+		if (!mesh || mesh->triangles.empty()) return;
+
+		mesh->UpdateAABB();
+		aabb = AABB::Empty();
+		for (int corner = 0; corner < 8; ++corner)
+		{
+			vec3 point{
+				(corner & 1) ? mesh->aabb.max.x : mesh->aabb.min.x,
+				(corner & 2) ? mesh->aabb.max.y : mesh->aabb.min.y,
+				(corner & 4) ? mesh->aabb.max.z : mesh->aabb.min.z
+			};
+			aabb.Encapsulate(vec3{ objectToWorld * glm::vec4{ point, 1.0f } });
+		}
+	}
+
+	// The shared mesh only rebuilds once, the other instances find it up to date
+	virtual void BuildAccelerationStructure(const BVHSettings& settings)
+	{
+		if (mesh) mesh->BuildAccelerationStructure(settings);
+	}
+
+	virtual void RefineAccelerationStructure(const BVHSettings& settings)
+	{
+		if (mesh) mesh->RefineAccelerationStructure(settings);
+	}
+
+	virtual const BVH* AccelerationStructure() const { return mesh ? mesh->AccelerationStructure() : nullptr; }
+};
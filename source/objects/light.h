@@ -44,13 +44,16 @@ public:
 
 	virtual bool IsLight() override { return true; };
 
+	// Uniform over the whole quad (xVector and yVector are half its sides), which PDF relies on
 	virtual vec3 GetRandomPointOnSurface(UniformRandomGenerator& gen) override
 	{
 		float u = gen.RandomFloat();
 		float v = gen.RandomFloat();
-		vec3 corner = position - xVector / 2.0f - yVector / 2.0f;
-		return corner + xVector * u + yVector * v;
+		vec3 corner = position - xVector - yVector;
+		return corner + xVector * (2.0f * u) + yVector * (2.0f * v);
 	}
 
 	virtual double PDF() override { return 1.0 / area; }
+
+	virtual vec3 GetEmissionNormal(vec3 location) override { return normal; }
 };
\ No newline at end of file
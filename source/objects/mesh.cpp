@@ -6,30 +6,29 @@
 #include "mesh.h"
 #include "../helpers/OBJ_Loader.h"
 
-bool TriangleMesh::Intersects(vec3 rayOrigin, vec3 rayDirection, RayIntersectionInfo& hitInfo)
+TriangleMesh::TriangleMesh()
 {
-	float hitDistance = FLOAT_INFINITY;
-	if (!aabb.IntersectsRay(rayOrigin, rayDirection, hitDistance))
-	{
-		hitInfo.Reset();
-		return false;
-	}
+	// Spatial splits clip the triangles themselves instead of their bounds
+	accelerationData.splitPrimitive = [this](unsigned int index, int axis, float position, const AABB& bounds, AABB& left, AABB& right) {
+		triangles[index].SplitBounds(axis, position, bounds, left, right);
+	};
+}
 
-	int elementIndex = 0;
+bool TriangleMesh::Intersects(vec3 rayOrigin, vec3 rayDirection, RayIntersectionInfo& hitInfo)
+{
+	// The root of the bottom-level hierarchy doubles as the bounding box test
+	const auto& data = accelerationData.Active();
+	Ray ray{ rayOrigin, rayDirection };
+	unsigned int hitSlot = 0;
 	float nearestDistance = FLOAT_INFINITY;
-	for (unsigned int index = 0; index < triangles.size(); ++index)
-	{
-		if (triangles[index].Intersects(rayOrigin, rayDirection, hitDistance) && hitDistance < nearestDistance)
-		{
-			nearestDistance = hitDistance;
-			elementIndex = index;
-		}
-	}
+	data.bvh.IntersectLeaves(ray, nearestDistance, [&](unsigned int first, unsigned int count, float& nearest) {
+		return data.intersectionData.IntersectRange(first, count, rayOrigin, rayDirection, nearest, hitSlot);
+	});
 
 	if (nearestDistance < FLOAT_INFINITY)
 	{
 		hitInfo.object = this;
-		hitInfo.elementIndex = elementIndex;
+		hitInfo.elementIndex = data.intersectionData.triangleIndex[hitSlot];
 		hitInfo.hitDistance = nearestDistance;
 	}
 	else
@@ -40,6 +39,62 @@ bool TriangleMesh::Intersects(vec3 rayOrigin, vec3 rayDirection, RayIntersection
 	return (hitInfo.object != nullptr);
 }
 
+bool TriangleMesh::Occludes(const Ray& ray, float maxDistance)
+{
+	const auto& data = accelerationData.Active();
+	return data.bvh.OccludedLeaves(ray, maxDistance, [&](unsigned int first, unsigned int count, float maxHitDistance) {
+		return data.intersectionData.OccludedRange(first, count, ray.origin, ray.direction, maxHitDistance);
+	});
+}
+
+void TriangleMesh::IntersectPacket(RayPacket& packet, unsigned int firstRay, float* nearestDistances, RayIntersectionInfo* hitInfos)
+{
+	const auto& data = accelerationData.Active();
+	data.bvh.IntersectPacketLeaves(packet, firstRay, nearestDistances, [&](unsigned int first, unsigned int count, unsigned int firstActive) {
+		for (unsigned int i = firstActive; i < packet.size; ++i)
+		{
+			unsigned int hitSlot = 0;
+			if (data.intersectionData.IntersectRange(first, count, packet.rays[i].origin, packet.rays[i].direction, nearestDistances[i], hitSlot))
+			{
+				hitInfos[i].object = this;
+				hitInfos[i].elementIndex = data.intersectionData.triangleIndex[hitSlot];
+				hitInfos[i].hitDistance = nearestDistances[i];
+			}
+		}
+	});
+}
+
+void TriangleMesh::IntersectRays(const Ray* rays, unsigned int rayCount, RayIntersectionInfo* hitInfos, unsigned int groupSize)
+{
+	std::vector<float> nearestDistances(rayCount, FLOAT_INFINITY);
+	for (unsigned int i = 0; i < rayCount; ++i)
+	{
+		hitInfos[i].Reset();
+	}
+
+	const auto& data = accelerationData.Active();
+	data.bvh.IntersectLeavesInterleaved(rays, rayCount, nearestDistances.data(), groupSize, [&](unsigned int rayIndex, unsigned int first, unsigned int count, float& nearest) {
+		unsigned int hitSlot = 0;
+		if (!data.intersectionData.IntersectRange(first, count, rays[rayIndex].origin, rays[rayIndex].direction, nearest, hitSlot)) return false;
+
+		hitInfos[rayIndex].object = this;
+		hitInfos[rayIndex].elementIndex = data.intersectionData.triangleIndex[hitSlot];
+		hitInfos[rayIndex].hitDistance = nearest;
+		return true;
+	});
+}
+
+void TriangleMesh::OccludedRays(const Ray* rays, float* maxDistances, unsigned int rayCount, unsigned int groupSize)
+{
+	const auto& data = accelerationData.Active();
+	data.bvh.IntersectLeavesInterleaved(rays, rayCount, maxDistances, groupSize, [&](unsigned int rayIndex, unsigned int first, unsigned int count, float& maxDistance) {
+		if (!data.intersectionData.OccludedRange(first, count, rays[rayIndex].origin, rays[rayIndex].direction, maxDistance)) return false;
+
+		maxDistance = -1.0f;
+		return true;
+	});
+}
+
 vec3 TriangleMesh::GetSurfaceNormal(vec3 location, unsigned int index)
 {
 	return triangles[index].normal;
@@ -50,6 +105,7 @@ void TriangleMesh::AddQuad(vec3 p1, vec3 p2, vec3 p3, vec3 p4)
 {
 	triangles.push_back(Triangle{ p1, p2, p3 });
 	triangles.push_back(Triangle{ p3, p4, p1 });
+	accelerationData.MarkDirty();
 }
 
 void TriangleMesh::UpdateAABB()
@@ -67,6 +123,30 @@ void TriangleMesh::UpdateAABB()
 	}
 }
 
+void TriangleMesh::BuildAccelerationStructure(const BVHSettings& settings)
+{
+	accelerationData.Build(settings, [this]() { return TriangleBounds(); }, [this](TriangleSoA& soa, const std::vector<unsigned int>& order) {
+		soa.Build(triangles, order);
+	});
+}
+
+void TriangleMesh::RefineAccelerationStructure(const BVHSettings& settings)
+{
+	accelerationData.Refine(settings, [this]() { return TriangleBounds(); }, [this](TriangleSoA& soa, const std::vector<unsigned int>& order) {
+		soa.Build(triangles, order);
+	});
+}
+
+std::vector<AABB> TriangleMesh::TriangleBounds() const
+{
+	std::vector<AABB> triangleBounds(triangles.size());
+	for (unsigned int i = 0; i < triangles.size(); ++i)
+	{
+		triangleBounds[i] = triangles[i].Bounds();
+	}
+	return triangleBounds;
+}
+
 void TriangleMesh::LoadMesh(std::string path)
 {
 	std::cout << "\r\n";
@@ -89,11 +169,11 @@ void TriangleMesh::LoadMesh(std::string path)
 	// Load triangles
 	for (objl::Mesh& mesh : meshes)
 	{
-		for (int k = 0; k < mesh.Indices.size()-3; k++)
+		for (size_t k = 0; k + 2 < mesh.Indices.size(); k += 3)
 		{
-			objl::Vector3& p1 = mesh.Vertices[k].Position;
-			objl::Vector3& p2 = mesh.Vertices[k+1].Position;
-			objl::Vector3& p3 = mesh.Vertices[k+2].Position;
+			objl::Vector3& p1 = mesh.Vertices[mesh.Indices[k]].Position;
+			objl::Vector3& p2 = mesh.Vertices[mesh.Indices[k+1]].Position;
+			objl::Vector3& p3 = mesh.Vertices[mesh.Indices[k+2]].Position;
 
 			vec3 v1 = vec3{ p1.X, p1.Y, p1.Z };
 			vec3 v2 = vec3{ p2.X, p2.Y, p2.Z };
@@ -102,4 +182,6 @@ void TriangleMesh::LoadMesh(std::string path)
 			triangles.push_back(Triangle{ v1+position, v3+position, v2+position });
 		}
 	}
+
+	accelerationData.MarkDirty();
 }
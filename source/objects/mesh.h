@@ -5,18 +5,36 @@
 #pragma once
 #include "object.h"
 #include "../core/triangle.h"
+#include "../core/trianglesoa.h"
+#include "../accelerationstructures/bvh.h"
+#include "../accelerationstructures/doublebufferedstructure.h"
 #include <vector>
+#include <string>
 
 class TriangleMesh : public Object
 {
+protected:
+	// Bottom-level structure over the triangles, kept until the geometry changes
+	DoubleBufferedStructure<TriangleSoA> accelerationData;
+
+	std::vector<AABB> TriangleBounds() const;
+
 public:
 	std::vector<Triangle> triangles;
 
-	TriangleMesh() = default;
+	TriangleMesh();
 	~TriangleMesh() = default;
 
 	virtual bool Intersects(vec3 rayOrigin, vec3 rayDirection, RayIntersectionInfo& hitInfo);
 
+	virtual bool Occludes(const Ray& ray, float maxDistance) override;
+
+	virtual void IntersectPacket(RayPacket& packet, unsigned int firstRay, float* nearestDistances, RayIntersectionInfo* hitInfos) override;
+
+	virtual void IntersectRays(const Ray* rays, unsigned int rayCount, RayIntersectionInfo* hitInfos, unsigned int groupSize) override;
+
+	virtual void OccludedRays(const Ray* rays, float* maxDistances, unsigned int rayCount, unsigned int groupSize) override;
+
 	virtual vec3 GetSurfaceNormal(vec3 location, unsigned int index);
 
 	// The points must be defined in ccw order in respect to their normal
@@ -24,5 +42,15 @@ public:
 
 	virtual void UpdateAABB();
 
+	virtual void BuildAccelerationStructure(const BVHSettings& settings);
+
+	// Builds into the inactive buffer and swaps it in, safe while other threads trace the mesh
+	virtual void RefineAccelerationStructure(const BVHSettings& settings);
+
+	virtual const BVH* AccelerationStructure() const { return &accelerationData.Active().bvh; }
+
+	// Must be called if triangles are modified directly
+	void MarkGeometryDirty() { accelerationData.MarkDirty(); }
+
 	void LoadMesh(std::string path);
 };
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include "../core/randomization.h"
 #include "../core/material.h"
 #include "../core/aabb.h"
+#include "../accelerationstructures/bvh.h"
 
 class Object
 {
@@ -18,18 +19,73 @@ public:
 	AABB aabb;
 
 	Object() = default;
-	~Object() = default;
+	virtual ~Object() = default;
 
 	virtual bool Intersects(vec3 rayOrigin, vec3 rayDirection, RayIntersectionInfo& hitInfo) = 0;
 	virtual vec3 GetSurfaceNormal(vec3 location, unsigned int index) = 0;
+
+	// True if any surface is hit closer than maxDistance, objects can override this with a cheaper any hit test
+	virtual bool Occludes(const Ray& ray, float maxDistance)
+	{
+		RayIntersectionInfo hitInfo;
+		return Intersects(ray.origin, ray.direction, hitInfo) && hitInfo.hitDistance < maxDistance;
+	}
+
+	// Closest hits for the rays [firstRay, packet.size), only hits closer than nearestDistances are recorded
+	virtual void IntersectPacket(RayPacket& packet, unsigned int firstRay, float* nearestDistances, RayIntersectionInfo* hitInfos)
+	{
+		RayIntersectionInfo hitInfo;
+		for (unsigned int i = firstRay; i < packet.size; ++i)
+		{
+			if (Intersects(packet.rays[i].origin, packet.rays[i].direction, hitInfo) && hitInfo.hitDistance < nearestDistances[i])
+			{
+				hitInfos[i] = hitInfo;
+				nearestDistances[i] = hitInfo.hitDistance;
+			}
+		}
+	}
+
+	// Closest hits for a stream of independent rays, objects with their own structure can interleave the traversals
+	virtual void IntersectRays(const Ray* rays, unsigned int rayCount, RayIntersectionInfo* hitInfos, unsigned int groupSize)
+	{
+		for (unsigned int i = 0; i < rayCount; ++i)
+		{
+			// Not every Intersects resets the hit on a miss
+			if (!Intersects(rays[i].origin, rays[i].direction, hitInfos[i])) hitInfos[i].Reset();
+		}
+	}
+
+	// Shadow ray queries for a stream of rays, the distance of every occluded ray is set negative (see Scene::OccludedRays)
+	virtual void OccludedRays(const Ray* rays, float* maxDistances, unsigned int rayCount, unsigned int groupSize)
+	{
+		for (unsigned int i = 0; i < rayCount; ++i)
+		{
+			if (Occludes(rays[i], maxDistances[i])) maxDistances[i] = -1.0f;
+		}
+	}
+
 	virtual bool IsLight() { return false; };
 	virtual vec3 GetRandomPointOnSurface(UniformRandomGenerator& gen)
 	{
 		return position;
 	}
 
+	// Area density of GetRandomPointOnSurface, not finite for point lights
 	virtual double PDF() { return 1.0 / area; }
+
+	// Side of the surface a light emits from at a point returned by GetRandomPointOnSurface
+	virtual vec3 GetEmissionNormal(vec3 location) { return GetSurfaceNormal(location, 0); }
+
 	virtual void UpdateAABB() {}
+
+	// Called once the object geometry is final, before the scene builds its top-level structure
+	virtual void BuildAccelerationStructure(const BVHSettings& settings) {}
+
+	// Replaces a quickly built structure with one built with the given settings, called from background threads while rendering
+	virtual void RefineAccelerationStructure(const BVHSettings& settings) {}
+
+	// Bottom-level structure of the object, if it has one. Objects returning one must implement the refinement too.
+	virtual const BVH* AccelerationStructure() const { return nullptr; }
 };
 
 class ImplicitObject : public Object
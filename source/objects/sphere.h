@@ -4,6 +4,7 @@
 
 #pragma once
 #include "object.h"
+#include "../core/spheresoa.h"
 
 class SphereObject : public ImplicitObject
 {
@@ -15,38 +16,12 @@ public:
 
 	virtual bool Intersects(vec3 rayOrigin, vec3 rayDirection, RayIntersectionInfo& hitInfo)
 	{
-		if (radius < FLT_EPSILON) return false;
-
-		float radiusSq = radius * radius;
-
-		/*
-		Code based on ScratchAPixel guide
-		*/
-		float t0, t1;
-
-		vec3 L = position - rayOrigin;
-
-		float tca = glm::dot(L, rayDirection);
-		if (tca < 0) return false;
-
-		float distanceSq = glm::dot(L, L) - tca * tca;
-		if (distanceSq > radiusSq) return false;
-
-		float thc = sqrt(radiusSq - distanceSq);
-		t0 = tca - thc;
-		t1 = tca + thc;
-
-		if (t0 > t1) std::swap(t0, t1);
-
-		if (t0 < 0)
-		{
-			t0 = t1; // if t0 is negative, let's use t1 instead 
-			if (t0 < 0) return false; // both t0 and t1 are negative 
-		}
+		float t = 0.0f;
+		if (!IntersectSphere(position, radius, rayOrigin, rayDirection, t)) return false;
 
 		hitInfo.object = this;
 		hitInfo.elementIndex = 0;
-		hitInfo.hitDistance = t0;
+		hitInfo.hitDistance = t;
 
 		return true;
 	}
@@ -68,8 +43,11 @@ public:
 		return vec3(x, y, z);
 	}
 
+	// A sphere with zero radius is a point light
+	virtual double PDF() override { return 1.0 / (2.0 * M_TWO_PI * double(radius) * double(radius)); }
+
 	virtual void UpdateAABB() 
 	{
-		aabb = AABB(position, vec3{ radius });
+		aabb = AABB(position, vec3{ radius * 2.0f });
 	}
 };
\ No newline at end of file
@@ -0,0 +1,122 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#include "sphereset.h"
+
+bool SphereSet::Intersects(vec3 rayOrigin, vec3 rayDirection, RayIntersectionInfo& hitInfo)
+{
+	const auto& data = accelerationData.Active();
+	Ray ray{ rayOrigin, rayDirection };
+	unsigned int hitSlot = 0;
+	float nearestDistance = FLOAT_INFINITY;
+	data.bvh.IntersectLeaves(ray, nearestDistance, [&](unsigned int first, unsigned int count, float& nearest) {
+		return data.intersectionData.IntersectRange(first, count, rayOrigin, rayDirection, nearest, hitSlot);
+	});
+
+	if (nearestDistance < FLOAT_INFINITY)
+	{
+		hitInfo.object = this;
+		hitInfo.elementIndex = data.intersectionData.sphereIndex[hitSlot];
+		hitInfo.hitDistance = nearestDistance;
+	}
+	else
+	{
+		hitInfo.Reset();
+	}
+
+	return (hitInfo.object != nullptr);
+}
+
+bool SphereSet::Occludes(const Ray& ray, float maxDistance)
+{
+	const auto& data = accelerationData.Active();
+	return data.bvh.OccludedLeaves(ray, maxDistance, [&](unsigned int first, unsigned int count, float maxHitDistance) {
+		return data.intersectionData.OccludedRange(first, count, ray.origin, ray.direction, maxHitDistance);
+	});
+}
+
+void SphereSet::IntersectPacket(RayPacket& packet, unsigned int firstRay, float* nearestDistances, RayIntersectionInfo* hitInfos)
+{
+	const auto& data = accelerationData.Active();
+	data.bvh.IntersectPacketLeaves(packet, firstRay, nearestDistances, [&](unsigned int first, unsigned int count, unsigned int firstActive) {
+		for (unsigned int i = firstActive; i < packet.size; ++i)
+		{
+			unsigned int hitSlot = 0;
+			if (data.intersectionData.IntersectRange(first, count, packet.rays[i].origin, packet.rays[i].direction, nearestDistances[i], hitSlot))
+			{
+				hitInfos[i].object = this;
+				hitInfos[i].elementIndex = data.intersectionData.sphereIndex[hitSlot];
+				hitInfos[i].hitDistance = nearestDistances[i];
+			}
+		}
+	});
+}
+
+void SphereSet::IntersectRays(const Ray* rays, unsigned int rayCount, RayIntersectionInfo* hitInfos, unsigned int groupSize)
+{
+	const auto& data = accelerationData.Active();
+	std::vector<float> nearestDistances(rayCount, FLOAT_INFINITY);
+	for (unsigned int i = 0; i < rayCount; ++i)
+	{
+		hitInfos[i].Reset();
+	}
+
+	data.bvh.IntersectLeavesInterleaved(rays, rayCount, nearestDistances.data(), groupSize, [&](unsigned int rayIndex, unsigned int first, unsigned int count, float& nearest) {
+		unsigned int hitSlot = 0;
+		if (!data.intersectionData.IntersectRange(first, count, rays[rayIndex].origin, rays[rayIndex].direction, nearest, hitSlot)) return false;
+
+		hitInfos[rayIndex].object = this;
+		hitInfos[rayIndex].elementIndex = data.intersectionData.sphereIndex[hitSlot];
+		hitInfos[rayIndex].hitDistance = nearest;
+		return true;
+	});
+}
+
+void SphereSet::OccludedRays(const Ray* rays, float* maxDistances, unsigned int rayCount, unsigned int groupSize)
+{
+	const auto& data = accelerationData.Active();
+	data.bvh.IntersectLeavesInterleaved(rays, rayCount, maxDistances, groupSize, [&](unsigned int rayIndex, unsigned int first, unsigned int count, float& maxDistance) {
+		if (!data.intersectionData.OccludedRange(first, count, rays[rayIndex].origin, rays[rayIndex].direction, maxDistance)) return false;
+
+		maxDistance = -1.0f;
+		return true;
+	});
+}
+
+void SphereSet::UpdateAABB()
+{
+	if (centers.empty()) return;
+
+	aabb = AABB::Empty();
+	for (unsigned int i = 0; i < centers.size(); ++i)
+	{
+		aabb.Encapsulate(AABB(centers[i], vec3{ radii[i] * 2.0f }));
+	}
+	aabb.center = aabb.Centroid();
+	position = aabb.center;
+}
+
+void SphereSet::BuildAccelerationStructure(const BVHSettings& settings)
+{
+	accelerationData.Build(settings, [this]() { return SphereBounds(); }, [this](SphereSoA& soa, const std::vector<unsigned int>& order) {
+		soa.Build(centers, radii, order);
+	});
+}
+
+void SphereSet::RefineAccelerationStructure(const BVHSettings& settings)
+{
+	accelerationData.Refine(settings, [this]() { return SphereBounds(); }, [this](SphereSoA& soa, const std::vector<unsigned int>& order) {
+		soa.Build(centers, radii, order);
+	});
+}
+
+std::vector<AABB> SphereSet::SphereBounds() const
+{
+	std::vector<AABB> sphereBounds(centers.size());
+	for (unsigned int i = 0; i < centers.size(); ++i)
+	{
+		sphereBounds[i] = AABB(centers[i], vec3{ radii[i] * 2.0f });
+	}
+	return sphereBounds;
+}
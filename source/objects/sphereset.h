@@ -0,0 +1,66 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "object.h"
+#include "../core/spheresoa.h"
+#include "../accelerationstructures/bvh.h"
+#include "../accelerationstructures/doublebufferedstructure.h"
+#include <vector>
+
+/*
+	Many spheres as a single object (particles, molecules). The spheres are stored as plain arrays
+	instead of one SphereObject each, with their own BVH whose leaves are tested a register of
+	spheres at a time. Hits report the sphere index as elementIndex.
+*/
+class SphereSet : public Object
+{
+protected:
+	DoubleBufferedStructure<SphereSoA> accelerationData;
+
+	std::vector<AABB> SphereBounds() const;
+
+public:
+	std::vector<vec3> centers;
+	std::vector<float> radii;
+
+	SphereSet() = default;
+	~SphereSet() = default;
+
+	void AddSphere(const vec3& center, float radius)
+	{
+		centers.push_back(center);
+		radii.push_back(radius);
+		accelerationData.MarkDirty();
+	}
+
+	inline unsigned int Size() const { return (unsigned int)centers.size(); }
+
+	virtual bool Intersects(vec3 rayOrigin, vec3 rayDirection, RayIntersectionInfo& hitInfo);
+
+	virtual bool Occludes(const Ray& ray, float maxDistance) override;
+
+	virtual void IntersectPacket(RayPacket& packet, unsigned int firstRay, float* nearestDistances, RayIntersectionInfo* hitInfos) override;
+
+	virtual void IntersectRays(const Ray* rays, unsigned int rayCount, RayIntersectionInfo* hitInfos, unsigned int groupSize) override;
+
+	virtual void OccludedRays(const Ray* rays, float* maxDistances, unsigned int rayCount, unsigned int groupSize) override;
+
+	virtual vec3 GetSurfaceNormal(vec3 location, unsigned int index)
+	{
+		return glm::normalize(location - centers[index]);
+	}
+
+	virtual void UpdateAABB();
+
+	virtual void BuildAccelerationStructure(const BVHSettings& settings);
+
+	// Builds into the inactive buffer and swaps it in, safe while other threads trace the set
+	virtual void RefineAccelerationStructure(const BVHSettings& settings);
+
+	virtual const BVH* AccelerationStructure() const { return &accelerationData.Active().bvh; }
+
+	// Must be called if centers or radii are modified directly
+	void MarkGeometryDirty() { accelerationData.MarkDirty(); }
+};
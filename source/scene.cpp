@@ -8,6 +8,10 @@
 #include "objects/box.h"
 #include "objects/light.h"
 
+#include <iostream>
+#include <string>
+#include <cmath>
+
 Ray Scene::RandomHemisphereRay(vec3& origin, vec3& incomingDirection, vec3& surfaceNormal, UniformRandomGenerator& gen, float& cosTheta)
 {
 	vec3 Nx, Nz, Ny = surfaceNormal;
@@ -29,60 +33,410 @@ Ray Scene::RandomHemisphereRay(vec3& origin, vec3& incomingDirection, vec3& surf
 	return Ray(origin, sample_transformed);
 }
 
+/*
+	Spatial splits duplicate references, at the top level every duplicate is a whole object which
+	a ray might traverse once per leaf it visits. Only the mesh structures use them. The primitive
+	store is built without them as well, its spheres and other objects cannot be clipped.
+*/
+static BVHSettings TopLevelSettings(const BVHSettings& settings)
+{
+	BVHSettings topLevel = settings;
+	if (topLevel.builder == BVHBuilder::Spatial) topLevel.builder = BVHBuilder::BinnedSAH;
+	return topLevel;
+}
+
+// Settings for the first mesh structures of a progressive build, the LBVH builds in a fraction of the time
+static BVHSettings CoarseSettings(const BVHSettings& settings)
+{
+	BVHSettings coarse = settings;
+	coarse.builder = BVHBuilder::Linear;
+	return coarse;
+}
+
 Scene::~Scene()
 {
+	WaitForRefinement();
 	for (Object* o : objects) delete o;
+	for (TriangleMesh* mesh : sharedMeshes) delete mesh;
 	// do not delete lights, they are duplicates of objects which are emissive
 }
 
 void Scene::PrepareForRayTracing()
 {
-	// Cache lights
+	WaitForRefinement();
+
+	// Cache lights and the derived material constants
 	lights.clear();
 	for (Object* o : objects)
 	{
 		Material& m = o->material;
+		m.Prepare();
 		if (m.emission.r > 0.0 || m.emission.g > 0.0 || m.emission.b > 0.0)
 		{
 			lights.push_back(o);
 		}
 	}
 
-	// Update AABBs
+	/*
+		Update AABBs and bottom-level structures (meshes only rebuild if their geometry changed).
+		A progressive build starts with coarse mesh structures, unless a mesh has been refined before.
+	*/
+	bool progressive = progressiveBuild && bvhSettings.builder != BVHBuilder::Linear;
+	bool refine = false;
 	for (Object* o : objects)
 	{
 		o->UpdateAABB();
+
+		const BVH* built = o->AccelerationStructure();
+		bool coarse = progressive && built && (built->IsEmpty() || !built->IsConfiguredAs(bvhSettings));
+		o->BuildAccelerationStructure(coarse ? CoarseSettings(bvhSettings) : bvhSettings);
+		refine |= coarse;
+	}
+
+	// Generate acceleration structure
+	octree.Clear();
+	kdTree.Clear();
+	bvh.Clear();
+	primitives.Clear();
+	switch (accelerationStructure)
+	{
+	case AccelerationStructure::Octree:
+		octree.Fill(objects);
+		break;
+	case AccelerationStructure::KdTree:
+		kdTree.Fill(objects);
+		break;
+	case AccelerationStructure::FlatBVH:
+		primitives.Fill(objects, TopLevelSettings(bvhSettings));
+		break;
+	case AccelerationStructure::BVH:
+	{
+		std::vector<AABB> objectBounds(objects.size());
+		for (unsigned int i = 0; i < objects.size(); ++i)
+		{
+			objectBounds[i] = objects[i]->aabb;
+		}
+		bvh.Configure(TopLevelSettings(bvhSettings));
+		bvh.Build(objectBounds);
+		break;
+	}
+	default:
+		break;
 	}
 
-	// Generate Octree
-	octree.Fill(objects);
+	// The object bounds do not change with refinement, so the top-level structure stays valid
+	if (refine) RefineInBackground();
 }
 
+void Scene::RefineInBackground()
+{
+	// Half of the cores are left for rendering
+	unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency() / 2);
+	threadCount = std::min(threadCount, (unsigned int)objects.size());
+
+	nextRefinement = 0;
+	for (unsigned int t = 0; t < threadCount; ++t)
+	{
+		refinementThreads.emplace_back([this]() {
+			for (unsigned int i = nextRefinement++; i < objects.size(); i = nextRefinement++)
+			{
+				objects[i]->RefineAccelerationStructure(bvhSettings);
+			}
+		});
+	}
+}
 
-bool Scene::IntersectRay(Ray& ray, RayIntersectionInfo& hitInfo) const
+void Scene::WaitForRefinement()
 {
-	//return octree.Intersect(ray, hitInfo);
+	for (std::thread& thread : refinementThreads)
+	{
+		thread.join();
+	}
+	refinementThreads.clear();
+}
+
+
+void Scene::UpdateAccelerationStructures()
+{
+	WaitForRefinement();
+	for (Object* o : objects)
+	{
+		o->UpdateAABB();
+		o->BuildAccelerationStructure(bvhSettings);
+	}
 
-	hitInfo.object = nullptr;
-	hitInfo.elementIndex = 0;
-	hitInfo.hitDistance = FLOAT_INFINITY;
+	switch (accelerationStructure)
+	{
+	case AccelerationStructure::Octree:
+		// The octree and the kd-tree have no refit, objects may move to other cells
+		octree.Clear();
+		octree.Fill(objects);
+		break;
+	case AccelerationStructure::KdTree:
+		kdTree.Fill(objects);
+		break;
+	case AccelerationStructure::FlatBVH:
+		// The primitives are copies, moved objects have to be gathered again
+		primitives.Fill(objects, TopLevelSettings(bvhSettings));
+		break;
+	case AccelerationStructure::BVH:
+	{
+		std::vector<AABB> objectBounds(objects.size());
+		for (unsigned int i = 0; i < objects.size(); ++i)
+		{
+			objectBounds[i] = objects[i]->aabb;
+		}
+
+		if (bvh.IsConfiguredAs(TopLevelSettings(bvhSettings)))
+		{
+			bvh.Update(objectBounds);
+		}
+		else
+		{
+			bvh.Configure(TopLevelSettings(bvhSettings));
+			bvh.Build(objectBounds);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void Scene::PrintBVHMemoryUsage() const
+{
+	size_t nodeCount = 0;
+	size_t nodeBytes = 0;
+	size_t primitiveBytes = 0;
+	auto add = [&](const BVH& structure) {
+		size_t indexBytes = structure.PrimitiveIndices().capacity() * sizeof(unsigned int);
+		nodeCount += structure.TraversalNodeCount();
+		nodeBytes += structure.MemoryUsage() - indexBytes;
+		primitiveBytes += indexBytes;
+	};
+
+	// Instances share their structure with the mesh, it is counted once
+	std::vector<const BVH*> counted;
+	add(bvh);
+	for (Object* o : objects)
+	{
+		const BVH* structure = o->AccelerationStructure();
+		if (structure && std::find(counted.begin(), counted.end(), structure) == counted.end())
+		{
+			counted.push_back(structure);
+			add(*structure);
+		}
+	}
+
+	std::cout << "BVH memory: " + std::to_string(nodeCount) + " nodes, "
+		+ std::to_string(nodeCount > 0 ? nodeBytes / nodeCount : 0) + " bytes per node, "
+		+ std::to_string((nodeBytes + primitiveBytes) / 1024) + " KB including primitive references\r\n";
+}
+
+bool Scene::IntersectRay(Ray& ray, RayIntersectionInfo& hitInfo) const
+{
+	hitInfo.Reset();
 
 	RayIntersectionInfo hitTest;
-	for (Object* object : objects)
+	switch (accelerationStructure)
 	{
-		if (object->Intersects(ray.origin, ray.direction, hitTest) && hitTest.hitDistance < hitInfo.hitDistance)
+	case AccelerationStructure::Octree:
+		return octree.Intersect(ray, hitInfo);
+
+	case AccelerationStructure::KdTree:
+		return kdTree.Intersect(ray, hitInfo);
+
+	case AccelerationStructure::FlatBVH:
+		return primitives.Intersect(ray, hitInfo);
+
+	case AccelerationStructure::BVH:
+		bvh.Intersect(ray, hitInfo.hitDistance, [&](unsigned int index, float& nearestDistance) {
+			if (objects[index]->Intersects(ray.origin, ray.direction, hitTest) && hitTest.hitDistance < nearestDistance)
+			{
+				hitInfo = hitTest;
+				return true;
+			}
+			return false;
+		});
+		break;
+
+	default:
+		for (Object* object : objects)
 		{
-			hitInfo = hitTest;
+			if (object->Intersects(ray.origin, ray.direction, hitTest) && hitTest.hitDistance < hitInfo.hitDistance)
+			{
+				hitInfo = hitTest;
+			}
 		}
+		break;
 	}
 
 	return (hitInfo.object != nullptr);
 }
 
+void Scene::IntersectPacket(RayPacket& packet, RayIntersectionInfo* hitInfos) const
+{
+	if (accelerationStructure != AccelerationStructure::BVH)
+	{
+		for (unsigned int i = 0; i < packet.size; ++i)
+		{
+			IntersectRay(packet.rays[i], hitInfos[i]);
+		}
+		return;
+	}
+
+	float nearestDistances[RAY_PACKET_MAX_SIZE];
+	for (unsigned int i = 0; i < packet.size; ++i)
+	{
+		hitInfos[i].Reset();
+		nearestDistances[i] = FLOAT_INFINITY;
+	}
+
+	// Objects continue the packet traversal in their own structures (meshes)
+	bvh.IntersectPacket(packet, 0, nearestDistances, [&](unsigned int index, unsigned int firstRay) {
+		objects[index]->IntersectPacket(packet, firstRay, nearestDistances, hitInfos);
+	});
+}
+
+void Scene::IntersectRays(const Ray* rays, unsigned int rayCount, RayIntersectionInfo* hitInfos) const
+{
+	if (accelerationStructure != AccelerationStructure::BVH)
+	{
+		for (unsigned int i = 0; i < rayCount; ++i)
+		{
+			Ray ray = rays[i];
+			IntersectRay(ray, hitInfos[i]);
+		}
+		return;
+	}
+
+	for (unsigned int i = 0; i < rayCount; ++i)
+	{
+		hitInfos[i].Reset();
+	}
+
+	std::vector<std::vector<unsigned int>> objectRays = GatherObjectRays(rays, rayCount);
+	std::vector<Ray> objectStream;
+	std::vector<RayIntersectionInfo> objectHits;
+	for (unsigned int objectIndex = 0; objectIndex < objects.size(); ++objectIndex)
+	{
+		const std::vector<unsigned int>& rayIndices = objectRays[objectIndex];
+		if (rayIndices.empty()) continue;
+
+		objectStream.resize(rayIndices.size());
+		objectHits.resize(rayIndices.size());
+		for (size_t i = 0; i < rayIndices.size(); ++i)
+		{
+			objectStream[i] = rays[rayIndices[i]];
+		}
+
+		objects[objectIndex]->IntersectRays(objectStream.data(), (unsigned int)rayIndices.size(), objectHits.data(), rayGroupSize);
+		for (size_t i = 0; i < rayIndices.size(); ++i)
+		{
+			RayIntersectionInfo& hitInfo = hitInfos[rayIndices[i]];
+			if (objectHits[i].object && objectHits[i].hitDistance < hitInfo.hitDistance)
+			{
+				hitInfo = objectHits[i];
+			}
+		}
+	}
+}
+
+/*
+	Rays reaching the bounds of each object, by object index. The top-level traversals are interleaved,
+	the objects then trace their rays as streams of their own so that the traversals of the mesh BVHs,
+	where the cache misses are, get interleaved as well. The top-level BVH holds every object once.
+*/
+std::vector<std::vector<unsigned int>> Scene::GatherObjectRays(const Ray* rays, unsigned int rayCount) const
+{
+	std::vector<std::vector<unsigned int>> objectRays(objects.size());
+	std::vector<float> maxDistances(rayCount, FLOAT_INFINITY);
+	const std::vector<unsigned int>& objectIndices = bvh.PrimitiveIndices();
+	bvh.IntersectLeavesInterleaved(rays, rayCount, maxDistances.data(), rayGroupSize, [&](unsigned int rayIndex, unsigned int first, unsigned int count, float& maxDistance) {
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			objectRays[objectIndices[first + i]].push_back(rayIndex);
+		}
+		return false;
+	});
+	return objectRays;
+}
+
+bool Scene::Occluded(Ray& ray, float maxDistance) const
+{
+	switch (accelerationStructure)
+	{
+	case AccelerationStructure::BVH:
+		return bvh.Occluded(ray, maxDistance, [&](unsigned int index, float maxHitDistance) {
+			return objects[index]->Occludes(ray, maxHitDistance);
+		});
+
+	case AccelerationStructure::Octree:
+		return octree.Occluded(ray, maxDistance);
+
+	case AccelerationStructure::KdTree:
+		return kdTree.Occluded(ray, maxDistance);
+
+	case AccelerationStructure::FlatBVH:
+		return primitives.Occluded(ray, maxDistance);
+
+	default:
+		for (Object* object : objects)
+		{
+			if (object->Occludes(ray, maxDistance)) return true;
+		}
+		return false;
+	}
+}
+
+void Scene::OccludedRays(const Ray* rays, float* maxDistances, unsigned int rayCount) const
+{
+	if (accelerationStructure != AccelerationStructure::BVH)
+	{
+		for (unsigned int i = 0; i < rayCount; ++i)
+		{
+			Ray ray = rays[i];
+			if (Occluded(ray, maxDistances[i])) maxDistances[i] = -1.0f;
+		}
+		return;
+	}
+
+	std::vector<std::vector<unsigned int>> objectRays = GatherObjectRays(rays, rayCount);
+	std::vector<Ray> objectStream;
+	std::vector<float> objectDistances;
+	for (unsigned int objectIndex = 0; objectIndex < objects.size(); ++objectIndex)
+	{
+		// Rays occluded by an earlier object are left out
+		objectStream.clear();
+		objectDistances.clear();
+		std::vector<unsigned int>& rayIndices = objectRays[objectIndex];
+		rayIndices.erase(std::remove_if(rayIndices.begin(), rayIndices.end(), [&](unsigned int i) { return maxDistances[i] < 0.0f; }), rayIndices.end());
+		if (rayIndices.empty()) continue;
+
+		for (unsigned int i : rayIndices)
+		{
+			objectStream.push_back(rays[i]);
+			objectDistances.push_back(maxDistances[i]);
+		}
+
+		objects[objectIndex]->OccludedRays(objectStream.data(), objectDistances.data(), (unsigned int)rayIndices.size(), rayGroupSize);
+		for (size_t i = 0; i < rayIndices.size(); ++i)
+		{
+			if (objectDistances[i] < 0.0f) maxDistances[rayIndices[i]] = -1.0f;
+		}
+	}
+}
+
 ColorDbl Scene::TraceUnlit(Ray ray) const
 {
 	RayIntersectionInfo hitInfo;
-	if (IntersectRay(ray, hitInfo))
+	IntersectRay(ray, hitInfo);
+	return TraceUnlit(ray, hitInfo);
+}
+
+ColorDbl Scene::TraceUnlit(Ray& ray, RayIntersectionInfo& hitInfo) const
+{
+	if (hitInfo.object)
 	{
 		Material& material = hitInfo.object->material;
 		return ColorDbl(material.color.r, material.color.g, material.color.b);
@@ -91,18 +445,103 @@ ColorDbl Scene::TraceUnlit(Ray ray) const
 	return ColorDbl{ 0.0f };
 }
 
-ColorDbl Scene::TraceRay(Ray ray, UniformRandomGenerator& uniformGenerator, unsigned int traceDepth, ColorDbl importance)
+ColorDbl Scene::DirectLight(Ray& ray, vec3& intersectionPoint, vec3& normal, Material& surface, UniformRandomGenerator& uniformGenerator)
+{
+	ColorDbl directLight{ 0.0f };
+	vec3 lightDirection;
+	float lightDistance = 0.0f;
+	for (Object* lightSource : lights)
+	{
+		double lightFactor = SampleLight(*lightSource, intersectionPoint, normal, uniformGenerator, lightDirection, lightDistance);
+		if (lightFactor == 0.0) continue;
+
+		// Shadow ray attempt, only geometry in front of the sampled light point can block it
+		Ray shadowRay = Ray(intersectionPoint, lightDirection);
+		if (!Occluded(shadowRay, lightDistance * SHADOW_RAY_DISTANCE_SCALE))
+		{
+			double BRDF = surface.BRDF(ray.direction, shadowRay.direction, normal);
+			directLight += lightSource->material.emission * (BRDF * lightFactor);
+		}
+	}
+	return directLight;
+}
+
+double Scene::SampleLight(Object& lightSource, vec3& intersectionPoint, vec3& normal, UniformRandomGenerator& uniformGenerator, vec3& direction, float& distance)
+{
+	vec3 lightPoint = lightSource.GetRandomPointOnSurface(uniformGenerator);
+	direction = lightPoint - intersectionPoint;
+	distance = glm::length(direction);
+	direction /= distance;
+
+	float surfaceDot = glm::dot(normal, direction);
+	if (lightSampling == LightSampling::Explicit)
+	{
+		float lightDot = glm::dot(vec3(0.0f, -1.0f, 0.0f), direction*-1.0f);
+		return double(surfaceDot * lightDot);
+	}
+	if (surfaceDot <= 0.0f) return 0.0;
+
+	/*
+		The BRDF carries a factor PI (see Material::BRDF) which is divided out here.
+		Point lights are only reached by light sampling, their emission falls off with the squared distance.
+	*/
+	double distanceSq = double(distance) * double(distance);
+	double areaPDF = lightSource.PDF();
+	if (!std::isfinite(areaPDF))
+	{
+		return double(surfaceDot) * M_ONE_OVER_PI / distanceSq;
+	}
+
+	float lightDot = glm::dot(lightSource.GetEmissionNormal(lightPoint), -direction);
+	if (lightDot <= 0.0f) return 0.0;
+
+	/*
+		Area to solid angle, the hemisphere of RandomHemisphereRay is the other strategy. Only Light objects
+		emit when a bounce hits them (EmittedLight), other emissive objects are reached by light sampling alone.
+	*/
+	double lightPDF = areaPDF * distanceSq / double(lightDot);
+	double weight = lightSource.IsLight() ? MISWeight(lightPDF, M_ONE_OVER_TWO_PI) : 1.0;
+	return double(surfaceDot) * M_ONE_OVER_PI / lightPDF * weight;
+}
+
+ColorDbl Scene::EmittedLight(Object& lightSource, Ray& ray, RayIntersectionInfo& hitInfo, float bouncePDF)
+{
+	ColorDbl emission = lightSource.material.emission;
+	if (lightSampling == LightSampling::Explicit) return emission;
+
+	// Light sampling only reaches the emitting side
+	vec3 lightPoint = ray.origin + ray.direction * hitInfo.hitDistance;
+	float lightDot = glm::dot(lightSource.GetEmissionNormal(lightPoint), -ray.direction);
+	if (lightDot <= 0.0f) return ColorDbl{ 0.0 };
+	if (bouncePDF <= 0.0f) return emission;
+
+	double distance = double(hitInfo.hitDistance);
+	double lightPDF = lightSource.PDF() * distance * distance / double(lightDot);
+	return emission * MISWeight(double(bouncePDF), lightPDF);
+}
+
+ColorDbl Scene::TraceRay(Ray ray, UniformRandomGenerator& uniformGenerator, unsigned int traceDepth, ColorDbl importance, float bouncePDF)
 {
 	RayIntersectionInfo hitInfo;
-	if (!IntersectRay(ray, hitInfo))
+	IntersectRay(ray, hitInfo);
+	return TraceRay(ray, hitInfo, uniformGenerator, traceDepth, importance, bouncePDF);
+}
+
+ColorDbl Scene::TraceRay(Ray& ray, RayIntersectionInfo& hitInfo, UniformRandomGenerator& uniformGenerator, unsigned int traceDepth, ColorDbl importance, float bouncePDF)
+{
+	if (!hitInfo.object)
 	{
 		return importance * backgroundColor;
 	}
 
 	Object& object = *hitInfo.object;
-	if (traceDepth == 0 || object.IsLight())
+	if (object.IsLight())
 	{
 		// Note that this method "cheats" and only allows explicit light sources to emit light.
+		return importance * EmittedLight(object, ray, hitInfo, bouncePDF);
+	}
+	if (traceDepth == 0)
+	{
 		return importance * object.material.emission;
 	}
 
@@ -117,29 +556,8 @@ ColorDbl Scene::TraceRay(Ray ray, UniformRandomGenerator& uniformGenerator, unsi
 		/*
 			Direct light contribution
 		*/
-		ColorDbl directLight{ 0.0f };
-		vec3 lightDirection;
-		RayIntersectionInfo hitInfo;
-		float distanceSq = 0.0;
+		ColorDbl directLight = DirectLight(ray, intersectionPoint, normal, surface, uniformGenerator);
 		float surfaceDot = 0.0f;
-		float lightDot = 0.0f;
-		double BRDF = 0.0;
-		for (Object* lightSource : lights)
-		{
-			lightDirection = lightSource->GetRandomPointOnSurface(uniformGenerator) - intersectionPoint;
-			lightDirection = glm::normalize(lightDirection);
-
-			// Shadow ray attempt (either a clear path (no collision) or the light is reached)
-			Ray shadowRay = Ray(intersectionPoint, lightDirection);
-			if (!IntersectRay(shadowRay, hitInfo) || (hitInfo.object == lightSource))
-			{
-				surfaceDot = glm::dot(normal, lightDirection);
-				lightDot = glm::dot(vec3(0.0f, -1.0f, 0.0f), lightDirection*-1.0f);	
-				BRDF = surface.BRDF(ray.direction, shadowRay.direction, normal);
-
-				directLight += lightSource->material.emission * double(BRDF * surfaceDot * lightDot);
-			}
-		}
 
 		/*
 			Determine if ray should terminate using russian roulette.
@@ -162,7 +580,7 @@ ColorDbl Scene::TraceRay(Ray ray, UniformRandomGenerator& uniformGenerator, unsi
 		*/
 		Ray bouncedRay = RandomHemisphereRay(intersectionPoint, ray.direction, normal, uniformGenerator, surfaceDot);
 		importance *= 2.0 * double(surfaceDot) * surface.BRDF(ray.direction, bouncedRay.direction, normal);
-		ColorDbl indirectLight = TraceRay(bouncedRay, uniformGenerator, --traceDepth, importance);
+		ColorDbl indirectLight = TraceRay(bouncedRay, uniformGenerator, --traceDepth, importance, float(M_ONE_OVER_TWO_PI));
 
 		return directLight + indirectLight;
 	}
@@ -176,35 +594,20 @@ ColorDbl Scene::TraceRay(Ray ray, UniformRandomGenerator& uniformGenerator, unsi
 	else if (surface.type == SurfaceType::Refractive)
 	{
 		vec3& I = ray.direction;
-		float n1 = 1.0f;					// air
-		float n2 = surface.refractiveIndex;
 
-		// Ray aiming out of the material? (swap normal and coefficients to match ray direction)
-		if (glm::dot(normal, I) >= 0)
-		{
-			normal = normal * -1.0f;
-			std::swap(n1, n2);
-		}
+		// Ray aiming out of the material? (the normal is flipped to match the ray direction)
+		float n = surface.OrientForRefraction(I, normal);
 		vec3 errorMargin = normal * INTERSECTION_ERROR_MARGIN;
-		float n = n1 / n2;
 
-		// Determine if the incoming angle is beyond the limit for total internal reflection
-		float cosI = glm::dot(I, normal);
-		float cos2t = 1.0f - n * n * (1.0f - cosI * cosI);
-		if (cos2t < 0.0f)
+		// R determines amount of reflection (1-R determines refraction)
+		vec3 tdir;
+		float R;
+		if (!surface.Refract(I, normal, n, tdir, R))
 		{
 			// Return total internal reflection
 			return TraceRay(Ray{ intersectionPoint + errorMargin, glm::reflect(I, normal) }, uniformGenerator, --traceDepth, importance);
 		}
 
-		// Use Schlick's approximation of the Fresnel equation to determine reflection and refraction contributions.
-		// R determines amount of reflection (1-R determines refraction)
-		vec3 tdir = I * n - normal * (cosI * n + sqrt(cos2t));
-		float R0 = (n2 - n1) / (n2 + n1);
-		R0 *= R0;
-		float c = 1.0f - (-cosI);
-		float R = R0 + (1.0f - R0) * c * c * c * c * c;
-
 		// Use probability to determine if the ray is important enough to need a detailed contribution
 		if (uniformGenerator.RandomDouble() < MaxImportance(importance))
 		{
@@ -233,6 +636,114 @@ ColorDbl Scene::TraceRay(Ray ray, UniformRandomGenerator& uniformGenerator, unsi
 	return ColorDbl{ 0.0 };
 }
 
+ColorDbl Scene::TracePath(Ray ray, UniformRandomGenerator& uniformGenerator, unsigned int traceDepth)
+{
+	RayIntersectionInfo hitInfo;
+	IntersectRay(ray, hitInfo);
+	return TracePath(ray, hitInfo, uniformGenerator, traceDepth);
+}
+
+ColorDbl Scene::TracePath(Ray& cameraRay, RayIntersectionInfo& cameraHitInfo, UniformRandomGenerator& uniformGenerator, unsigned int traceDepth)
+{
+	Ray ray = cameraRay;
+	RayIntersectionInfo hitInfo = cameraHitInfo;
+	ColorDbl radiance{ 0.0 };
+	ColorDbl importance{ 1.0 };		// throughput of the path up to the current hit
+	float bouncePDF = 0.0f;			// of the diffuse bounce which produced ray, see EmittedLight
+
+	for (;; --traceDepth)
+	{
+		if (!hitInfo.object)
+		{
+			return radiance + importance * backgroundColor;
+		}
+
+		Object& object = *hitInfo.object;
+		if (object.IsLight())
+		{
+			// Only explicit light sources emit light, same as TraceRay
+			return radiance + importance * EmittedLight(object, ray, hitInfo, bouncePDF);
+		}
+		if (traceDepth == 0)
+		{
+			return radiance + importance * object.material.emission;
+		}
+
+		Material& surface = object.material;
+		vec3 intersectionPoint = ray.origin + ray.direction * hitInfo.hitDistance;
+		vec3 normal = object.GetSurfaceNormal(intersectionPoint, hitInfo.elementIndex);
+		if (surface.type == SurfaceType::Diffuse)
+		{
+			intersectionPoint += normal * INTERSECTION_ERROR_MARGIN;
+			ColorDbl directLight = DirectLight(ray, intersectionPoint, normal, surface, uniformGenerator);
+
+			// Russian roulette, see TraceRay for the importance of the bounce
+			double p = MaxImportance(importance);
+			importance *= surface.color;
+			radiance += directLight * importance;
+			if (uniformGenerator.RandomDouble(0.0, 1.0) > p)
+			{
+				return radiance;
+			}
+			importance /= p;
+
+			float surfaceDot = 0.0f;
+			Ray bouncedRay = RandomHemisphereRay(intersectionPoint, ray.direction, normal, uniformGenerator, surfaceDot);
+			importance *= 2.0 * double(surfaceDot) * surface.BRDF(ray.direction, bouncedRay.direction, normal);
+			ray = bouncedRay;
+			bouncePDF = float(M_ONE_OVER_TWO_PI);
+		}
+		else if (surface.type == SurfaceType::Specular)
+		{
+			intersectionPoint += normal * INTERSECTION_ERROR_MARGIN;
+			ray = Ray(intersectionPoint, glm::reflect(ray.direction, normal));
+			bouncePDF = 0.0f;
+		}
+		else if (surface.type == SurfaceType::Refractive)
+		{
+			bouncePDF = 0.0f;
+			vec3 I = ray.direction;
+			float n = surface.OrientForRefraction(I, normal);
+			vec3 errorMargin = normal * INTERSECTION_ERROR_MARGIN;
+
+			// R is the amount of reflection
+			vec3 tdir;
+			float R;
+			if (!surface.Refract(I, normal, n, tdir, R))
+			{
+				// Total internal reflection
+				ray = Ray(intersectionPoint + errorMargin, glm::reflect(I, normal));
+			}
+			else
+			{
+				/*
+					Follow one of the two paths instead of blending both. P stays within [0.25, 0.75] so the
+					weights are at most 4, the expected contribution is R * reflected + (1 - R) * refracted
+					as with the split in TraceRay.
+				*/
+				double P = .25 + .5 * R;
+				if (uniformGenerator.RandomDouble() < P)
+				{
+					importance *= R / P;
+					ray = Ray(intersectionPoint + errorMargin, glm::reflect(I, normal));
+				}
+				else
+				{
+					importance *= (1.0 - R) / (1.0 - P);
+					ray = Ray(intersectionPoint - errorMargin, tdir);
+				}
+			}
+		}
+		else
+		{
+			// Failed to get a color
+			return radiance;
+		}
+
+		IntersectRay(ray, hitInfo);
+	}
+}
+
 void Scene::MoveCameraToRecommendedPosition(Camera& camera)
 {
 	camera.SetView(vec3(0.0f, 0.0f, 0.0f), vec3(0.0f, 0.0f, 1.0f), vec3(0.0f, 1.0f, 0.0f));
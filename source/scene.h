@@ -4,25 +4,88 @@ Copyright Denny Lindberg and Molly Middagsfjell 2018
 
 #pragma once
 #include <vector>
+#include <thread>
+#include <atomic>
 #include "core/math.h"
 #include "core/randomization.h"
 #include "core/camera.h"
 #include "objects/object.h"
 #include "objects/mesh.h"
+#include "objects/instance.h"
 #include "accelerationstructures/octree.h"
+#include "accelerationstructures/kdtree.h"
+#include "accelerationstructures/bvh.h"
+#include "accelerationstructures/primitivestore.h"
 #include <algorithm>
 
+// FlatBVH traces a type-sorted copy of the primitives of all objects (see PrimitiveStore)
+enum class AccelerationStructure { None, Octree, KdTree, BVH, FlatBVH, COUNT };
+
+/*
+	How the light reaching a diffuse surface is estimated. Explicit adds one shadow ray per light with a cosine
+	of the light direction but no distance falloff, and bounce rays which reach a light add its full emission.
+	Its shadow rays aim at points over the whole light quad (Light::GetRandomPointOnSurface), not only the
+	central quarter as before MIS was added, so Explicit images have wider penumbrae than they used to.
+	The MIS modes combine the shadow ray (light sampling) and the bounce (BSDF sampling) estimates of every light
+	with the balance or the power heuristic, which converges faster for small or very bright lights.
+*/
+enum class LightSampling { Explicit, MISBalance, MISPower, COUNT };
 
 class Scene
 {
+	friend class WavefrontIntegrator;
+
 protected:
 	std::vector<Object*> objects;	// TODO: std::pointer type
 	std::vector<Object*> lights;	// TODO: std::pointer type
+	std::vector<TriangleMesh*> sharedMeshes;	// geometry referenced by instances, not traced directly
+	std::vector<std::thread> refinementThreads;
+	std::atomic<unsigned int> nextRefinement{ 0 };	// next object to refine
+
+	void RefineInBackground();
+
+	// Indices of the rays reaching each object through the top-level BVH, for the stream queries
+	std::vector<std::vector<unsigned int>> GatherObjectRays(const Ray* rays, unsigned int rayCount) const;
 
 	struct Ray RandomHemisphereRay(vec3& origin, vec3& incomingDirection, vec3& surfaceNormal, UniformRandomGenerator& gen, float& cosTheta);
 
+	// Light from all light sources reaching a diffuse surface point, one shadow ray per light
+	ColorDbl DirectLight(Ray& ray, vec3& intersectionPoint, vec3& normal, Material& surface, UniformRandomGenerator& uniformGenerator);
+
+	/*
+		Picks a point on lightSource to light a diffuse surface point, direction and distance lead to it.
+		Returns the factor which turns emission * BRDF into the light sampling estimate (cosines, PDF and MIS weight),
+		zero if the surface and the light face away from each other.
+	*/
+	double SampleLight(Object& lightSource, vec3& intersectionPoint, vec3& normal, UniformRandomGenerator& uniformGenerator, vec3& direction, float& distance);
+
+	/*
+		Emission of a light hit by ray. bouncePDF is the solid angle PDF of the diffuse bounce which produced the ray,
+		0 for camera, mirror and refracted rays which light sampling cannot produce.
+	*/
+	ColorDbl EmittedLight(Object& lightSource, Ray& ray, RayIntersectionInfo& hitInfo, float bouncePDF);
+
+	// Weight of a sample drawn with pdf against the other strategy of lightSampling which could have drawn it with otherPDF
+	inline double MISWeight(double pdf, double otherPDF) const
+	{
+		if (lightSampling == LightSampling::MISPower)
+		{
+			pdf *= pdf;
+			otherPDF *= otherPDF;
+		}
+		return pdf / (pdf + otherPDF);
+	}
+
 public:
+	AccelerationStructure accelerationStructure = AccelerationStructure::BVH;
+	BVHSettings bvhSettings;			// used for both the top-level and the mesh structures
+	unsigned int rayGroupSize = BVH_INTERLEAVE_DEFAULT_GROUP;	// rays traversed together by IntersectRays
+	bool progressiveBuild = false;		// meshes start with a fast LBVH and are rebuilt with bvhSettings in the background
+	LightSampling lightSampling = LightSampling::MISBalance;
 	Octree octree;
+	KdTree kdTree;
+	BVH bvh;							// top-level structure over objects, meshes keep their own bottom-level BVH
+	PrimitiveStore primitives;
 	ColorDbl backgroundColor = { 0.0f, 0.0f, 0.0f };
 
 	Scene() = default;
@@ -36,18 +99,80 @@ public:
 		return newObject;
 	}
 
+	// Mesh geometry which is only placed in the scene through CreateInstance
+	TriangleMesh* CreateSharedMesh()
+	{
+		TriangleMesh* mesh = new TriangleMesh();
+		sharedMeshes.push_back(mesh);
+		return mesh;
+	}
+
+	MeshInstance* CreateInstance(TriangleMesh* sharedMesh, const mat4& transform)
+	{
+		MeshInstance* instance = CreateObject<MeshInstance>();
+		instance->SetMesh(sharedMesh);
+		instance->SetTransform(transform);
+		return instance;
+	}
+
+	const std::vector<Object*>& Lights() const { return lights; }
+
 	void PrepareForRayTracing();
 
+	// Blocks until the background mesh builds started by a progressive PrepareForRayTracing are done
+	void WaitForRefinement();
+
+	/*
+		Call after moving objects between frames instead of PrepareForRayTracing.
+		The BVHs are refitted to the new object bounds and only rebuilt if their quality degraded.
+	*/
+	void UpdateAccelerationStructures();
+
 	bool IntersectRay(Ray& ray, RayIntersectionInfo& hitInfo) const;
 
+	// Node count and memory of the top-level and all mesh BVHs
+	void PrintBVHMemoryUsage() const;
+
+	// Closest hits for all rays in the packet, traversed together when the scene uses a BVH
+	void IntersectPacket(RayPacket& packet, RayIntersectionInfo* hitInfos) const;
+
+	/*
+		Closest hits for a stream of independent rays (e.g. bounces). With the BVH the rays reaching each object
+		are passed on to Object::IntersectRays as one stream, both levels interleave rayGroupSize traversals.
+	*/
+	void IntersectRays(const Ray* rays, unsigned int rayCount, RayIntersectionInfo* hitInfos) const;
+
+	// Shadow ray query, true as soon as anything is found closer than maxDistance
+	bool Occluded(Ray& ray, float maxDistance) const;
+
+	/*
+		Shadow ray queries for a stream of rays, maxDistances[i] is the length of ray i. On return the
+		distance of every occluded ray is negative. The BVH passes the rays on to Object::OccludedRays like IntersectRays.
+	*/
+	void OccludedRays(const Ray* rays, float* maxDistances, unsigned int rayCount) const;
+
 	ColorDbl TraceUnlit(Ray ray) const;
+	ColorDbl TraceUnlit(Ray& ray, RayIntersectionInfo& hitInfo) const;
 
 	inline double MaxImportance(ColorDbl& importance)
 	{
 		return std::max(importance.x, std::max(importance.y, importance.z));
 	}
 
-	ColorDbl TraceRay(Ray ray, UniformRandomGenerator& uniformGenerator, unsigned int traceDepth = 5, ColorDbl importance = ColorDbl{ 1.0 });
+	// bouncePDF belongs to the diffuse bounce which produced the ray, see EmittedLight
+	ColorDbl TraceRay(Ray ray, UniformRandomGenerator& uniformGenerator, unsigned int traceDepth = 5, ColorDbl importance = ColorDbl{ 1.0 }, float bouncePDF = 0.0f);
+
+	// Continues TraceRay from an intersection which is already known (e.g. from IntersectPacket)
+	ColorDbl TraceRay(Ray& ray, RayIntersectionInfo& hitInfo, UniformRandomGenerator& uniformGenerator, unsigned int traceDepth = 5, ColorDbl importance = ColorDbl{ 1.0 }, float bouncePDF = 0.0f);
+
+	/*
+		Same estimate as TraceRay, computed in a loop which carries the path throughput instead of recursing.
+		Refractive surfaces follow either the reflected or the refracted path at random instead of both.
+	*/
+	ColorDbl TracePath(Ray ray, UniformRandomGenerator& uniformGenerator, unsigned int traceDepth = 5);
+
+	// Continues TracePath from an intersection which is already known (e.g. from IntersectPacket)
+	ColorDbl TracePath(Ray& ray, RayIntersectionInfo& hitInfo, UniformRandomGenerator& uniformGenerator, unsigned int traceDepth = 5);
 
 	virtual void MoveCameraToRecommendedPosition(Camera& camera);
 };
@@ -0,0 +1,318 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#include "wavefront.h"
+#include "objects/object.h"
+
+#include <algorithm>
+#include <functional>
+
+void WavefrontIntegrator::Trace(const Ray* cameraRays, unsigned int count, ColorDbl* radiance, UniformRandomGenerator& uniformGenerator, unsigned int traceDepth)
+{
+	Generate(cameraRays, count);
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		radiance[i] = ColorDbl{ 0.0 };
+	}
+
+	for (; pathCount > 0; --traceDepth)
+	{
+		Extend();
+		Classify(radiance, traceDepth);
+
+		shadowRays.clear();
+		shadowDistances.clear();
+		shadowContributions.clear();
+		shadowOutputIndex.clear();
+		ShadeDiffuse(uniformGenerator);
+		ShadeSpecular();
+		ShadeRefractive(uniformGenerator);
+
+		TraceShadowRays(radiance);
+		Compact();
+	}
+}
+
+void WavefrontIntegrator::Generate(const Ray* cameraRays, unsigned int count)
+{
+	rays.assign(cameraRays, cameraRays + count);
+	hitInfos.resize(count);
+	importance.assign(count, ColorDbl{ 1.0 });
+	bouncePDF.assign(count, 0.0f);
+	outputIndex.resize(count);
+	alive.assign(count, 1);
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		outputIndex[i] = i;
+	}
+	pathCount = count;
+}
+
+void WavefrontIntegrator::Extend()
+{
+	scene.IntersectRays(rays.data(), pathCount, hitInfos.data());
+}
+
+/*
+	Paths which left the scene, reached a light or the depth limit are finished here,
+	the others are queued by the surface type of their hit
+*/
+void WavefrontIntegrator::Classify(ColorDbl* radiance, unsigned int traceDepth)
+{
+	for (std::vector<unsigned int>& queue : shadeQueues)
+	{
+		queue.clear();
+	}
+
+	for (unsigned int i = 0; i < pathCount; ++i)
+	{
+		Object* object = hitInfos[i].object;
+		if (!object)
+		{
+			radiance[outputIndex[i]] += importance[i] * scene.backgroundColor;
+			alive[i] = 0;
+		}
+		else if (object->IsLight())
+		{
+			radiance[outputIndex[i]] += importance[i] * scene.EmittedLight(*object, rays[i], hitInfos[i], bouncePDF[i]);
+			alive[i] = 0;
+		}
+		else if (traceDepth == 0)
+		{
+			radiance[outputIndex[i]] += importance[i] * object->material.emission;
+			alive[i] = 0;
+		}
+		else
+		{
+			shadeQueues[int(object->material.type)].push_back(i);
+		}
+	}
+
+	// No shading model, the path contributes nothing more (same as TraceRay)
+	for (unsigned int i : shadeQueues[int(SurfaceType::Diffuse_Specular)])
+	{
+		alive[i] = 0;
+	}
+}
+
+// Paths hitting the same material end up next to each other, so each material group is shaded with one batch
+void WavefrontIntegrator::SortByMaterial(std::vector<unsigned int>& queue) const
+{
+	std::sort(queue.begin(), queue.end(), [this](unsigned int a, unsigned int b)
+	{
+		const Material* materialA = &hitInfos[a].object->material;
+		const Material* materialB = &hitInfos[b].object->material;
+		return (materialA != materialB) ? std::less<const Material*>()(materialA, materialB) : (a < b);
+	});
+}
+
+size_t WavefrontIntegrator::MaterialGroupEnd(const std::vector<unsigned int>& queue, size_t groupStart) const
+{
+	const Material* material = &hitInfos[queue[groupStart]].object->material;
+	size_t groupEnd = groupStart + 1;
+	while (groupEnd < queue.size() && &hitInfos[queue[groupEnd]].object->material == material)
+	{
+		++groupEnd;
+	}
+	return groupEnd;
+}
+
+void WavefrontIntegrator::ShadeDiffuse(UniformRandomGenerator& uniformGenerator)
+{
+	const std::vector<Object*>& lights = scene.Lights();
+	std::vector<unsigned int>& queue = shadeQueues[int(SurfaceType::Diffuse)];
+	SortByMaterial(queue);
+
+	for (size_t groupStart = 0, groupEnd = 0; groupStart < queue.size(); groupStart = groupEnd)
+	{
+		groupEnd = MaterialGroupEnd(queue, groupStart);
+		const Material& surface = hitInfos[queue[groupStart]].object->material;
+
+		// Light and bounce directions are sampled first, their BRDFs are evaluated afterwards in two batches
+		shadowBSDF.Clear();
+		pathBSDF.Clear();
+		shadePaths.clear();
+		bounceRays.clear();
+		bounceCosines.clear();
+		unsigned int firstShadowRay = (unsigned int)shadowRays.size();
+
+		for (size_t q = groupStart; q < groupEnd; ++q)
+		{
+			unsigned int i = queue[q];
+			Ray& ray = rays[i];
+			Object& object = *hitInfos[i].object;
+			vec3 intersectionPoint = ray.origin + ray.direction * hitInfos[i].hitDistance;
+			vec3 normal = object.GetSurfaceNormal(intersectionPoint, hitInfos[i].elementIndex);
+			intersectionPoint += normal * INTERSECTION_ERROR_MARGIN;
+
+			// Russian roulette on the importance before the surface color, see Scene::TraceRay
+			double p = scene.MaxImportance(importance[i]);
+			importance[i] *= surface.color;
+
+			// One shadow ray per light, the contribution is added by the shadow stage unless it is occluded
+			for (Object* lightSource : lights)
+			{
+				vec3 lightDirection;
+				float lightDistance = 0.0f;
+				double lightFactor = scene.SampleLight(*lightSource, intersectionPoint, normal, uniformGenerator, lightDirection, lightDistance);
+				if (lightFactor == 0.0) continue;
+
+				shadowBSDF.Add(ray.direction, lightDirection, normal);
+				shadowRays.push_back(Ray(intersectionPoint, lightDirection));
+				shadowDistances.push_back(lightDistance * SHADOW_RAY_DISTANCE_SCALE);
+				shadowContributions.push_back(lightSource->material.emission * lightFactor * importance[i]);	// BRDF applied below
+				shadowOutputIndex.push_back(outputIndex[i]);
+			}
+
+			if (uniformGenerator.RandomDouble(0.0, 1.0) > p)
+			{
+				alive[i] = 0;
+				continue;
+			}
+			importance[i] /= p;
+
+			float surfaceDot = 0.0f;
+			Ray bouncedRay = scene.RandomHemisphereRay(intersectionPoint, ray.direction, normal, uniformGenerator, surfaceDot);
+			pathBSDF.Add(ray.direction, bouncedRay.direction, normal);
+			shadePaths.push_back(i);
+			bounceRays.push_back(bouncedRay);
+			bounceCosines.push_back(surfaceDot);
+		}
+
+		shadowBSDF.Evaluate(surface);
+		for (unsigned int s = 0; s < shadowBSDF.count; ++s)
+		{
+			shadowContributions[firstShadowRay + s] *= double(shadowBSDF.result[s]);
+		}
+
+		pathBSDF.Evaluate(surface);
+		for (unsigned int b = 0; b < pathBSDF.count; ++b)
+		{
+			unsigned int i = shadePaths[b];
+			importance[i] *= 2.0 * double(bounceCosines[b]) * double(pathBSDF.result[b]);
+			rays[i] = bounceRays[b];
+			bouncePDF[i] = float(M_ONE_OVER_TWO_PI);
+		}
+	}
+}
+
+void WavefrontIntegrator::ShadeSpecular()
+{
+	const std::vector<unsigned int>& queue = shadeQueues[int(SurfaceType::Specular)];
+	pathBSDF.Clear();
+	shadePoints.clear();
+	for (unsigned int i : queue)
+	{
+		Ray& ray = rays[i];
+		Object& object = *hitInfos[i].object;
+		vec3 intersectionPoint = ray.origin + ray.direction * hitInfos[i].hitDistance;
+		vec3 normal = object.GetSurfaceNormal(intersectionPoint, hitInfos[i].elementIndex);
+
+		pathBSDF.Add(ray.direction, vec3{ 0.0f }, normal);
+		shadePoints.push_back(intersectionPoint + normal * INTERSECTION_ERROR_MARGIN);
+	}
+
+	pathBSDF.Reflect();
+	for (unsigned int s = 0; s < pathBSDF.count; ++s)
+	{
+		rays[queue[s]] = Ray(shadePoints[s], pathBSDF.Outgoing(s));
+		bouncePDF[queue[s]] = 0.0f;
+	}
+}
+
+// Follows either the reflected or the refracted ray, see Scene::TracePath
+void WavefrontIntegrator::ShadeRefractive(UniformRandomGenerator& uniformGenerator)
+{
+	std::vector<unsigned int>& queue = shadeQueues[int(SurfaceType::Refractive)];
+	SortByMaterial(queue);
+
+	for (size_t groupStart = 0, groupEnd = 0; groupStart < queue.size(); groupStart = groupEnd)
+	{
+		groupEnd = MaterialGroupEnd(queue, groupStart);
+		const Material& surface = hitInfos[queue[groupStart]].object->material;
+
+		pathBSDF.Clear();
+		shadePoints.clear();
+		for (size_t q = groupStart; q < groupEnd; ++q)
+		{
+			unsigned int i = queue[q];
+			Ray& ray = rays[i];
+			Object& object = *hitInfos[i].object;
+			vec3 intersectionPoint = ray.origin + ray.direction * hitInfos[i].hitDistance;
+			vec3 normal = object.GetSurfaceNormal(intersectionPoint, hitInfos[i].elementIndex);
+
+			float n = surface.OrientForRefraction(ray.direction, normal);
+			pathBSDF.Add(ray.direction, vec3{ 0.0f }, normal, n);
+			shadePoints.push_back(intersectionPoint);
+		}
+
+		// Reflectances and transmission cosines of the whole group, the reflected directions go to outgoing
+		pathBSDF.Fresnel(surface);
+		pathBSDF.Reflect();
+
+		for (unsigned int s = 0; s < pathBSDF.count; ++s)
+		{
+			unsigned int i = queue[groupStart + s];
+			bouncePDF[i] = 0.0f;
+			vec3 I = pathBSDF.Incident(s);
+			vec3 normal = pathBSDF.Normal(s);
+			vec3 errorMargin = normal * INTERSECTION_ERROR_MARGIN;
+
+			float cos2t = pathBSDF.cos2t[s];
+			if (cos2t < 0.0f)
+			{
+				rays[i] = Ray(shadePoints[s] + errorMargin, pathBSDF.Outgoing(s));
+				continue;
+			}
+
+			vec3 tdir = Material::TransmittedDirection(I, normal, pathBSDF.eta[s], cos2t);
+			float R = pathBSDF.result[s];
+
+			double P = .25 + .5 * R;
+			if (uniformGenerator.RandomDouble() < P)
+			{
+				importance[i] *= R / P;
+				rays[i] = Ray(shadePoints[s] + errorMargin, pathBSDF.Outgoing(s));
+			}
+			else
+			{
+				importance[i] *= (1.0 - R) / (1.0 - P);
+				rays[i] = Ray(shadePoints[s] - errorMargin, tdir);
+			}
+		}
+	}
+}
+
+void WavefrontIntegrator::TraceShadowRays(ColorDbl* radiance)
+{
+	scene.OccludedRays(shadowRays.data(), shadowDistances.data(), (unsigned int)shadowRays.size());
+	for (unsigned int i = 0; i < shadowRays.size(); ++i)
+	{
+		if (shadowDistances[i] >= 0.0f)
+		{
+			radiance[shadowOutputIndex[i]] += shadowContributions[i];
+		}
+	}
+}
+
+// Moves the live paths to the front, in their previous order
+void WavefrontIntegrator::Compact()
+{
+	unsigned int liveCount = 0;
+	for (unsigned int i = 0; i < pathCount; ++i)
+	{
+		if (!alive[i]) continue;
+
+		if (liveCount != i)
+		{
+			rays[liveCount] = rays[i];
+			importance[liveCount] = importance[i];
+			bouncePDF[liveCount] = bouncePDF[i];
+			outputIndex[liveCount] = outputIndex[i];
+			alive[liveCount] = 1;
+		}
+		++liveCount;
+	}
+	pathCount = liveCount;
+}
@@ -0,0 +1,78 @@
+/*
+	Copyright Denny Lindberg and Molly Middagsfjell 2018
+*/
+
+#pragma once
+#include "scene.h"
+#include "core/ray.h"
+#include "core/material.h"
+#include "core/bsdf.h"
+#include "core/randomization.h"
+
+#include <vector>
+
+#define WAVEFRONT_DEFAULT_PATH_COUNT 4096
+
+/*
+	Path tracer which advances a whole pool of paths one bounce at a time instead of following one path
+	to its end. Every bounce runs in stages over all paths still alive:
+		extend:  closest hits of all path rays with one Scene::IntersectRays stream
+		shade:   paths grouped by SurfaceType and then by material, the BRDF, reflection and Fresnel terms of
+		         each group are evaluated in batches by the active kernels, shadow rays are queued
+		shadow:  all queued shadow rays with one Scene::OccludedRays stream
+		compact: terminated paths are removed so the next bounce only touches live paths
+	The path state is kept as separate arrays (structure of arrays) which are reused between calls.
+	Produces the same estimate as Scene::TracePath, one instance per thread.
+*/
+class WavefrontIntegrator
+{
+protected:
+	Scene& scene;
+
+	// Live paths, index i of every array belongs to the same path
+	std::vector<Ray> rays;							// ray to extend
+	std::vector<RayIntersectionInfo> hitInfos;		// closest hit of the ray after the extend stage
+	std::vector<ColorDbl> importance;				// throughput of the path up to the hit
+	std::vector<float> bouncePDF;					// of the diffuse bounce which produced the ray, see Scene::EmittedLight
+	std::vector<unsigned int> outputIndex;			// path index of the caller, radiance is gathered there
+	std::vector<unsigned char> alive;				// cleared by the shade stage when the path terminates
+	unsigned int pathCount = 0;
+
+	std::vector<unsigned int> shadeQueues[int(SurfaceType::COUNT)];	// live paths by surface type of their hit
+
+	// Shadow rays of the current bounce
+	std::vector<Ray> shadowRays;
+	std::vector<float> shadowDistances;				// negative after the shadow stage if occluded
+	std::vector<ColorDbl> shadowContributions;		// light reaching the path if the ray is not occluded
+	std::vector<unsigned int> shadowOutputIndex;
+
+	// Shading of the current material group
+	BSDFBatch shadowBSDF;							// one entry per shadow ray of the group
+	BSDFBatch pathBSDF;								// one entry per path of the group (bounce, reflection or refraction)
+	std::vector<unsigned int> shadePaths;			// path of each pathBSDF entry
+	std::vector<vec3> shadePoints;					// intersection point of each pathBSDF entry
+	std::vector<Ray> bounceRays;
+	std::vector<float> bounceCosines;
+
+	void SortByMaterial(std::vector<unsigned int>& queue) const;
+	size_t MaterialGroupEnd(const std::vector<unsigned int>& queue, size_t groupStart) const;
+
+	void Generate(const Ray* cameraRays, unsigned int count);
+	void Extend();
+	void Classify(ColorDbl* radiance, unsigned int traceDepth);
+	void ShadeDiffuse(UniformRandomGenerator& uniformGenerator);
+	void ShadeSpecular();
+	void ShadeRefractive(UniformRandomGenerator& uniformGenerator);
+	void TraceShadowRays(ColorDbl* radiance);
+	void Compact();
+
+public:
+	WavefrontIntegrator(Scene& scene) : scene{ scene } {}
+	~WavefrontIntegrator() = default;
+
+	/*
+		Traces one path per camera ray, the radiance of the path started by cameraRays[i] is written to radiance[i].
+		Any number of paths can be given, the buffers grow to the largest count.
+	*/
+	void Trace(const Ray* cameraRays, unsigned int count, ColorDbl* radiance, UniformRandomGenerator& uniformGenerator, unsigned int traceDepth = 5);
+};